@@ -0,0 +1,38 @@
+/*
+ * classify.h
+ *
+ * Hashed source classifier for the UDP Packet Repeater
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include "repeater.h"
+
+#define FLOW_CACHE_SETS     128     // Sets in each listener's flow cache (power of 2)
+#define FLOW_CACHE_WAYS     8       // Entries in each set
+#define CLASSIFY_UNIONS_MAX 65536   // Most unions of address and port entries kept by each listener shard
+
+/*
+ * A match_t is what a packet matches on its listener: the route of every map
+ * it matches, in rules order (a route appears once per map). It is computed
+ * once, when the classifier is built, for every source the maps tell apart.
+ */
+typedef struct match_s
+{
+    route_t             **routes;       // Routes to send the packet on
+    int                 num_routes;     // Number of entries in routes
+} match_t;
+
+// Builds a listener's classifier from its maps, once their routes are compiled, emptying its flow cache
+void classifier_build(listener_t *listener);
+
+// Finds what a packet from src_ip:src_port (host byte order) matches on a listener
+const match_t *classifier_match(listener_t *listener, uint32_t src_ip, uint16_t src_port);
+
+#endif
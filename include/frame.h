@@ -0,0 +1,94 @@
+/*
+ * frame.h
+ *
+ * Ethernet/IPv4/UDP frame helpers for the UDP Packet Repeater's raw datapaths
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <net/if.h>
+
+#include "repeater.h"
+
+#define ETH_HEADER_SIZE     14
+#define IP_HEADER_SIZE      20  // Without options
+#define UDP_HEADER_SIZE     8
+#define FRAME_HEADERS_SIZE  (ETH_HEADER_SIZE + IP_HEADER_SIZE + UDP_HEADER_SIZE)
+#define MAC_SIZE            6
+
+/*
+ * The addresses of a network interface, in host byte order
+ */
+typedef struct iface_s
+{
+    char            name[IF_NAMESIZE];
+    int             ifindex;
+    unsigned char   mac[MAC_SIZE];
+    uint32_t        address;        // First IPv4 address
+    uint32_t        netmask;
+    bool            veth;           // A veth device (frames sent from this host carry partial checksums)
+} iface_t;
+
+/*
+ * A UDP datagram found in a frame. Addresses and ports are in host byte order
+ */
+typedef struct udp_info_s
+{
+    uint32_t            src_ip;
+    uint32_t            dst_ip;
+    uint16_t            src_port;
+    uint16_t            dst_port;
+    const unsigned char *payload;
+    size_t              payload_len;
+} udp_info_t;
+
+/*
+ * The headers of the frames sent from one address and port to another, built
+ * once so only the lengths, IP ID and checksums are filled in per frame. The
+ * sums are of the fixed fields each checksum covers.
+ */
+typedef struct frame_template_s
+{
+    unsigned char       headers[FRAME_HEADERS_SIZE];
+    uint32_t            ip_sum;         // IP header without length, ID and checksum
+    uint32_t            udp_sum;        // Pseudo header addresses and protocol, and UDP ports
+} frame_template_t;
+
+// Looks up an interface by name, returns -1 if it doesn't exist or has no IPv4 address
+int frame_get_iface(const char *name, iface_t *iface);
+
+// Finds the MAC address to send to for a destination reached through an interface
+int frame_resolve_mac(const iface_t *iface, uint32_t dest, unsigned char *mac);
+
+// Parses an IPv4 packet (from the IP header) holding a whole, unfragmented UDP datagram
+bool frame_parse_ip(const unsigned char *ip, size_t len, udp_info_t *info);
+
+// Checks the UDP checksum of a parsed IPv4 packet
+bool frame_udp_checksum_ok(const unsigned char *ip, const unsigned char *udp, size_t udp_len);
+
+// Checks whether a parsed IPv4 packet's UDP checksum is only partial (left for offload)
+bool frame_udp_checksum_partial(const unsigned char *ip, const unsigned char *udp, size_t udp_len);
+
+// Writes Ethernet, IPv4 and UDP headers (with checksums) in front of a payload
+void frame_write_headers(unsigned char *frame, const unsigned char *src_mac, const unsigned char *dst_mac,
+        uint32_t src_ip, uint16_t src_port, uint32_t dst_ip, uint16_t dst_port,
+        size_t payload_len, uint16_t ip_id);
+
+// Builds the headers of the frames from one address and port to another
+void frame_init_template(frame_template_t *tmpl, const unsigned char *src_mac, const unsigned char *dst_mac,
+        uint32_t src_ip, uint16_t src_port, uint32_t dst_ip, uint16_t dst_port);
+
+// Writes a template's headers in front of a payload, filling in the lengths, IP ID and checksums
+void frame_fill_headers(unsigned char *frame, const frame_template_t *tmpl, size_t payload_len,
+        uint32_t payload_sum, uint16_t ip_id);
+
+// Sums a payload for frame_fill_headers()
+uint32_t frame_payload_sum(const void *payload, size_t len);
+
+#endif
@@ -23,4 +23,6 @@ void parse_listener(json_value *value);
 void parse_transmitter(json_value *value);
 void parse_target(json_value *value);
 void parse_map(json_value *value);
+void parse_options(json_value *value);
+int parse_int(json_value *value, const char *name);
 #endif
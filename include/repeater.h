@@ -14,25 +14,174 @@
 #ifndef REPEATER_H
 #define REPEATER_H
 
+#include <netinet/in.h>
+
 #include "uthash.h"
 
-#define MAX_FDS             256                 // Upper bound for socket fd value
+#define MAX_EVENTS          64                  // Upper bound for events returned per epoll_wait()
 #define SOCKET_RECV_BUFFER  5 * 1024 * 1024     // 5MB Receive Buffer
 #define SOCKET_SEND_BUFFER  5 * 1024 * 1024     // 5MB Send Buffer
 #define BUFFER_SIZE         65507               // Size of the max UDP payload to receive (bytes) (65535-20(IP)-8(UDP))
+#define DEFAULT_MAX_PAYLOAD 1472                // Listener payload size unless configured (bytes) (1500(MTU)-20(IP)-8(UDP))
+#define CACHE_LINE_SIZE     64                  // Packet buffer slots are aligned to this (bytes)
+#define MAX_RECV_BATCH      256                 // Upper bound for packets read per recvmmsg() call
+#define DEFAULT_RECV_BATCH  32                  // Packets read per recvmmsg() call unless configured
+#define DEFAULT_FD_BUDGET   256                 // Packets handled per ready socket per wakeup unless configured
+#define MAX_SHARDS          64                  // Upper bound for SO_REUSEPORT sockets (and threads) per listener
+#define SEND_BATCH          256                 // Datagrams queued per transmitter socket before a sendmmsg() call
+#define GSO_MAX_SEGMENTS    64                  // Upper bound for datagrams sent as one UDP_SEGMENT buffer
+#define DEFAULT_SPIN_IDLE   100000              // Time a low-latency worker spins after its last packet unless configured (us)
+#define DEFAULT_SEND_QUEUE  64                  // Datagrams held per target while its socket is full unless configured
+#define MAX_SEND_QUEUE      65536               // Upper bound for datagrams held per target
+#define SEND_RETRY          1                   // Time between sends to a full socket, without EPOLLOUT (ms)
+#define ZEROCOPY_BUFS       256                 // Extra pool buffers per worker that zerocopy sends may keep
+#define ZEROCOPY_SENDS      1024                // Upper bound for zerocopy sends in flight per transmitter socket
+#define ZEROCOPY_PINS       4096                // Upper bound for buffers those sends hold, counted once per send
+#define PACE_TICK           100                 // Time covered by each slot of a worker's pacing timer wheel (us)
+#define PACE_SLOTS          1024                // Slots in a worker's pacing timer wheel
+#define TXTIME_HORIZON      100                 // Furthest ahead a datagram is scheduled with SO_TXTIME (ms)
+#define MAX_TX_THREADS      16                  // Upper bound for transmit threads
+#define TX_THREAD_QUEUE     256                 // Datagrams queued from each worker to each transmit thread (power of 2)
 
 typedef enum {false, true} bool;
 
+/*
+ * The type of socket behind an epoll event. Every struct registered with
+ * epoll starts with one of these, so data.ptr can be told apart.
+ */
+typedef enum {SOCKET_LISTENER, SOCKET_TRANSMITTER, SOCKET_XSK, SOCKET_PACER} socket_type_t;
+
+/*
+ * The engine that receives and forwards packets
+ */
+typedef enum {ENGINE_EPOLL, ENGINE_IO_URING} engine_t;
+
+/*
+ * How a listener receives its packets: from its UDP socket, from an AF_PACKET
+ * (TPACKET_V3) ring capturing its port, or from an AF_XDP socket on its
+ * interface
+ */
+typedef enum {INGEST_SOCKET, INGEST_TPACKET, INGEST_XDP} ingest_t;
+
+/*
+ * How a transmitter sends its packets: through its UDP socket, or as whole
+ * frames written to an AF_PACKET (PACKET_TX_RING) ring on its interface
+ */
+typedef enum {EGRESS_SOCKET, EGRESS_TPACKET} egress_t;
+
+/*
+ * Which datagram a target's send queue drops when it is full: the one being
+ * queued, or the oldest one queued
+ */
+typedef enum {DROP_NEWEST, DROP_OLDEST} drop_policy_t;
+
+/*
+ * How the packets to a target with a rate cap are spaced out: held by the
+ * worker until their time comes, or handed to the kernel at once with their
+ * send time (SO_TXTIME), for the fq qdisc to hold
+ */
+typedef enum {PACING_TIMER, PACING_TXTIME} pacing_t;
+
+/*
+ * How the XDP program of the AF_XDP datapath is attached: generic (works on
+ * any interface, including veth) or in the driver
+ */
+typedef enum {XDP_MODE_SKB, XDP_MODE_NATIVE} xdp_mode_t;
+
+/*
+ * A listener_t holds the state for one listening socket, and is what the epoll
+ * event for the socket points at. Several sockets may share a listener ID,
+ * including the shards of a sharded listener, one per worker thread.
+ *
+ * The maps for the listener ID are copied into an array of its own when the
+ * repeater starts, so packets are only compared against their own listener's
+ * rules, which sit next to each other in memory. Those are then sorted into
+ * a classifier, so a packet takes a few hash lookups rather than a scan.
+ *
+ * Listeners are stored in a linked list
+ */
+typedef struct listener_s
+{
+    socket_type_t       type;               // Always SOCKET_LISTENER
+    int                 id;                 // ID from the rules file
+    int                 sockfd;             // Socket file descriptor
+    uint32_t            address;            // Address the socket is bound to (0 for any)
+    uint16_t            port;               // Port the socket is bound to
+    int                 shard;              // Shard index, and the worker thread serving it
+    int                 max_payload;        // Largest payload expected, sizes the receive slots (bytes)
+    bool                gro;                // UDP_GRO is enabled on the socket
+    ingest_t            ingest;             // Where packets are received from
+    int                 busy_poll;          // Low-latency mode: SO_BUSY_POLL time (us, 0 to only spin), -1 if off
+    char                *interface;         // Interface name (INGEST_XDP, and multicast groups)
+    uint32_t            *sources;           // Sources the multicast group is joined for (first shard only)
+    int                 num_sources;        // Number of entries in sources, 0 for any source
+    struct tpacket_ring_s *ring;            // Capture ring (INGEST_TPACKET only)
+    struct map_s        *maps;              // Copies of the maps belonging to this listener, in rules order
+    int                 num_maps;           // Number of entries in maps
+    struct classifier_s *classifier;        // The maps sorted into hash tiers by source, for matching packets
+    unsigned long       packets_received;   // Counters
+    unsigned long       packets_jumbo;
+    unsigned long       packets_forwarded;
+    unsigned long       packets_bad_checksum;   // Dropped by INGEST_XDP for a bad UDP checksum
+    unsigned long       flow_hits;          // Packets matched from the flow cache
+    unsigned long       flow_misses;        // Packets matched by the classifier's tables
+    bool                ready;              // On the ready list
+    struct listener_s   *next_ready;        // Used for storing listeners in the ready list
+    struct listener_s   *next_listener;     // Used for storing listeners in linked list
+} listener_t;
+
+/*
+ * A pktbuf_t is one buffer of the preallocated packet pool.
+ *
+ * Packets are received into the right-sized slot. A packet longer than the
+ * listener's max_payload runs over into the spill region, and is then made
+ * contiguous there. A packet coalesced by UDP_GRO holds several datagrams of
+ * gso_size bytes (the last may be shorter).
+ */
+typedef struct pktbuf_s
+{
+    char            *slot;          // Slot in the pool's hot arena
+    char            *spill;         // BUFFER_SIZE region in the pool's jumbo arena
+    char            *data;          // Start of the received packet (slot or spill)
+    size_t          len;            // Length of the received packet (bytes)
+    size_t          gso_size;       // Size of each coalesced datagram (0 if not coalesced)
+    int             refs;           // Zerocopy sends and transmit thread queue entries holding it
+    int             thread_refs;    // Of those, the transmit thread queue entries
+    struct pktbuf_s *next;          // Used for storing free buffers in a linked list
+} pktbuf_t;
+
 /*
  * A transmitter_t is used to map the arbitrary transmitter ID from the rules
  * file to a socket file descriptor.
  *
+ * Each worker has its own copy, with its own batch of datagrams queued for the
+ * socket. A connected target gets a transmitter of its own, which isn't in the
+ * hash table. Copies of a zerocopy transmitter have their own sockets, so each
+ * worker gets only its own completion notifications, and copies of a
+ * transmitter with tpacket egress have their own send rings.
+ *
  * Transmitters are stored in a hash table by their ID (which muct be unique)
  */
 typedef struct transmitter_s
 {
+    socket_type_t   type;       // Always SOCKET_TRANSMITTER
     int             id;         // ID (key for hash), must be unique
     int             sockfd;     // Socket file descriptor
+    char            *interface; // Interface to send from with AF_XDP or the send ring, or NULL
+    egress_t        egress;     // How packets are sent
+    struct tpacket_tx_s *ring;  // Send ring (each worker has its own), or NULL
+    bool            connected;  // The socket is connected to its one target, so sends carry no address
+    size_t          zerocopy;   // Smallest message sent with MSG_ZEROCOPY (bytes), 0 if off
+    struct zerocopy_s *zc;      // Zerocopy sends in flight on the socket
+    bool            registered; // The socket is registered with its worker's epoll instance
+    bool            multicast;  // Sends to a multicast group, so its sockets get the options below
+    int             multicast_ttl;  // IP_MULTICAST_TTL
+    bool            multicast_loop; // IP_MULTICAST_LOOP
+    struct send_batch_s *batch; // Datagrams queued for the next sendmmsg() call
+    struct transmitter_s *next_flush;   // Used for storing transmitters with queued datagrams in a list
+    struct target_s *blocked;   // Targets with datagrams held until the socket is writable
+    bool            writable;   // EPOLLOUT arrived since the held datagrams were last sent
+    struct transmitter_s *next_blocked; // Used for storing transmitters with held datagrams in a list
     UT_hash_handle  hh;         // Used for storing in hash table
 } transmitter_t;
 
@@ -41,6 +190,9 @@ typedef struct transmitter_s
  * packets should be forwarded, as well as a reference to the transmitter
  * (socket) that should be used to send these packets
  *
+ * A target given a transmit thread is sent to by that thread; the workers
+ * only queue its packets for it.
+ *
  * Targets are stored in a hash table by their ID (which must be unique)
  */
 typedef struct target_s
@@ -49,25 +201,70 @@ typedef struct target_s
     uint32_t        address;        // dst IP of the forwarded packet
     uint16_t        port;           // dst port of the forwarded packet
     int             transmitter_id; // ID of the transmitter_t to use for the export
+    bool            no_gso;         // Coalesced packets must be split before sending
+    bool            connect;        // Sent to through a socket of its own, connected to it
+    struct transmitter_s *connected;    // That socket's transmitter (each worker has a copy), or NULL
+    int             send_tail;      // Last datagram queued for it in its transmitter's send batch, or -1
+    int             queue_length;   // Datagrams held while the socket is full
+    drop_policy_t   drop_policy;    // Datagram dropped when they don't fit
+    struct send_queue_s *queue;     // Datagrams held (each worker has its own)
+    struct target_s *next_blocked;  // Used for storing targets with held datagrams in a list
+    bool            paced;          // Has a rate cap
+    int             max_pps;        // Packets sent to it per second (per worker), 0 for no cap
+    int             max_bps;        // Payload bytes sent to it per second (per worker), 0 for no cap
+    pacing_t        pacing;         // How its packets are spaced out
+    uint64_t        pace_next;      // Earliest time its next packet may go (ns, CLOCK_MONOTONIC)
+    uint64_t        pace_tick;      // Pacing wheel tick it is waiting for
+    struct transmitter_s *sender;   // The worker's transmitter it is sent through
+    struct target_s *next_paced;    // Used for storing targets waiting in a pacing wheel slot
+    unsigned long   packets_queued; // Counters
+    unsigned long   packets_dropped;
+    struct xdp_path_s *xdp;         // Sending through AF_XDP, or NULL
+    struct tpacket_path_s *ring_path;   // Sending through its transmitter's send ring (each worker has its own), or NULL
+    int             thread;         // Transmit thread sending to it, 0 if sent by the workers
+    struct tx_queue_s *tx_queue;    // The worker's queue to that thread (each worker has its own), or NULL
+    struct tx_route_s *tx_route;    // How that thread sends to it
     UT_hash_handle  hh;             // Used for storing in hash table
 } target_t;
 
+/*
+ * A route_t is a target compiled for the forwarding path once the config has
+ * been verified: the target, its transmitter and a prebuilt destination
+ * address. Each worker has a flat array of them, one per target, and every map
+ * points at its target's entry in the array of the worker serving it, so
+ * sending a packet takes no hash lookups.
+ */
+typedef struct route_s
+{
+    int                 sockfd;         // Socket file descriptor of the transmitter
+    struct sockaddr_in  dest_addr;      // dst address and port of the forwarded packet
+    transmitter_t       *transmitter;   // The worker's copy of the transmitter
+    target_t            *target;        // The worker's copy of the target
+} route_t;
+
 /*
  * Map used to match incoming packets and determine where to forward them.
  *
  * Packets recevied will be matched on listener_id (incoming socket),
- * src address, and src port (with 0 as wildcard). Packets are forwarded using
+ * src address prefix (a prefix_len of 0 as wildcard), and src port range
+ * (a port of 0 as wildcard). Packets are forwarded using
  * the socket and destination address and port determined by the target_t
  *
- * Maps are stored in a linked list that is traversed for every packet
- * received. Packets can match more than one map.
+ * Maps are stored in a linked list as they are created. When the repeater
+ * starts, each listener gets an array of its own maps, compiled into the
+ * listener's classifier (see classify.h), which finds the routes of every map
+ * a packet's source matches without going through the maps. Packets can
+ * match more than one map.
  */
 typedef struct map_s
 {
     int             listener_id;    // ID of the listener the packet arrived on
-    uint32_t        address;        // src address of packet
-    uint16_t        port;           // src port of packet (0 = wildcard)
+    uint32_t        address;        // src address of packet, or its prefix (any address if prefix_len is 0)
+    int             prefix_len;     // Leading bits of address matched (0 for a wildcard, 32 for one address)
+    uint16_t        port;           // src port of packet, or first of a range (0 = wildcard)
+    uint16_t        port_last;      // Last src port matched (port for one port, 0 with a wildcard)
     int             target_id;      // The target to use to send a matching packet
+    route_t         *route;         // Compiled target, set when the repeater starts
     struct map_s    *next_map;      // Used for storing maps in linked list
 } map_t;
 
@@ -79,9 +276,38 @@ void create_listener(int id, uint32_t address, uint16_t port);
 void create_transmitter(int id, uint32_t address, uint16_t port);
 void create_target(int id, uint32_t address, uint16_t port, int transmitter_id);
 void create_map(int listener_id, uint32_t src_address, uint16_t src_port, int target_id);
+void create_map_prefix(int listener_id, uint32_t src_address, int prefix_len, uint16_t src_port, int target_id);
+void create_map_range(int listener_id, uint32_t src_address, int prefix_len, uint16_t port_first, uint16_t port_last, int target_id);
+
+// Functions for tuning the repeater
+void set_recv_batch(int size);
+void set_fd_budget(int budget);
+void set_listener_max_payload(int id, int max_payload);
+void set_listener_shards(int id, int shards);
+void set_listener_ingest(int id, ingest_t ingest);
+void set_listener_interface(int id, const char *interface);
+void add_listener_source(int id, uint32_t source);
+void set_transmitter_interface(int id, const char *interface);
+void set_transmitter_zerocopy(int id, int threshold);
+void set_transmitter_multicast(int id, int ttl, bool loop);
+void set_transmitter_egress(int id, egress_t egress);
+void set_target_connect(int id, bool connect);
+void set_target_queue(int id, int length, drop_policy_t policy);
+void set_target_rate(int id, int max_pps, int max_bps, pacing_t pacing);
+void set_target_thread(int id, int thread);
+void set_xdp_mode(xdp_mode_t mode);
+void set_listener_busy_poll(int id, int busy_poll_us);
+void set_busy_poll(int busy_poll_us);
+void set_spin_idle(int idle_us);
+void set_worker_cpu(int worker, int cpu);
+void set_engine(engine_t e);
+
+// Sends a datagram through a target's socket (or send queue) for the AF_XDP datapath
+void send_datagram(const route_t *route, listener_t *listener, const void *buf, size_t len);
 
 // Functions for printing the internal data structures
 void print_maps(void);
+void print_listeners(void);
 void print_transmitters(void);
 void print_targets(void);
 
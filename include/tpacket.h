@@ -0,0 +1,108 @@
+/*
+ * tpacket.h
+ *
+ * AF_PACKET ring ingest (TPACKET_V3) and egress (TPACKET_V2 PACKET_TX_RING)
+ * for the UDP Packet Repeater
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#ifndef TPACKET_H
+#define TPACKET_H
+
+#include <time.h>
+#include <linux/if_packet.h>
+
+#include "frame.h"
+#include "repeater.h"
+
+#define TPACKET_BLOCK_SIZE  (1 << 20)   // Size of each ring block (bytes, power of 2 pages)
+#define TPACKET_BLOCK_NR    32          // Number of blocks in each ring
+#define TPACKET_FRAME_SIZE  2048        // Nominal frame size given to the kernel (bytes)
+#define TPACKET_BLOCK_TOV   1           // Time before a partly filled block is handed over (ms)
+#define TPACKET_TX_FRAME_SIZE   2048    // Size of each send ring frame (bytes, power of 2)
+#define TPACKET_TX_FRAME_NR     1024    // Number of frames in each send ring
+#define TPACKET_TX_BLOCK_SIZE   (1 << 16)   // Size of each send ring block (bytes, power of 2 pages)
+#define TPACKET_RESOLVE_RETRY   1       // Time between MAC address lookups for an unresolved target (s)
+#define TPACKET_RESOLVE_REFRESH 30      // Time between MAC address lookups for a resolved target (s)
+
+/*
+ * A tpacket_ring_t is the capture ring of one listener socket, along with how
+ * far the repeater has read it. Blocks are walked in order; a block goes back
+ * to the kernel once every frame in it has been read.
+ */
+typedef struct tpacket_ring_s
+{
+    int                 fd;             // AF_PACKET socket file descriptor
+    char                *map;           // The mmap'd ring
+    size_t              map_len;        // Length of the mmap'd ring (bytes)
+    unsigned int        block;          // Block being read
+    unsigned int        frames_left;    // Frames not yet read in the block (0 if none started)
+    struct tpacket3_hdr *frame;         // Next frame to read in the block
+} tpacket_ring_t;
+
+/*
+ * A tpacket_tx_t is the PACKET_TX_RING of one of a worker's transmitters,
+ * sending whole frames out of one interface. Frames are filled in order, and
+ * the kernel is asked to send every filled frame at once.
+ */
+typedef struct tpacket_tx_s
+{
+    int                 fd;             // AF_PACKET socket file descriptor
+    char                *map;           // The mmap'd ring
+    size_t              map_len;        // Length of the mmap'd ring (bytes)
+    iface_t             iface;          // Interface the frames are sent from
+    size_t              max_payload;    // Largest payload that fits in a frame and the MTU (bytes)
+    unsigned int        frame;          // Next frame to fill
+    unsigned int        pending;        // Frames filled since the kernel was last asked to send
+    uint16_t            ip_id;          // IP ID of the next frame
+} tpacket_tx_t;
+
+/*
+ * A tpacket_path_t is how one of a worker's targets is sent to through its
+ * transmitter's ring: the headers of its frames, built once, and whether the
+ * MAC address of the next hop is known. Until it is, the target is sent to
+ * through the transmitter's socket, which makes the kernel resolve it.
+ */
+typedef struct tpacket_path_s
+{
+    frame_template_t    headers;        // Ethernet, IPv4 and UDP headers, without lengths and checksums
+    uint32_t            dst_ip;         // Destination address (host byte order)
+    bool                resolved;       // The destination MAC address in headers is known
+    time_t              next_resolve;   // Earliest time to look it up again
+} tpacket_path_t;
+
+// Opens a ring capturing the UDP datagrams sent to address:port (host byte order)
+void tpacket_open(tpacket_ring_t *ring, uint32_t address, uint16_t port, int *fanout_id);
+
+// Steps to the next UDP datagram in the ring, returns false once the ring is empty
+bool tpacket_next(tpacket_ring_t *ring, const char **payload, size_t *len,
+        uint32_t *src_ip, uint16_t *src_port);
+
+// Makes a UDP socket drop everything, for listeners that receive through a ring
+void tpacket_mute_socket(int sockfd);
+
+// Opens a send ring on an interface, returns -1 if it can't be used
+int tpacket_open_tx(tpacket_tx_t *tx, const char *interface);
+
+// Builds the frame headers for a target sent to through a send ring (host byte order)
+void tpacket_init_path(const tpacket_tx_t *tx, tpacket_path_t *path, uint32_t src_ip, uint16_t src_port,
+        uint32_t dst_ip, uint16_t dst_port);
+
+// Checks whether a path's next hop MAC address is known, looking it up when due
+bool tpacket_path_ready(const tpacket_tx_t *tx, tpacket_path_t *path);
+
+// Checks that the next count frames of a send ring are free
+bool tpacket_tx_room(const tpacket_tx_t *tx, unsigned int count);
+
+// Fills the next frame of a send ring with a datagram, returns false if the ring is full
+bool tpacket_tx_frame(tpacket_tx_t *tx, const tpacket_path_t *path, const void *payload, size_t len,
+        uint32_t payload_sum);
+
+// Asks the kernel to send every filled frame of a send ring
+void tpacket_tx_kick(tpacket_tx_t *tx);
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * uring.h
+ *
+ * io_uring engine for the UDP Packet Repeater
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "repeater.h"
+
+#define URING_MAX_BUFS      256     // Upper bound for provided receive buffers (power of 2)
+#define URING_MIN_BUFS      16      // Lower bound for provided receive buffers (power of 2)
+#define URING_MAX_SENDS     65536   // Upper bound for sends in flight (sizes the buffer count)
+#define URING_MIN_ENTRIES   256     // Lower bound for submission queue entries
+#define URING_MAX_ENTRIES   32768   // Upper bound for submission queue entries (kernel limit)
+
+// Runs the io_uring engine. Only returns (with -1) if io_uring can't be used
+int run_uring_engine(listener_t *listeners, transmitter_t *transmitters);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * xdp.h
+ *
+ * AF_XDP datapath for the UDP Packet Repeater
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#ifndef XDP_H
+#define XDP_H
+
+#include <time.h>
+
+#include "frame.h"
+#include "repeater.h"
+
+#define XDP_NUM_FRAMES      4096    // Frames in the shared UMEM
+#define XDP_FRAME_SIZE      2048    // Size of each UMEM frame (bytes, power of 2)
+#define XDP_RING_SIZE       1024    // Entries in each fill, completion, RX and TX ring (power of 2)
+#define XDP_RESOLVE_RETRY   1       // Time between MAC address lookups for an unresolved target (s)
+
+/*
+ * How a target is sent to through the XSK of its transmitter's interface.
+ * Until the MAC address of the next hop is known, packets for the target go
+ * through the transmitter's socket, which makes the kernel resolve it.
+ */
+typedef struct xdp_path_s
+{
+    struct xsk_s    *xsk;           // XSK of the transmitter's interface
+    uint32_t        src_ip;         // Addresses and ports of the sent frames (host byte order)
+    uint16_t        src_port;
+    uint32_t        dst_ip;
+    uint16_t        dst_port;
+    unsigned char   dst_mac[MAC_SIZE];
+    bool            resolved;       // dst_mac is known
+    time_t          next_resolve;   // Earliest time to look dst_mac up again
+} xdp_path_t;
+
+// Sets up the XSKs, UMEM and XDP programs. Returns -1 (with nothing left set up) if AF_XDP can't be used
+int xdp_init(listener_t *listeners, transmitter_t *transmitters, target_t *targets, xdp_mode_t mode);
+
+// Registers every XSK with an epoll instance, edge-triggered
+void xdp_register(int epoll_fd);
+
+// Forwards up to budget frames from every XSK, returns true if any has more to receive or send
+bool xdp_poll(int budget);
+
+#endif
@@ -0,0 +1,670 @@
+/*
+ * classify.c
+ *
+ * Hashed source classifier for the UDP Packet Repeater
+ *
+ * A map matches a source address prefix (CIDR, a wildcard being the 0-bit
+ * prefix and one address the 32-bit prefix) and a source port range (one
+ * port being a range of one, and a wildcard (0) every port). Rather than
+ * comparing a packet with every one of its listener's maps, the maps are
+ * sorted into four tiers when the repeater starts, each a hash table except
+ * the last:
+ *
+ *   (prefix, ports)    every prefix and port range in the maps
+ *   (prefix, *)        every prefix in a map with a wildcard port
+ *   (*, ports)         every port range in a map with a wildcard address
+ *   (*, *)             the maps with both wildcards
+ *
+ * The prefixes of the maps are either nested or apart, so the ones a source
+ * address falls in are the longest of them and the prefixes around it. The
+ * first two tiers are keyed by that longest prefix, which is looked up in a
+ * multibit trie: a tree of 256-slot nodes taking the address 8 bits at a
+ * time (the DIR-24-8 idea, with strides small enough to give each listener
+ * shard its own). Every slot holds the longest prefix covering it, so the
+ * lookup is at most four array reads, however many prefixes there are.
+ *
+ * Port ranges may overlap, so they are cut at every port one of them starts
+ * at or ends before, into ranges that each lie wholly in or out of every map
+ * range. A source port's range is found by a binary search of the ports they
+ * start at, and keys the tiers in place of the port, so a map for a thousand
+ * ports takes one entry, not a thousand.
+ *
+ * Each entry holds everything a packet from that source matches, across all
+ * four tiers, in rules order, so a packet mostly takes the entry of the most
+ * specific tier holding its source. The exception is a source in both the
+ * second and third tiers but not the first, which needs the maps of both.
+ * Making those unions up front would take an entry for every prefix of the
+ * second tier and range of the third, so they are made the first time such
+ * a source is looked up instead, and kept in a table of their own. When it
+ * holds CLASSIFY_UNIONS_MAX, it is emptied, along with the flow cache that
+ * may point into it, and refilled as sources come.
+ *
+ * Building the classifier scans every map for each entry it makes. The
+ * second and third tiers have an entry for each prefix and port range, and
+ * the first an entry for each prefix and range inside those of a map naming
+ * both; when no prefixes nest and no ranges overlap, that is an entry per
+ * map, so building takes time quadratic in the maps, on every listener
+ * shard. A union costs the same scan of the maps when it is first made.
+ *
+ * In front of the tiers is a flow cache of the sources seen lately, so the
+ * packets of a long-lived flow take one lookup in a small array instead. It
+ * is set-associative: a source can only go in the FLOW_CACHE_WAYS entries of
+ * the set it hashes to, and when they are all taken, a clock over the set
+ * evicts the first entry that hasn't been hit since the clock last passed
+ * it. The cache is part of the classifier, so it starts empty every time the
+ * classifier is built, and never outlives the rules it was filled from.
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "classify.h"
+
+#define LPM_CHILD       0x80000000u     // Set in a trie slot holding the index of a child node
+
+/*
+ * An entry of one of the hash tiers of a classifier
+ */
+typedef struct source_s
+{
+    uint64_t            key;            // Prefix number << 32 | port range number, with the tier's wildcards left 0
+    match_t             match;          // What a packet from the source matches
+    UT_hash_handle      hh;             // Used for storing in hash table
+} source_t;
+
+/*
+ * A source address prefix of the maps
+ */
+typedef struct prefix_s
+{
+    uint32_t            address;        // Prefix, with the bits past it 0
+    int                 len;            // Number of bits in the prefix (1 to 32)
+} prefix_t;
+
+/*
+ * A node of the longest prefix match trie, for 8 bits of the address. Each
+ * slot holds the number of the longest prefix covering it (0 for none), or
+ * LPM_CHILD | the index of the node for the next 8 bits.
+ */
+typedef struct lpm_node_s
+{
+    uint32_t            slots[256];
+} lpm_node_t;
+
+/*
+ * One set of a flow cache
+ */
+typedef struct flow_set_s
+{
+    uint64_t            keys[FLOW_CACHE_WAYS];      // Source address << 16 | port
+    const match_t       *matches[FLOW_CACHE_WAYS];  // What the source matches, or NULL if the entry is free
+    uint8_t             referenced;                 // Bit per entry, set when it is hit
+    uint8_t             hand;                       // Next entry the clock looks at
+} flow_set_t;
+
+/*
+ * A classifier_t is one listener shard's maps sorted into the four tiers,
+ * with its prefix trie and flow cache. Each shard has its own, pointing at
+ * its own worker's routes, and only the thread serving the shard uses it.
+ */
+typedef struct classifier_s
+{
+    prefix_t            *prefixes;      // Distinct prefixes of the maps, shortest first, numbered from 1
+    int                 num_prefixes;   // Number of entries in prefixes
+    lpm_node_t          *nodes;         // Prefix trie, rooted at the first node, or NULL if there are no prefixes
+    int                 num_nodes;      // Number of nodes in use
+    int                 max_nodes;      // Number of nodes allocated
+    uint16_t            *port_starts;   // First port of each port range, ascending, numbered from 1
+    int                 num_port_ranges; // Number of entries in port_starts
+    source_t            *pairs;         // (prefix, ports) tier
+    source_t            *addresses;     // (prefix, *) tier
+    source_t            *ports;         // (*, ports) tier
+    source_t            *unions;        // Unions of (prefix, *) and (*, ports) entries made so far
+    int                 num_unions;     // Number of entries in unions
+    match_t             any;            // (*, *) tier
+    bool                cached;         // Some hash tier has entries, so the flow cache is used
+    flow_set_t          flows[FLOW_CACHE_SETS]; // Flow cache
+} classifier_t;
+
+static void find_prefixes(classifier_t *classifier, const listener_t *listener);
+static int compare_prefixes(const void *a, const void *b);
+static void find_port_ranges(classifier_t *classifier, const listener_t *listener);
+static int compare_ports(const void *a, const void *b);
+static uint32_t port_range(const classifier_t *classifier, uint16_t port);
+static void add_port_ranges(const listener_t *listener, source_t **tier, uint32_t prefix, const map_t *map);
+static void lpm_insert(classifier_t *classifier, const prefix_t *prefix, uint32_t number);
+static uint32_t lpm_add_node(classifier_t *classifier, uint32_t number);
+static uint32_t lpm_lookup(const classifier_t *classifier, uint32_t address);
+static const match_t *match_tiers(listener_t *listener, uint32_t src_ip, uint16_t src_port);
+static const match_t *match_union(listener_t *listener, uint32_t prefix, uint32_t ports);
+static void cache_flow(flow_set_t *set, uint64_t key, const match_t *match);
+static void add_source(const listener_t *listener, source_t **tier, uint32_t prefix, uint32_t ports);
+static void fill_match(const listener_t *listener, match_t *match, uint32_t prefix, uint32_t ports);
+static bool map_matches(const map_t *map, const prefix_t *prefix, uint16_t port);
+
+/**
+ * Builds a listener's classifier from its maps, whose routes must already be
+ * compiled, with an empty flow cache. The prefix trie and port ranges are
+ * found first, then the tiers. Unions of the second and third tiers are left
+ * until they are looked up.
+ *
+ * @param listener  The listener shard to build the classifier of
+ */
+void classifier_build(listener_t *listener)
+{
+    classifier_t    *classifier;
+    map_t           *map;
+
+    classifier = calloc(1, sizeof(classifier_t));
+    if (classifier == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    listener->classifier = classifier;
+
+    find_prefixes(classifier, listener);
+    if (classifier->num_prefixes > 0) {
+        lpm_add_node(classifier, 0);
+        for (int p = 0; p < classifier->num_prefixes; p++) {
+            lpm_insert(classifier, &classifier->prefixes[p], p + 1);
+        }
+    }
+    find_port_ranges(classifier, listener);
+
+    // A prefix takes the maps of the prefixes around it, so any of them may give it an entry
+    for (int p = 0; p < classifier->num_prefixes; p++) {
+        for (int m = 0; m < listener->num_maps; m++) {
+            map = &listener->maps[m];
+            if (map->prefix_len != 0 && map->port == 0 &&
+                    map_matches(map, &classifier->prefixes[p], 0)) {
+                add_source(listener, &classifier->addresses, p + 1, 0);
+                break;
+            }
+        }
+    }
+    for (int m = 0; m < listener->num_maps; m++) {
+        map = &listener->maps[m];
+        if (map->prefix_len == 0 && map->port != 0) {
+            add_port_ranges(listener, &classifier->ports, 0, map);
+        }
+    }
+    for (int p = 0; p < classifier->num_prefixes; p++) {
+        for (int m = 0; m < listener->num_maps; m++) {
+            map = &listener->maps[m];
+            if (map->prefix_len != 0 && map->port != 0 &&
+                    map_matches(map, &classifier->prefixes[p], map->port)) {
+                add_port_ranges(listener, &classifier->pairs, p + 1, map);
+            }
+        }
+    }
+    fill_match(listener, &classifier->any, 0, 0);
+    classifier->cached = (classifier->pairs != NULL || classifier->addresses != NULL ||
+            classifier->ports != NULL);
+}
+
+/**
+ * Finds what a packet matches on a listener, from the flow cache if its
+ * source is there, and otherwise from the tiers, caching the answer. The
+ * listener's flow cache counters are updated. A listener with only (*, *)
+ * maps has nothing to look up, so skips the cache.
+ *
+ * @param listener  The listener shard the packet arrived on
+ * @param src_ip    The source address of the packet (host byte order)
+ * @param src_port  The source port of the packet (host byte order)
+ * @return          The routes to send the packet on (possibly none)
+ */
+const match_t *classifier_match(listener_t *listener, uint32_t src_ip, uint16_t src_port)
+{
+    classifier_t    *classifier = listener->classifier;
+    uint64_t        key = (uint64_t)src_ip << 16 | src_port;
+    flow_set_t      *set;
+    const match_t   *match;
+
+    if (!classifier->cached) {
+        return &classifier->any;
+    }
+
+    // Fibonacci hashing spreads the sources of one subnet over the sets
+    set = &classifier->flows[((key * 0x9E3779B97F4A7C15ULL) >> 32) & (FLOW_CACHE_SETS - 1)];
+    for (int w = 0; w < FLOW_CACHE_WAYS; w++) {
+        if (set->keys[w] == key && set->matches[w] != NULL) {
+            set->referenced |= 1 << w;
+            listener->flow_hits++;
+            return set->matches[w];
+        }
+    }
+
+    listener->flow_misses++;
+    match = match_tiers(listener, src_ip, src_port);
+    cache_flow(set, key, match);
+    return match;
+}
+
+/**
+ * Finds what a source matches in a classifier's tiers, taking the entry of
+ * the most specific tier that holds it, or the union of the second and third
+ * tiers' entries if it is in both
+ *
+ * @param listener      The listener shard whose classifier to look in
+ * @param src_ip        The source address (host byte order)
+ * @param src_port      The source port (host byte order)
+ * @return              The routes to send a packet from the source on
+ */
+static const match_t *match_tiers(listener_t *listener, uint32_t src_ip, uint16_t src_port)
+{
+    classifier_t    *classifier = listener->classifier;
+    source_t        *source = NULL;
+    source_t        *address = NULL;
+    uint32_t        prefix = lpm_lookup(classifier, src_ip);
+    uint32_t        ports = port_range(classifier, src_port);
+    uint64_t        tier_key;
+
+    if (prefix != 0) {
+        if (classifier->pairs != NULL && ports != 0) {
+            tier_key = (uint64_t)prefix << 32 | ports;
+            HASH_FIND(hh, classifier->pairs, &tier_key, sizeof(tier_key), source);
+            if (source != NULL) {
+                return &source->match;
+            }
+        }
+        if (classifier->addresses != NULL) {
+            tier_key = (uint64_t)prefix << 32;
+            HASH_FIND(hh, classifier->addresses, &tier_key, sizeof(tier_key), address);
+        }
+    }
+    if (classifier->ports != NULL && ports != 0) {
+        tier_key = ports;
+        HASH_FIND(hh, classifier->ports, &tier_key, sizeof(tier_key), source);
+        if (source != NULL) {
+            return (address != NULL) ? match_union(listener, prefix, ports) : &source->match;
+        }
+    }
+    if (address != NULL) {
+        return &address->match;
+    }
+    return &classifier->any;
+}
+
+/**
+ * Finds the union of a (prefix, *) entry and a (*, ports) entry, making it if
+ * it hasn't been yet. If the classifier already holds CLASSIFY_UNIONS_MAX,
+ * they are all dropped first, and the flow cache with them.
+ *
+ * @param listener  The listener shard whose classifier to look in
+ * @param prefix    The number of the source's longest prefix
+ * @param ports     The number of the source's port range
+ * @return          The routes to send a packet from the source on
+ */
+static const match_t *match_union(listener_t *listener, uint32_t prefix, uint32_t ports)
+{
+    classifier_t    *classifier = listener->classifier;
+    source_t        *source = NULL;
+    source_t        *next;
+    uint64_t        key = (uint64_t)prefix << 32 | ports;
+
+    HASH_FIND(hh, classifier->unions, &key, sizeof(key), source);
+    if (source != NULL) {
+        return &source->match;
+    }
+    if (classifier->num_unions == CLASSIFY_UNIONS_MAX) {
+        for (source = classifier->unions; source != NULL; source = next) {
+            next = source->hh.next;
+            HASH_DEL(classifier->unions, source);
+            free(source->match.routes);
+            free(source);
+        }
+        classifier->num_unions = 0;
+        memset(classifier->flows, 0, sizeof(classifier->flows));
+    }
+    add_source(listener, &classifier->unions, prefix, ports);
+    classifier->num_unions++;
+    HASH_FIND(hh, classifier->unions, &key, sizeof(key), source);
+    return &source->match;
+}
+
+/**
+ * Puts a source in its flow cache set, in a free entry or in place of the
+ * first one the clock finds that hasn't been hit since it last went by. The
+ * clock clears the hit bit of every entry it passes over, so it stops within
+ * two turns of the set. A new entry starts out unhit, so a source only seen
+ * once is the first to go.
+ *
+ * @param set   The set the source hashes to
+ * @param key   The source address << 16 | port
+ * @param match What the source matches
+ */
+static void cache_flow(flow_set_t *set, uint64_t key, const match_t *match)
+{
+    int w;
+
+    while (1) {
+        w = set->hand;
+        set->hand = (set->hand + 1) % FLOW_CACHE_WAYS;
+        if (set->matches[w] == NULL || !(set->referenced & (1 << w))) {
+            break;
+        }
+        set->referenced &= ~(1 << w);
+    }
+    set->keys[w] = key;
+    set->matches[w] = match;
+}
+
+/**
+ * Adds a source to one of a classifier's hash tiers, unless it is there
+ * already, with everything it matches
+ *
+ * @param listener  The listener shard the classifier belongs to
+ * @param tier      The tier to add it to
+ * @param prefix    The number of the source's longest prefix, or 0 for the (*, ports) tier
+ * @param ports     The number of the source's port range, or 0 for the (prefix, *) tier
+ */
+static void add_source(const listener_t *listener, source_t **tier, uint32_t prefix, uint32_t ports)
+{
+    source_t    *source = NULL;
+    uint64_t    key = (uint64_t)prefix << 32 | ports;
+
+    HASH_FIND(hh, *tier, &key, sizeof(key), source);
+    if (source != NULL) {
+        return;
+    }
+    source = malloc(sizeof(source_t));
+    if (source == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    source->key = key;
+    fill_match(listener, &source->match, prefix, ports);
+    HASH_ADD(hh, *tier, key, sizeof(source->key), source);
+}
+
+/**
+ * Finds the routes of the maps a source matches, in rules order. A 0 prefix
+ * or port range stands for one that no map names, so only the maps with a
+ * wildcard there match it. A port range is matched by its first port, as
+ * each lies wholly in or out of every map's range.
+ *
+ * @param listener  The listener shard whose maps to match
+ * @param match     Filled in with the routes
+ * @param prefix    The number of the source's longest prefix, or 0
+ * @param ports     The number of the source's port range, or 0
+ */
+static void fill_match(const listener_t *listener, match_t *match, uint32_t prefix, uint32_t ports)
+{
+    const classifier_t  *classifier = listener->classifier;
+    const prefix_t      *source_prefix = (prefix != 0) ? &classifier->prefixes[prefix - 1] : NULL;
+    uint16_t            port = (ports != 0) ? classifier->port_starts[ports - 1] : 0;
+    int                 count = 0;
+
+    for (int m = 0; m < listener->num_maps; m++) {
+        if (map_matches(&listener->maps[m], source_prefix, port)) {
+            count++;
+        }
+    }
+    match->routes = malloc((count > 0 ? count : 1) * sizeof(route_t *));
+    if (match->routes == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    match->num_routes = 0;
+    for (int m = 0; m < listener->num_maps; m++) {
+        if (map_matches(&listener->maps[m], source_prefix, port)) {
+            match->routes[match->num_routes++] = listener->maps[m].route;
+        }
+    }
+}
+
+/**
+ * Checks whether a map matches a source
+ *
+ * @param map       The map
+ * @param prefix    The source's longest prefix, or NULL if it has none
+ * @param port      The source port, or 0
+ * @return true if the map's prefix is or is around the source's, or is a
+ *         wildcard, and its port range holds the source's port or is a
+ *         wildcard
+ */
+static bool map_matches(const map_t *map, const prefix_t *prefix, uint16_t port)
+{
+    if (map->port != 0 && (port < map->port || port > map->port_last)) {
+        return false;
+    }
+    if (map->prefix_len == 0) {
+        return true;
+    }
+    return prefix != NULL && map->prefix_len <= prefix->len &&
+            ((prefix->address ^ map->address) & (0xFFFFFFFFu << (32 - map->prefix_len))) == 0;
+}
+
+/**
+ * Fills in a classifier's distinct map prefixes, shortest first, so that a
+ * prefix is inserted into the trie after the prefixes around it
+ *
+ * @param classifier    The classifier to fill in
+ * @param listener      The listener shard whose maps to take the prefixes of
+ */
+static void find_prefixes(classifier_t *classifier, const listener_t *listener)
+{
+    int count = 0;
+
+    classifier->prefixes = malloc((listener->num_maps > 0 ? listener->num_maps : 1) * sizeof(prefix_t));
+    if (classifier->prefixes == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    for (int m = 0; m < listener->num_maps; m++) {
+        if (listener->maps[m].prefix_len != 0) {
+            classifier->prefixes[count].address = listener->maps[m].address;
+            classifier->prefixes[count].len = listener->maps[m].prefix_len;
+            count++;
+        }
+    }
+    qsort(classifier->prefixes, count, sizeof(prefix_t), compare_prefixes);
+    classifier->num_prefixes = 0;
+    for (int p = 0; p < count; p++) {
+        if (classifier->num_prefixes == 0 ||
+                compare_prefixes(&classifier->prefixes[p], &classifier->prefixes[classifier->num_prefixes - 1]) != 0) {
+            classifier->prefixes[classifier->num_prefixes++] = classifier->prefixes[p];
+        }
+    }
+}
+
+/**
+ * Orders prefixes by length, then address, for qsort()
+ */
+static int compare_prefixes(const void *a, const void *b)
+{
+    const prefix_t *pa = a;
+    const prefix_t *pb = b;
+
+    if (pa->len != pb->len) {
+        return (pa->len < pb->len) ? -1 : 1;
+    }
+    if (pa->address != pb->address) {
+        return (pa->address < pb->address) ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Cuts the port ranges of a classifier's maps into ranges that each lie
+ * wholly in or out of every map's, filling in the port each starts at. The
+ * first starts at port 0, and one starts at every map range's first port and
+ * the port after its last, so together they cover every port.
+ *
+ * @param classifier    The classifier to fill in
+ * @param listener      The listener shard whose maps to take the ranges of
+ */
+static void find_port_ranges(classifier_t *classifier, const listener_t *listener)
+{
+    const map_t *map;
+    int         count = 0;
+
+    classifier->port_starts = malloc((2 * listener->num_maps + 1) * sizeof(uint16_t));
+    if (classifier->port_starts == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    classifier->port_starts[count++] = 0;
+    for (int m = 0; m < listener->num_maps; m++) {
+        map = &listener->maps[m];
+        if (map->port != 0) {
+            classifier->port_starts[count++] = map->port;
+            if (map->port_last < 65535) {
+                classifier->port_starts[count++] = map->port_last + 1;
+            }
+        }
+    }
+    qsort(classifier->port_starts, count, sizeof(uint16_t), compare_ports);
+    classifier->num_port_ranges = 0;
+    for (int r = 0; r < count; r++) {
+        if (classifier->num_port_ranges == 0 ||
+                classifier->port_starts[r] != classifier->port_starts[classifier->num_port_ranges - 1]) {
+            classifier->port_starts[classifier->num_port_ranges++] = classifier->port_starts[r];
+        }
+    }
+}
+
+/**
+ * Orders ports, for qsort()
+ */
+static int compare_ports(const void *a, const void *b)
+{
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/**
+ * Finds the port range a source port falls in, by a binary search for the
+ * last range starting at or before it
+ *
+ * @param classifier    The classifier whose port ranges to look in
+ * @param port          The source port (host byte order)
+ * @return              The number of the port range, or 0 if no map has a port
+ */
+static uint32_t port_range(const classifier_t *classifier, uint16_t port)
+{
+    int low = 0;
+    int high = classifier->num_port_ranges;
+    int middle;
+
+    if (classifier->num_port_ranges <= 1) {
+        return 0;
+    }
+    // The first range starts at 0, so the one found is at least the first
+    while (high - low > 1) {
+        middle = (low + high) / 2;
+        if (classifier->port_starts[middle] <= port) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low + 1;
+}
+
+/**
+ * Adds a source to one of a classifier's hash tiers for every port range
+ * inside a map's
+ *
+ * @param listener  The listener shard the classifier belongs to
+ * @param tier      The tier to add to
+ * @param prefix    The number of the source's longest prefix, or 0 for the (*, ports) tier
+ * @param map       The map whose port ranges to add
+ */
+static void add_port_ranges(const listener_t *listener, source_t **tier, uint32_t prefix, const map_t *map)
+{
+    const classifier_t  *classifier = listener->classifier;
+
+    for (uint32_t r = port_range(classifier, map->port);
+            r <= (uint32_t)classifier->num_port_ranges && classifier->port_starts[r - 1] <= map->port_last; r++) {
+        add_source(listener, tier, prefix, r);
+    }
+}
+
+/**
+ * Inserts a prefix into a classifier's trie, setting every slot it covers in
+ * the node of its last 8 bits. Prefixes must be inserted shortest first: a
+ * slot a prefix covers can then have no child yet, and a child made for a
+ * longer prefix later starts out with its parent slot's prefix in every slot.
+ *
+ * @param classifier    The classifier whose trie to insert into
+ * @param prefix        The prefix
+ * @param number        The prefix's number
+ */
+static void lpm_insert(classifier_t *classifier, const prefix_t *prefix, uint32_t number)
+{
+    uint32_t    node = 0;
+    uint32_t    child;
+    int         shift = 24;
+    int         first;
+
+    // Walk down to the node whose 8 bits the prefix ends in
+    while (prefix->len > 32 - shift) {
+        first = (prefix->address >> shift) & 0xFF;
+        if (!(classifier->nodes[node].slots[first] & LPM_CHILD)) {
+            child = lpm_add_node(classifier, classifier->nodes[node].slots[first]);
+            classifier->nodes[node].slots[first] = LPM_CHILD | child;
+        }
+        node = classifier->nodes[node].slots[first] & ~LPM_CHILD;
+        shift -= 8;
+    }
+    first = (prefix->address >> shift) & 0xFF;
+    for (int s = 0; s < 1 << (32 - shift - prefix->len); s++) {
+        classifier->nodes[node].slots[first + s] = number;
+    }
+}
+
+/**
+ * Adds a node to a classifier's trie, growing the array of nodes if needed
+ *
+ * @param classifier    The classifier whose trie to add to
+ * @param number        The prefix number to fill the node's slots with
+ * @return              The index of the node
+ */
+static uint32_t lpm_add_node(classifier_t *classifier, uint32_t number)
+{
+    lpm_node_t  *node;
+
+    if (classifier->num_nodes == classifier->max_nodes) {
+        classifier->max_nodes = (classifier->max_nodes > 0) ? classifier->max_nodes * 2 : 16;
+        classifier->nodes = realloc(classifier->nodes, classifier->max_nodes * sizeof(lpm_node_t));
+        if (classifier->nodes == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+    }
+    node = &classifier->nodes[classifier->num_nodes];
+    for (int s = 0; s < 256; s++) {
+        node->slots[s] = number;
+    }
+    return classifier->num_nodes++;
+}
+
+/**
+ * Finds the longest map prefix a source address falls in
+ *
+ * @param classifier    The classifier whose trie to look in
+ * @param address       The source address (host byte order)
+ * @return              The number of the prefix, or 0 if it is in none
+ */
+static uint32_t lpm_lookup(const classifier_t *classifier, uint32_t address)
+{
+    uint32_t    slot;
+    int         shift = 24;
+
+    if (classifier->nodes == NULL) {
+        return 0;
+    }
+    slot = classifier->nodes[0].slots[address >> shift];
+    while (slot & LPM_CHILD) {
+        shift -= 8;
+        slot = classifier->nodes[slot & ~LPM_CHILD].slots[(address >> shift) & 0xFF];
+    }
+    return slot;
+}
@@ -0,0 +1,425 @@
+/*
+ * frame.c
+ *
+ * Ethernet/IPv4/UDP frame helpers for the UDP Packet Repeater's raw datapaths
+ *
+ * The raw datapaths read and write whole frames, bypassing the socket stack,
+ * so they have to parse, build and checksum the headers themselves, and find
+ * the MAC address of the next hop from the kernel's routing and neighbour
+ * tables.
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#define _GNU_SOURCE     // struct ifreq
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+
+// Static method prototypes
+static uint32_t checksum_add(uint32_t sum, const unsigned char *data, size_t len);
+static uint16_t checksum_fold(uint32_t sum);
+static uint32_t pseudo_header_sum(const unsigned char *ip, size_t udp_len);
+static int next_hop(const iface_t *iface, uint32_t dest, uint32_t *hop);
+
+/**
+ * Looks up the index, MAC address, IPv4 address and netmask of an interface,
+ * and whether it is a veth device
+ *
+ * @param name  The interface name
+ * @param iface Filled with the interface's addresses
+ * @return      0 on success, -1 if the interface doesn't exist or has no IPv4 address
+ */
+int frame_get_iface(const char *name, iface_t *iface)
+{
+    struct ifreq            ifr;
+    struct ethtool_drvinfo  drvinfo;
+    int                     sock;
+    int                     rc = 0;
+
+    memset(iface, 0, sizeof(*iface));
+    if (strlen(name) >= IF_NAMESIZE) {
+        return -1;
+    }
+    strcpy(iface->name, name);
+    iface->ifindex = if_nametoindex(name);
+    if (iface->ifindex == 0) {
+        return -1;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, name);
+    if (ioctl(sock, SIOCGIFHWADDR, &ifr) < 0) {
+        rc = -1;
+    } else {
+        memcpy(iface->mac, ifr.ifr_hwaddr.sa_data, MAC_SIZE);
+    }
+    if (rc == 0 && ioctl(sock, SIOCGIFADDR, &ifr) < 0) {
+        rc = -1;
+    } else if (rc == 0) {
+        iface->address = ntohl(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr);
+    }
+    if (rc == 0 && ioctl(sock, SIOCGIFNETMASK, &ifr) < 0) {
+        rc = -1;
+    } else if (rc == 0) {
+        iface->netmask = ntohl(((struct sockaddr_in *)&ifr.ifr_netmask)->sin_addr.s_addr);
+    }
+    memset(&drvinfo, 0, sizeof(drvinfo));
+    drvinfo.cmd = ETHTOOL_GDRVINFO;
+    ifr.ifr_data = (char *)&drvinfo;
+    if (rc == 0 && ioctl(sock, SIOCETHTOOL, &ifr) == 0) {
+        iface->veth = (strcmp(drvinfo.driver, "veth") == 0);
+    }
+    close(sock);
+    return rc;
+}
+
+/**
+ * Finds the MAC address to send frames to for a destination, through an
+ * interface: the destination's own if it is on the interface's subnet,
+ * otherwise its gateway's. Only complete entries of the kernel's neighbour
+ * table are used; the kernel resolves missing ones once something is sent to
+ * the destination through the socket stack.
+ *
+ * @param iface The interface the frames are sent from
+ * @param dest  The destination address (host byte order)
+ * @param mac   Filled with the MAC address
+ * @return      0 on success, -1 if the next hop or its MAC address isn't known
+ */
+int frame_resolve_mac(const iface_t *iface, uint32_t dest, unsigned char *mac)
+{
+    FILE            *arp;
+    char            line[256];
+    char            ip_str[INET_ADDRSTRLEN];
+    char            addr_str[INET_ADDRSTRLEN + 1];
+    char            mac_str[32];
+    char            device[IF_NAMESIZE];
+    unsigned int    hw_type;
+    unsigned int    flags;
+    unsigned int    bytes[MAC_SIZE];
+    struct in_addr  hop_addr;
+    uint32_t        hop;
+    int             rc = -1;
+
+    if (next_hop(iface, dest, &hop) < 0) {
+        return -1;
+    }
+    hop_addr.s_addr = htonl(hop);
+    if (inet_ntop(AF_INET, &hop_addr, ip_str, sizeof(ip_str)) == NULL) {
+        return -1;
+    }
+
+    arp = fopen("/proc/net/arp", "r");
+    if (arp == NULL) {
+        return -1;
+    }
+    // IP address, HW type, Flags, HW address, Mask, Device
+    while (fgets(line, sizeof(line), arp) != NULL) {
+        if (sscanf(line, "%16s 0x%x 0x%x %31s %*s %15s", addr_str, &hw_type, &flags, mac_str, device) != 5) {
+            continue;
+        }
+        if (strcmp(addr_str, ip_str) != 0 || strcmp(device, iface->name) != 0 || (flags & ATF_COM) == 0) {
+            continue;
+        }
+        if (sscanf(mac_str, "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2],
+                    &bytes[3], &bytes[4], &bytes[5]) == MAC_SIZE) {
+            for (int i = 0; i < MAC_SIZE; i++) {
+                mac[i] = bytes[i];
+            }
+            rc = 0;
+        }
+        break;
+    }
+    fclose(arp);
+    return rc;
+}
+
+/**
+ * Parses an IPv4 packet holding a whole, unfragmented UDP datagram
+ *
+ * @param ip    The start of the IP header
+ * @param len   The bytes available from the IP header on
+ * @param info  Filled with the datagram's addresses, ports and payload
+ * @return      true if the packet is such a datagram
+ */
+bool frame_parse_ip(const unsigned char *ip, size_t len, udp_info_t *info)
+{
+    const unsigned char *udp;
+    size_t              ip_header_len;
+    size_t              udp_len;
+
+    if (len < IP_HEADER_SIZE || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP) {
+        return false;
+    }
+    // More fragments flag or fragment offset set
+    if (((ip[6] << 8) | ip[7]) & 0x3fff) {
+        return false;
+    }
+    ip_header_len = (ip[0] & 0x0f) * 4;
+    if (ip_header_len < IP_HEADER_SIZE || len < ip_header_len + UDP_HEADER_SIZE) {
+        return false;
+    }
+    udp = ip + ip_header_len;
+    udp_len = (udp[4] << 8) | udp[5];
+    if (udp_len < UDP_HEADER_SIZE || udp_len > len - ip_header_len) {
+        return false;
+    }
+
+    info->src_ip        = ((uint32_t)ip[12] << 24) | ((uint32_t)ip[13] << 16) | ((uint32_t)ip[14] << 8) | ip[15];
+    info->dst_ip        = ((uint32_t)ip[16] << 24) | ((uint32_t)ip[17] << 16) | ((uint32_t)ip[18] << 8) | ip[19];
+    info->src_port      = (udp[0] << 8) | udp[1];
+    info->dst_port      = (udp[2] << 8) | udp[3];
+    info->payload       = udp + UDP_HEADER_SIZE;
+    info->payload_len   = udp_len - UDP_HEADER_SIZE;
+    return true;
+}
+
+/**
+ * Checks the UDP checksum of a datagram (a checksum of 0 means none was sent)
+ *
+ * @param ip        The IPv4 header
+ * @param udp       The UDP header
+ * @param udp_len   Length of the UDP header and payload (bytes)
+ * @return          true if the checksum is good or not used
+ */
+bool frame_udp_checksum_ok(const unsigned char *ip, const unsigned char *udp, size_t udp_len)
+{
+    if (udp[6] == 0 && udp[7] == 0) {
+        return true;
+    }
+    return checksum_fold(checksum_add(pseudo_header_sum(ip, udp_len), udp, udp_len)) == 0;
+}
+
+/**
+ * Checks whether a datagram carries a partial UDP checksum, left for the
+ * device to finish: the sum of the pseudo header alone, not complemented
+ *
+ * @param ip        The IPv4 header
+ * @param udp       The UDP header
+ * @param udp_len   Length of the UDP header and payload (bytes)
+ * @return          true if the checksum is partial
+ */
+bool frame_udp_checksum_partial(const unsigned char *ip, const unsigned char *udp, size_t udp_len)
+{
+    uint16_t partial = ~checksum_fold(pseudo_header_sum(ip, udp_len)) & 0xffff;
+
+    return ((udp[6] << 8) | udp[7]) == partial;
+}
+
+/**
+ * Writes the Ethernet, IPv4 and UDP headers for a payload already in place at
+ * frame + FRAME_HEADERS_SIZE, computing both checksums. Addresses and ports
+ * are in host byte order.
+ */
+void frame_write_headers(unsigned char *frame, const unsigned char *src_mac, const unsigned char *dst_mac,
+        uint32_t src_ip, uint16_t src_port, uint32_t dst_ip, uint16_t dst_port,
+        size_t payload_len, uint16_t ip_id)
+{
+    frame_template_t tmpl;
+
+    frame_init_template(&tmpl, src_mac, dst_mac, src_ip, src_port, dst_ip, dst_port);
+    frame_fill_headers(frame, &tmpl, payload_len, frame_payload_sum(frame + FRAME_HEADERS_SIZE, payload_len), ip_id);
+}
+
+/**
+ * Builds the Ethernet, IPv4 and UDP headers of the frames from one address
+ * and port to another, leaving the lengths, IP ID and checksums 0, and sums
+ * the fields the checksums cover that don't change from frame to frame.
+ * Addresses and ports are in host byte order.
+ *
+ * @param tmpl      The template to build
+ * @param src_mac   The MAC address of the interface sending the frames
+ * @param dst_mac   The MAC address of the next hop
+ * @param src_ip    The source address
+ * @param src_port  The source port
+ * @param dst_ip    The destination address
+ * @param dst_port  The destination port
+ */
+void frame_init_template(frame_template_t *tmpl, const unsigned char *src_mac, const unsigned char *dst_mac,
+        uint32_t src_ip, uint16_t src_port, uint32_t dst_ip, uint16_t dst_port)
+{
+    unsigned char   *frame = tmpl->headers;
+    unsigned char   *ip = frame + ETH_HEADER_SIZE;
+    unsigned char   *udp = ip + IP_HEADER_SIZE;
+
+    memset(frame, 0, FRAME_HEADERS_SIZE);
+
+    // Ethernet
+    memcpy(frame, dst_mac, MAC_SIZE);
+    memcpy(frame + MAC_SIZE, src_mac, MAC_SIZE);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    // IPv4, no options
+    ip[0]   = 0x45;
+    ip[8]   = 64;
+    ip[9]   = IPPROTO_UDP;
+    ip[12]  = src_ip >> 24;
+    ip[13]  = (src_ip >> 16) & 0xff;
+    ip[14]  = (src_ip >> 8) & 0xff;
+    ip[15]  = src_ip & 0xff;
+    ip[16]  = dst_ip >> 24;
+    ip[17]  = (dst_ip >> 16) & 0xff;
+    ip[18]  = (dst_ip >> 8) & 0xff;
+    ip[19]  = dst_ip & 0xff;
+
+    // UDP
+    udp[0]  = src_port >> 8;
+    udp[1]  = src_port & 0xff;
+    udp[2]  = dst_port >> 8;
+    udp[3]  = dst_port & 0xff;
+
+    tmpl->ip_sum    = checksum_add(0, ip, IP_HEADER_SIZE);
+    tmpl->udp_sum   = pseudo_header_sum(ip, 0) + checksum_add(0, udp, UDP_HEADER_SIZE);
+}
+
+/**
+ * Writes a template's headers in front of a payload already in place at
+ * frame + FRAME_HEADERS_SIZE, filling in the lengths, the IP ID and both
+ * checksums
+ *
+ * @param frame         The frame to write
+ * @param tmpl          The headers of the frame
+ * @param payload_len   The payload length (bytes)
+ * @param payload_sum   The payload's frame_payload_sum()
+ * @param ip_id         The IP ID of the frame
+ */
+void frame_fill_headers(unsigned char *frame, const frame_template_t *tmpl, size_t payload_len,
+        uint32_t payload_sum, uint16_t ip_id)
+{
+    unsigned char   *ip = frame + ETH_HEADER_SIZE;
+    unsigned char   *udp = ip + IP_HEADER_SIZE;
+    size_t          udp_len = UDP_HEADER_SIZE + payload_len;
+    size_t          ip_len = IP_HEADER_SIZE + udp_len;
+    uint16_t        sum;
+
+    memcpy(frame, tmpl->headers, FRAME_HEADERS_SIZE);
+
+    ip[2]   = ip_len >> 8;
+    ip[3]   = ip_len & 0xff;
+    ip[4]   = ip_id >> 8;
+    ip[5]   = ip_id & 0xff;
+    sum = checksum_fold(tmpl->ip_sum + ip_len + ip_id);
+    ip[10]  = sum >> 8;
+    ip[11]  = sum & 0xff;
+
+    // The UDP length is in the pseudo header and the UDP header. A computed checksum of 0 is sent as 0xffff
+    udp[4]  = udp_len >> 8;
+    udp[5]  = udp_len & 0xff;
+    sum = checksum_fold(tmpl->udp_sum + 2 * udp_len + payload_sum);
+    if (sum == 0) {
+        sum = 0xffff;
+    }
+    udp[6]  = sum >> 8;
+    udp[7]  = sum & 0xff;
+}
+
+/**
+ * Sums a payload as the UDP checksum does, so frame_fill_headers() can reuse
+ * the sum for every frame it is sent in
+ *
+ * @param payload   The payload
+ * @param len       The payload length (bytes)
+ * @return          The ones' complement sum, not folded
+ */
+uint32_t frame_payload_sum(const void *payload, size_t len)
+{
+    return checksum_add(0, payload, len);
+}
+
+/**
+ * Adds data to a ones' complement sum, as 16-bit big endian words
+ */
+static uint32_t checksum_add(uint32_t sum, const unsigned char *data, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i + 1];
+    }
+    if (len & 1) {
+        sum += data[len - 1] << 8;
+    }
+    return sum;
+}
+
+/**
+ * Folds a ones' complement sum to 16 bits and complements it, giving the
+ * checksum to write (or 0 if the data summed included a correct checksum)
+ */
+static uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum & 0xffff;
+}
+
+/**
+ * Sums the UDP pseudo header: addresses, protocol and UDP length
+ */
+static uint32_t pseudo_header_sum(const unsigned char *ip, size_t udp_len)
+{
+    return checksum_add(0, ip + 12, 8) + IPPROTO_UDP + udp_len;
+}
+
+/**
+ * Finds the next hop for a destination through an interface, from the
+ * interface's subnet or else the kernel's IPv4 routing table
+ *
+ * @return 0 on success, -1 if there's no route through the interface
+ */
+static int next_hop(const iface_t *iface, uint32_t dest, uint32_t *hop)
+{
+    FILE            *routes;
+    char            line[256];
+    char            device[IF_NAMESIZE + 1];
+    unsigned int    route_dest;
+    unsigned int    gateway;
+    unsigned int    flags;
+    unsigned int    mask;
+    int             best_len = -1;
+
+    if ((dest & iface->netmask) == (iface->address & iface->netmask)) {
+        *hop = dest;
+        return 0;
+    }
+
+    routes = fopen("/proc/net/route", "r");
+    if (routes == NULL) {
+        return -1;
+    }
+    // Iface, Destination, Gateway, Flags, RefCnt, Use, Metric, Mask (addresses in network byte order)
+    while (fgets(line, sizeof(line), routes) != NULL) {
+        if (sscanf(line, "%16s %x %x %x %*d %*d %*d %x", device, &route_dest, &gateway, &flags, &mask) != 5) {
+            continue;
+        }
+        if (strcmp(device, iface->name) != 0 || (flags & RTF_UP) == 0) {
+            continue;
+        }
+        route_dest = ntohl(route_dest);
+        mask = ntohl(mask);
+        if ((dest & mask) != route_dest || __builtin_popcount(mask) <= best_len) {
+            continue;
+        }
+        best_len = __builtin_popcount(mask);
+        *hop = (flags & RTF_GATEWAY) ? ntohl(gateway) : dest;
+    }
+    fclose(routes);
+    return (best_len >= 0) ? 0 : -1;
+}
@@ -12,6 +12,7 @@
  */
 
 #include <arpa/inet.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -101,7 +102,7 @@ void parse_config(char *filename)
 /**
  * Parses the decoded json_value. Ensures that the rules have listen,
  * transmit, target, and map arrays defined. Calls other functions to parse
- * those types individually.
+ * those types individually. The options object is optional.
  *
  * @param json_rules    The json_value* obtained from json_parse()
  */
@@ -159,6 +160,12 @@ int parse_rules(json_value* json_rules)
             for (int x = 0; x < value->u.array.length; x++) {
                 parse_map(value->u.array.values[x]);
             }
+        } else if ( strncmp(name, "options", 7) == 0 ) {
+            if (type != json_object) {
+                printf("Error: options type is not object\n");
+                exit(1);
+            }
+            parse_options(value);
         } else {
             printf("Unrecognized token in rules (%s)", name);
         }
@@ -201,10 +208,20 @@ void parse_listener(json_value *value)
     int id = 0;
     uint32_t address = 0;
     uint16_t port = 0;
+    int max_payload = 0;
+    int shards = 0;
+    ingest_t ingest = INGEST_SOCKET;
+    char *interface = NULL;
+    int busy_poll = 0;
+    json_value *sources = NULL;
 
     bool id_found = false;
     bool address_found = false;
     bool port_found = false;
+    bool max_payload_found = false;
+    bool shards_found = false;
+    bool ingest_found = false;
+    bool busy_poll_found = false;
 
     bool exit_now = false;
 
@@ -219,7 +236,7 @@ void parse_listener(json_value *value)
                 printf("Error: listen->id must be an integer\n");
                 exit(1);
             }
-            id = field->u.integer;
+            id = parse_int(field, "listen->id");
         } else if ( strncmp(name, "address", 7) == 0 ) {
             address_found = true;
             if (type != json_string) {
@@ -249,6 +266,55 @@ void parse_listener(json_value *value)
                 exit(1);
             }
             port = temp;
+        } else if ( strncmp(name, "max_payload", 11) == 0 ) {
+            max_payload_found = true;
+            if (type != json_integer) {
+                printf("Error: listen->max_payload must be an integer\n");
+                exit(1);
+            }
+            max_payload = parse_int(field, "listen->max_payload");
+        } else if ( strncmp(name, "shards", 6) == 0 ) {
+            shards_found = true;
+            if (type != json_integer) {
+                printf("Error: listen->shards must be an integer\n");
+                exit(1);
+            }
+            shards = parse_int(field, "listen->shards");
+        } else if ( strncmp(name, "ingest", 6) == 0 ) {
+            ingest_found = true;
+            if (type != json_string) {
+                printf("Error: listen->ingest must be a string\n");
+                exit(1);
+            }
+            if ( strcmp(field->u.string.ptr, "socket") == 0 ) {
+                ingest = INGEST_SOCKET;
+            } else if ( strcmp(field->u.string.ptr, "tpacket") == 0 ) {
+                ingest = INGEST_TPACKET;
+            } else if ( strcmp(field->u.string.ptr, "xdp") == 0 ) {
+                ingest = INGEST_XDP;
+            } else {
+                printf("Error: listen->ingest must be \"socket\", \"tpacket\" or \"xdp\"\n");
+                exit(1);
+            }
+        } else if ( strncmp(name, "interface", 9) == 0 ) {
+            if (type != json_string) {
+                printf("Error: listen->interface must be a string\n");
+                exit(1);
+            }
+            interface = field->u.string.ptr;
+        } else if ( strncmp(name, "busy_poll", 9) == 0 ) {
+            busy_poll_found = true;
+            if (type != json_integer) {
+                printf("Error: listen->busy_poll must be an integer\n");
+                exit(1);
+            }
+            busy_poll = parse_int(field, "listen->busy_poll");
+        } else if ( strncmp(name, "sources", 7) == 0 ) {
+            if (type != json_array) {
+                printf("Error: listen->sources must be an array of dotted decimal strings\n");
+                exit(1);
+            }
+            sources = field;
         }
     }
 
@@ -273,6 +339,32 @@ void parse_listener(json_value *value)
     printf("Listener- ID: %d, addr: %lu, port: %d\n", id, (long unsigned int)address, port);
 #endif
     create_listener(id, address, port);
+
+    // Optional fields
+    if (max_payload_found) {
+        set_listener_max_payload(id, max_payload);
+    }
+    if (shards_found) {
+        set_listener_shards(id, shards);
+    }
+    if (ingest_found) {
+        set_listener_ingest(id, ingest);
+    }
+    if (interface != NULL) {
+        set_listener_interface(id, interface);
+    }
+    if (busy_poll_found) {
+        set_listener_busy_poll(id, busy_poll);
+    }
+    for (int i = 0; sources != NULL && i < sources->u.array.length; i++) {
+        json_value *source = sources->u.array.values[i];
+        struct in_addr addr;
+        if (source->type != json_string || inet_pton(AF_INET, source->u.string.ptr, &addr) != 1) {
+            printf("Error: listen->sources must be an array of dotted decimal strings\n");
+            exit(1);
+        }
+        add_listener_source(id, ntohl(addr.s_addr));
+    }
 }
 
 /**
@@ -288,6 +380,12 @@ void parse_transmitter(json_value *value)
     int id = 0;
     uint32_t address = 0;
     uint16_t port = 0;
+    char *interface = NULL;
+    int zerocopy = 0;
+    int multicast_ttl = 1;
+    bool multicast_loop = true;
+    bool multicast_found = false;
+    egress_t egress = EGRESS_SOCKET;
 
     bool id_found = false;
     bool address_found = false;
@@ -306,7 +404,7 @@ void parse_transmitter(json_value *value)
                 printf("Error: transmit->id must be an integer\n");
                 exit(1);
             }
-            id = field->u.integer;
+            id = parse_int(field, "transmit->id");
         } else if ( strncmp(name, "address", 7) == 0 ) {
             address_found = true;
             if (type != json_string) {
@@ -341,6 +439,45 @@ void parse_transmitter(json_value *value)
                 }
                 port = temp;
             }
+        } else if ( strncmp(name, "interface", 9) == 0 ) {
+            if (type != json_string) {
+                printf("Error: transmit->interface must be a string\n");
+                exit(1);
+            }
+            interface = field->u.string.ptr;
+        } else if ( strncmp(name, "zerocopy", 8) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: transmit->zerocopy must be an integer\n");
+                exit(1);
+            }
+            zerocopy = parse_int(field, "transmit->zerocopy");
+        } else if ( strncmp(name, "multicast_ttl", 13) == 0 ) {
+            multicast_found = true;
+            if (type != json_integer) {
+                printf("Error: transmit->multicast_ttl must be an integer\n");
+                exit(1);
+            }
+            multicast_ttl = parse_int(field, "transmit->multicast_ttl");
+        } else if ( strncmp(name, "multicast_loop", 14) == 0 ) {
+            multicast_found = true;
+            if (type != json_boolean) {
+                printf("Error: transmit->multicast_loop must be true or false\n");
+                exit(1);
+            }
+            multicast_loop = field->u.boolean;
+        } else if ( strncmp(name, "egress", 6) == 0 ) {
+            if (type != json_string) {
+                printf("Error: transmit->egress must be a string\n");
+                exit(1);
+            }
+            if ( strcmp(field->u.string.ptr, "socket") == 0 ) {
+                egress = EGRESS_SOCKET;
+            } else if ( strcmp(field->u.string.ptr, "tpacket") == 0 ) {
+                egress = EGRESS_TPACKET;
+            } else {
+                printf("Error: transmit->egress must be \"socket\" or \"tpacket\"\n");
+                exit(1);
+            }
         }
     }
 
@@ -365,6 +502,20 @@ void parse_transmitter(json_value *value)
     printf("Transmitter- ID: %d, addr: %lu, port: %d\n", id, (long unsigned int)address, port);
 #endif
     create_transmitter(id, address, port);
+
+    // Optional fields
+    if (interface != NULL) {
+        set_transmitter_interface(id, interface);
+    }
+    if (zerocopy != 0) {
+        set_transmitter_zerocopy(id, zerocopy);
+    }
+    if (multicast_found) {
+        set_transmitter_multicast(id, multicast_ttl, multicast_loop);
+    }
+    if (egress != EGRESS_SOCKET) {
+        set_transmitter_egress(id, egress);
+    }
 }
 
 /**
@@ -381,6 +532,13 @@ void parse_target(json_value *value)
     uint32_t address = 0;
     uint16_t port = 0;
     int transmit_id = 0;
+    bool connect = false;
+    int queue_length = DEFAULT_SEND_QUEUE;
+    drop_policy_t drop_policy = DROP_NEWEST;
+    int max_pps = 0;
+    int max_bps = 0;
+    pacing_t pacing = PACING_TIMER;
+    int thread = 0;
 
     bool id_found = false;
     bool address_found = false;
@@ -400,7 +558,7 @@ void parse_target(json_value *value)
                 printf("Error: target->id must be an integer\n");
                 exit(1);
             }
-            id = field->u.integer;
+            id = parse_int(field, "target->id");
         } else if ( strncmp(name, "address", 7) == 0 ) {
             address_found = true;
             if (type != json_string) {
@@ -433,7 +591,63 @@ void parse_target(json_value *value)
                 printf("Error: target->transmitter must be an integer\n");
                 exit(1);
             }
-            transmit_id = field->u.integer;
+            transmit_id = parse_int(field, "target->transmitter");
+        } else if ( strncmp(name, "connect", 7) == 0 ) {
+            if (type != json_boolean) {
+                printf("Error: target->connect must be true or false\n");
+                exit(1);
+            }
+            connect = field->u.boolean;
+        } else if ( strncmp(name, "queue", 5) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: target->queue must be an integer\n");
+                exit(1);
+            }
+            queue_length = parse_int(field, "target->queue");
+        } else if ( strncmp(name, "drop", 4) == 0 ) {
+            if (type != json_string) {
+                printf("Error: target->drop must be a string\n");
+                exit(1);
+            }
+            if ( strcmp(field->u.string.ptr, "newest") == 0 ) {
+                drop_policy = DROP_NEWEST;
+            } else if ( strcmp(field->u.string.ptr, "oldest") == 0 ) {
+                drop_policy = DROP_OLDEST;
+            } else {
+                printf("Error: target->drop must be \"newest\" or \"oldest\"\n");
+                exit(1);
+            }
+        } else if ( strncmp(name, "rate", 4) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: target->rate must be an integer\n");
+                exit(1);
+            }
+            max_pps = parse_int(field, "target->rate");
+        } else if ( strncmp(name, "byte_rate", 9) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: target->byte_rate must be an integer\n");
+                exit(1);
+            }
+            max_bps = parse_int(field, "target->byte_rate");
+        } else if ( strncmp(name, "pacing", 6) == 0 ) {
+            if (type != json_string) {
+                printf("Error: target->pacing must be a string\n");
+                exit(1);
+            }
+            if ( strcmp(field->u.string.ptr, "timer") == 0 ) {
+                pacing = PACING_TIMER;
+            } else if ( strcmp(field->u.string.ptr, "txtime") == 0 ) {
+                pacing = PACING_TXTIME;
+            } else {
+                printf("Error: target->pacing must be \"timer\" or \"txtime\"\n");
+                exit(1);
+            }
+        } else if ( strncmp(name, "thread", 6) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: target->thread must be an integer\n");
+                exit(1);
+            }
+            thread = parse_int(field, "target->thread");
         }
     }
 
@@ -462,6 +676,16 @@ void parse_target(json_value *value)
     printf("Target- ID: %d, addr: %lu, port: %d transmitter: %d\n", id, (long unsigned int)address, port, transmit_id);
 #endif
     create_target(id, address, port, transmit_id);
+    if (connect) {
+        set_target_connect(id, true);
+    }
+    set_target_queue(id, queue_length, drop_policy);
+    if (max_pps != 0 || max_bps != 0) {
+        set_target_rate(id, max_pps, max_bps, pacing);
+    }
+    if (thread != 0) {
+        set_target_thread(id, thread);
+    }
 }
 
 /**
@@ -470,7 +694,7 @@ void parse_target(json_value *value)
  * Iterates through the fields, and ensures the proper fields have been
  * included. If a field is missing, reports the error and kills the program.
  *
- * Uses repeater.c's create_map() function
+ * Uses repeater.c's create_map_range() function
  */
 void parse_map(json_value *value)
 {
@@ -479,7 +703,9 @@ void parse_map(json_value *value)
     int i = 0;
     json_value *targets = NULL;
     uint32_t address = 0;
+    int prefix_len = 0;
     uint16_t port = 0;
+    uint16_t port_last = 0;
 
     bool source_found = false;
     bool target_found = false;
@@ -499,7 +725,7 @@ void parse_map(json_value *value)
                 printf("Error: map->source must be an integer\n");
                 exit(1);
             }
-            source = field->u.integer;
+            source = parse_int(field, "map->source");
         } else if ( strncmp(name, "target", 6) == 0 ) {
             target_found = true;
             if (type != json_array) {
@@ -515,15 +741,36 @@ void parse_map(json_value *value)
             }
             if ( strncmp(field->u.string.ptr, "*", 1) == 0 ) {
                 address = 0;
+                prefix_len = 0;
             } else {
                 //address = ntohl(inet_addr(field->u.string.ptr));
                 struct in_addr addr;
-                int rc = inet_pton(AF_INET, field->u.string.ptr, &addr);
+                char text[INET_ADDRSTRLEN];
+                char *slash = strchr(field->u.string.ptr, '/');
+                size_t length = (slash != NULL) ? (size_t)(slash - field->u.string.ptr) : field->u.string.length;
+                if (length >= sizeof(text)) {
+                    printf("Error: map->address is not a valid IPv4 address\n");
+                    exit(1);
+                }
+                memcpy(text, field->u.string.ptr, length);
+                text[length] = '\0';
+                int rc = inet_pton(AF_INET, text, &addr);
                 if (rc == 0) {
                     printf("Error: map->address is not a valid IPv4 address\n");
                     exit(1);
                 }
                 address = ntohl(addr.s_addr);
+                // A bare 0.0.0.0 has always meant any address; 0.0.0.0/8 and the like are prefixes
+                prefix_len = (address == 0) ? 0 : 32;
+                if (slash != NULL) {
+                    char *end;
+                    long temp = strtol(slash + 1, &end, 10);
+                    if (slash[1] == '\0' || *end != '\0' || temp < 0 || temp > 32) {
+                        printf("Error: map->address prefix length must be 0 to 32\n");
+                        exit(1);
+                    }
+                    prefix_len = temp;
+                }
             }
         } else if ( strncmp(name, "port", 4) == 0 ) {
             port_found = true;
@@ -533,13 +780,34 @@ void parse_map(json_value *value)
             }
             if ( strncmp(field->u.string.ptr, "*", 1) == 0 ) {
                 port = 0;
+                port_last = 0;
             } else {
-                int temp = atoi(field->u.string.ptr);
+                char *start = field->u.string.ptr;
+                char *end;
+                long temp = (*start >= '0' && *start <= '9') ? strtol(start, &end, 10) : 0;
                 if (temp <= 1024 || temp > 65535) {
-                    printf("%d is an invalid port. Must be between 1024-65536 noninclusive", temp);
+                    printf("%ld is an invalid port. Must be between 1024-65536 noninclusive", temp);
                     exit(1);
                 }
                 port = temp;
+                port_last = temp;
+                if (*end == '-') {
+                    start = end + 1;
+                    temp = (*start >= '0' && *start <= '9') ? strtol(start, &end, 10) : 0;
+                    if (temp <= 1024 || temp > 65535) {
+                        printf("%ld is an invalid port. Must be between 1024-65536 noninclusive", temp);
+                        exit(1);
+                    }
+                    if (temp < port) {
+                        printf("Error: map->port range must not end before it starts\n");
+                        exit(1);
+                    }
+                    port_last = temp;
+                }
+                if (*end != '\0') {
+                    printf("Error: map->port must be a port or a range of ports, such as \"20000-20999\"\n");
+                    exit(1);
+                }
             }
         }
     }
@@ -576,12 +844,129 @@ void parse_map(json_value *value)
             printf("Error: map->target must be an array of integers\n");
             exit(1);
         }
-        target = value->u.integer;
+        target = parse_int(value, "map->target");
 #ifdef DEBUG
-        printf("Map- source: %d, target: %d addr: %lu, port: %d\n", source, target, (long unsigned int)address, port);
+        printf("Map- source: %d, target: %d addr: %lu/%d, port: %d-%d\n", source, target, (long unsigned int)address, prefix_len, port, port_last);
 #endif
-        create_map(source, address, port, target);
+        create_map_range(source, address, prefix_len, port, port_last, target);
     }
 
 }
 
+/**
+ * Parses the optional json object holding global tuning options
+ *
+ * Any option that is left out keeps its default value.
+ *
+ * Uses repeater.c's set_*() functions
+ */
+void parse_options(json_value *value)
+{
+    // Iterate through the fields in the options
+    for (int i = 0; i < value->u.object.length; i++) {
+        char *name = value->u.object.values[i].name;
+        json_value *field = value->u.object.values[i].value;
+        int type = field->type;
+        if ( strncmp(name, "recv_batch", 10) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: options->recv_batch must be an integer\n");
+                exit(1);
+            }
+#ifdef DEBUG
+            printf("Option- recv_batch: %lld\n", (long long)field->u.integer);
+#endif
+            set_recv_batch(parse_int(field, "options->recv_batch"));
+        } else if ( strncmp(name, "fd_budget", 9) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: options->fd_budget must be an integer\n");
+                exit(1);
+            }
+#ifdef DEBUG
+            printf("Option- fd_budget: %lld\n", (long long)field->u.integer);
+#endif
+            set_fd_budget(parse_int(field, "options->fd_budget"));
+        } else if ( strncmp(name, "engine", 6) == 0 ) {
+            if (type != json_string) {
+                printf("Error: options->engine must be a string\n");
+                exit(1);
+            }
+            if ( strcmp(field->u.string.ptr, "epoll") == 0 ) {
+                set_engine(ENGINE_EPOLL);
+            } else if ( strcmp(field->u.string.ptr, "io_uring") == 0 ) {
+                set_engine(ENGINE_IO_URING);
+            } else {
+                printf("Error: options->engine must be \"epoll\" or \"io_uring\"\n");
+                exit(1);
+            }
+#ifdef DEBUG
+            printf("Option- engine: %s\n", field->u.string.ptr);
+#endif
+        } else if ( strncmp(name, "xdp_mode", 8) == 0 ) {
+            if (type != json_string) {
+                printf("Error: options->xdp_mode must be a string\n");
+                exit(1);
+            }
+            if ( strcmp(field->u.string.ptr, "skb") == 0 ) {
+                set_xdp_mode(XDP_MODE_SKB);
+            } else if ( strcmp(field->u.string.ptr, "native") == 0 ) {
+                set_xdp_mode(XDP_MODE_NATIVE);
+            } else {
+                printf("Error: options->xdp_mode must be \"skb\" or \"native\"\n");
+                exit(1);
+            }
+#ifdef DEBUG
+            printf("Option- xdp_mode: %s\n", field->u.string.ptr);
+#endif
+        } else if ( strncmp(name, "busy_poll", 9) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: options->busy_poll must be an integer\n");
+                exit(1);
+            }
+#ifdef DEBUG
+            printf("Option- busy_poll: %lld\n", (long long)field->u.integer);
+#endif
+            set_busy_poll(parse_int(field, "options->busy_poll"));
+        } else if ( strncmp(name, "spin_idle", 9) == 0 ) {
+            if (type != json_integer) {
+                printf("Error: options->spin_idle must be an integer\n");
+                exit(1);
+            }
+#ifdef DEBUG
+            printf("Option- spin_idle: %lld\n", (long long)field->u.integer);
+#endif
+            set_spin_idle(parse_int(field, "options->spin_idle"));
+        } else if ( strncmp(name, "cpus", 4) == 0 ) {
+            if (type != json_array) {
+                printf("Error: options->cpus must be an array of integers\n");
+                exit(1);
+            }
+            // Entry N is the CPU for worker N
+            for (int x = 0; x < field->u.array.length; x++) {
+                if (field->u.array.values[x]->type != json_integer) {
+                    printf("Error: options->cpus must be an array of integers\n");
+                    exit(1);
+                }
+                set_worker_cpu(x, parse_int(field->u.array.values[x], "options->cpus"));
+            }
+        } else {
+            printf("Unrecognized option in rules (%s)\n", name);
+        }
+    }
+}
+
+/**
+ * Reads a json integer that is passed on as an int. Larger values would be
+ * truncated, and could then pass the range checks, so they are rejected.
+ *
+ * @param value The json integer
+ * @param name  The name of the field, for the error message
+ * @return      The value of the integer
+ */
+int parse_int(json_value *value, const char *name)
+{
+    if (value->u.integer < INT_MIN || value->u.integer > INT_MAX) {
+        printf("Error: %s is out of range\n", name);
+        exit(1);
+    }
+    return value->u.integer;
+}
@@ -11,19 +11,260 @@
  *
  */
 
+#define _GNU_SOURCE     // recvmmsg()
+
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 
+#include "classify.h"
 #include "repeater.h"
+#include "tpacket.h"
+#include "uring.h"
+#include "xdp.h"
+
+// epoll busy polling parameters (Linux 6.9), missing from older headers
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t    busy_poll_usecs;
+    uint16_t    busy_poll_budget;
+    uint8_t     prefer_busy_poll;
+    uint8_t     pad;
+};
+#define EPIOCSPARAMS        _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/*
+ * A pacer_t is a worker's timer wheel of the targets whose held datagrams are
+ * waiting for their time to be sent. A target waits in the slot of the
+ * PACE_TICK us tick it is due in (modulo PACE_SLOTS), and a timerfd fires
+ * when the earliest one is due.
+ */
+typedef struct pacer_s
+{
+    socket_type_t       type;           // Always SOCKET_PACER
+    int                 fd;             // timerfd, or -1 if the worker paces no target itself
+    target_t            *slots[PACE_SLOTS]; // Targets waiting, by tick
+    uint64_t            tick;           // First tick not run yet
+    int                 count;          // Targets waiting
+    uint64_t            armed;          // When the timerfd fires (us, CLOCK_MONOTONIC), or 0
+    bool                fired;          // The timerfd fired since the wheel was last run
+} pacer_t;
+
+/*
+ * A worker_t is one thread running the epoll loop. Worker N serves shard N of
+ * every listener (worker 0 also serves the unsharded listeners and the
+ * transmitters), and has its own event loop, receive batch, packet pool and
+ * copy of the rule tables, so workers share nothing while forwarding.
+ */
+typedef struct worker_s
+{
+    int                 id;             // Index, and the listener shard served
+    pthread_t           thread;         // Thread running the worker (unused for worker 0)
+    int                 epoll_fd;       // Event loop, with every socket registered edge-triggered
+    listener_t          *ready_head;    // Listeners left with data after using their fd_budget
+    listener_t          *ready_tail;
+    transmitter_t       *transmitters;  // Transmitter hash table (worker 0 uses the global one)
+    target_t            *targets;       // Target hash table (worker 0 uses the global one)
+    route_t             *routes;        // Its targets compiled for forwarding, one per target
+    pktbuf_t            *pool_free;     // Free list of packet buffers
+    bool                xdp_ready;      // The XSKs may have frames waiting (worker 0 only)
+    bool                spin;           // Serves a low-latency listener, so polls instead of blocking
+    int                 busy_poll;      // Longest SO_BUSY_POLL time of its low-latency listeners (us)
+    uint64_t            last_active;    // When the last events arrived (us, CLOCK_MONOTONIC)
+    int                 cpu;            // CPU the thread is pinned to, or -1
+
+    // Receive batch (one recvmmsg() call fills up to recv_batch datagrams)
+    struct mmsghdr      recv_msgs[MAX_RECV_BATCH];
+    struct iovec        recv_iovs[MAX_RECV_BATCH][2];
+    struct sockaddr_in  recv_addrs[MAX_RECV_BATCH];
+    char                recv_ctrls[MAX_RECV_BATCH][CMSG_SPACE(sizeof(int))];   // UDP_GRO segment size
+
+    transmitter_t       *flush_head;    // Transmitters with datagrams queued
+    transmitter_t       *blocked_head;  // Transmitters with datagrams held until their socket is writable
+    uint64_t            next_retry;     // When to send held datagrams without waiting for EPOLLOUT (us)
+    int                 zc_pinned;      // Pool buffers kept by zerocopy sends the kernel hasn't completed
+    pacer_t             pacer;          // Targets waiting to send their held datagrams at their pace
+} worker_t;
+
+/*
+ * A send_batch_t holds the datagrams queued on one of a worker's transmitters,
+ * sent with one sendmmsg() call. The payloads aren't copied, so every batch is
+ * flushed before the buffers they point into are reused.
+ *
+ * The datagrams queued for each target are chained, so that when the batch
+ * is flushed, a run of equal-sized datagrams to one target can be put in one
+ * message and sent as one UDP_SEGMENT buffer.
+ */
+typedef struct send_batch_s
+{
+    int                 count;          // Datagrams queued
+    bool                listed;         // On the worker's flush list
+
+    // Queued datagrams
+    struct iovec        iovs[SEND_BATCH];
+    struct sockaddr_in  addrs[SEND_BATCH];
+    size_t              gso_sizes[SEND_BATCH];      // Segment size of coalesced datagrams (0 if not)
+    target_t            *targets[SEND_BATCH];
+    listener_t          *listeners[SEND_BATCH];     // Credited once the datagram is sent
+    pktbuf_t            *pkts[SEND_BATCH];          // Pool buffer holding the datagram, or NULL
+    uint64_t            txtimes[SEND_BATCH];        // SO_TXTIME send time of the datagram (ns), or 0
+    int                 next_same[SEND_BATCH];      // Next datagram queued for the same target, or -1
+    bool                used[SEND_BATCH];           // Put in a message
+
+    // Messages built from them when flushed
+    struct mmsghdr      msgs[SEND_BATCH];
+    struct iovec        msg_iovs[SEND_BATCH];
+    char                ctrls[SEND_BATCH][CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];    // UDP_SEGMENT, SCM_TXTIME
+    size_t              msg_segments[SEND_BATCH];   // UDP_SEGMENT segment size of each message (0 if none)
+    int                 msg_first[SEND_BATCH];      // First datagram of each message
+    int                 msg_count[SEND_BATCH];      // Datagrams in each message, following next_same
+    size_t              msg_bytes[SEND_BATCH];      // Payload bytes in each message
+    bool                msg_pooled[SEND_BATCH];     // Every datagram in the message is in a pool buffer
+} send_batch_t;
+
+/*
+ * A zerocopy_t tracks the MSG_ZEROCOPY sends in flight on one of a worker's
+ * transmitter sockets. The kernel numbers them in order, and reports ranges
+ * of completed numbers on the socket's error queue. Until then, the pool
+ * buffers of each send are kept out of the pool.
+ */
+typedef struct zerocopy_s
+{
+    uint32_t            next_id;                    // Number the kernel gives the next zerocopy send
+    uint32_t            oldest;                     // Oldest send not released yet
+    bool                done[ZEROCOPY_SENDS];       // Send completed, by number modulo ZEROCOPY_SENDS
+    int                 num_pins[ZEROCOPY_SENDS];   // Buffers each send holds
+    pktbuf_t            *pins[ZEROCOPY_PINS];       // Buffers held, in send order
+    int                 pins_head;
+    int                 pins_count;
+    bool                copied;                     // The kernel reported copying instead (logged once)
+} zerocopy_t;
+
+/*
+ * A send_queue_t holds copies of the datagrams for one of a worker's targets
+ * that its transmitter's socket had no room for, oldest first, until the
+ * socket is writable. While any are held, the target's new datagrams are held
+ * behind them, so they stay in order.
+ */
+typedef struct send_entry_s
+{
+    char                *data;          // Copy of the datagram (or coalesced datagrams)
+    size_t              size;           // Bytes allocated for data, kept for the next datagram
+    size_t              len;            // Length of the datagram (bytes)
+    size_t              gso_size;       // Segment size of coalesced datagrams (0 if not)
+    listener_t          *listener;      // Credited once the datagram is sent
+} send_entry_t;
+
+typedef struct send_queue_s
+{
+    send_entry_t        *entries;       // Ring of queue_length entries
+    int                 head;           // Oldest entry
+    int                 count;          // Entries held
+} send_queue_t;
+
+/*
+ * What stopped the datagrams held for a target from being sent
+ */
+typedef enum {SEND_DONE, SEND_FULL, SEND_PACED} send_result_t;
+
+/*
+ * A tx_route_t is how a transmit thread sends to one of its targets: through
+ * its own copy of the target's connected socket, or of its transmitter's
+ * socket (shared by the thread's targets with that transmitter)
+ */
+typedef struct tx_route_s
+{
+    int                 target_id;      // ID of the target
+    int                 transmitter_id; // ID of the transmitter whose socket was copied
+    int                 sockfd;         // The thread's socket
+    struct sockaddr_in  dest_addr;      // dst address and port of the forwarded packet
+    bool                connected;      // sockfd is connected to the target, so sends carry no address
+    bool                no_gso;         // Coalesced packets must be split before sending
+} tx_route_t;
+
+/*
+ * A tx_queue_t carries datagrams from one worker to one transmit thread
+ * without locks. The worker fills entries and publishes them by moving tail,
+ * the thread sends them and moves head past them, and the worker then gives
+ * back their pool buffers, counts what was sent and moves done up to head.
+ * Each index is only written by one side, and an entry is only filled again
+ * once it is done.
+ */
+typedef struct tx_entry_s
+{
+    pktbuf_t            *pkt;           // Pool buffer holding the datagram, kept until it is done
+    const char          *data;          // The datagram (or coalesced datagrams)
+    size_t              len;            // Length of the datagram (bytes)
+    size_t              gso_size;       // Segment size of coalesced datagrams (0 if not)
+    tx_route_t          *route;         // How the thread sends it
+    listener_t          *listener;      // The worker's listener, credited once it is done
+    target_t            *target;        // The worker's copy of the target, charged what wasn't sent
+    unsigned long       sent;           // Datagrams the thread sent (written by the thread)
+} tx_entry_t;
+
+typedef struct tx_queue_s
+{
+    tx_entry_t          entries[TX_THREAD_QUEUE];
+    uint32_t            fill;           // Next entry the worker fills (worker only)
+    uint32_t            done;           // Oldest entry whose buffer the worker hasn't given back (worker only)
+    uint32_t            tail;           // Entries published to the thread (written by the worker)
+    char                pad[CACHE_LINE_SIZE];   // Keeps head off the worker's cache line
+    uint32_t            head;           // Next entry the thread sends (written by the thread)
+} tx_queue_t;
+
+/*
+ * A tx_thread_t is a thread sending to the targets given to it, so that a
+ * target that is slow to take packets holds up that thread instead of the
+ * workers. It has a queue from every worker, and sleeps on an eventfd while
+ * they are all empty.
+ */
+typedef struct tx_thread_s
+{
+    int                 id;             // Number from the rules file
+    pthread_t           thread;
+    bool                used;           // Some target is given to it
+    int                 wake_fd;        // eventfd written to wake it
+    int                 sleeping;       // Waiting on wake_fd (accessed atomically)
+    tx_queue_t          *queues;        // One per worker
+} tx_thread_t;
 
 /* Global Variables */
-static struct pollfd    poll_fds[MAX_FDS];      // Array to poll
-static nfds_t           num_fds=0;              // Number of fds in the poll_fds array
-static int              listener_ids[MAX_FDS];  // Mapping from socket fd-->listener id
+static listener_t       *listener_head = NULL;  // Linked list of every listener
+static worker_t         *workers = NULL;        // One per shard
+static int              num_workers = 1;
+
+static int              recv_batch = DEFAULT_RECV_BATCH;    // Packets read per recvmmsg() call
+static int              fd_budget = DEFAULT_FD_BUDGET;  // Packets handled per ready fd per turn
+static engine_t         engine = ENGINE_EPOLL;  // Event loop used to forward packets
+static size_t           pool_slot_size = 0;     // Stride of the slots in the hot arena
+static xdp_mode_t       xdp_mode = XDP_MODE_SKB;    // How XDP programs are attached
+static bool             xdp_active = false;     // The AF_XDP datapath is set up
+static int              default_busy_poll = -1; // Low-latency mode for every listener (us), -1 if off
+static int              spin_idle = DEFAULT_SPIN_IDLE;  // Time a low-latency worker spins after its last packet (us)
+static int              worker_cpus[MAX_SHARDS];    // CPU to pin each worker to
+static bool             worker_pinned[MAX_SHARDS];  // worker_cpus entry is set
+static bool             zerocopy_used = false;  // Some transmitter sends with MSG_ZEROCOPY
+static tx_thread_t      *tx_threads = NULL;     // Transmit threads, by number - 1
+static int              num_tx_threads = 0;     // Highest transmit thread number given to a target
 
 // Hash tables
 static transmitter_t    *transmitter_hash_table = NULL;
@@ -35,9 +276,76 @@ static map_t            *map_tail = NULL;
 
 // Static method prototypes
 static int verify_config();
-static void recv_and_forward_packet(int fd);
-static void send_packet(const void* buf, size_t len, int target_id);
-static int open_socket(uint32_t address, uint16_t port);
+static void init_multicast(void);
+static void join_group(listener_t *listener);
+static void set_multicast_options(int sockfd, const transmitter_t *transmitter);
+static void connect_targets(void);
+static void init_workers(void);
+static void init_send_batch(transmitter_t *transmitter);
+static void init_send_queue(target_t *target);
+static void compile_routes(worker_t *worker);
+static void init_send_rings(worker_t *worker);
+static void init_tx_threads(void);
+static void *run_tx_thread(void *arg);
+static unsigned long send_offloaded(tx_thread_t *thread, const tx_entry_t *entry);
+static int send_waiting(const tx_route_t *route, const char *buf, size_t len, size_t gso_size);
+static void offload_datagram(worker_t *worker, listener_t *listener, pktbuf_t *pkt, const void *buf,
+        size_t len, size_t gso_size, target_t *target);
+static void publish_offloaded(worker_t *worker);
+static void reclaim_offloaded(worker_t *worker, tx_queue_t *queue);
+static void *run_worker(void *arg);
+static void init_packet_pool(worker_t *worker);
+static pktbuf_t *pool_get(worker_t *worker);
+static void pool_put(worker_t *worker, pktbuf_t *pkt);
+static void init_event_loop(worker_t *worker);
+static void register_transmitter(worker_t *worker, transmitter_t *transmitter);
+static void enable_busy_poll(int fd, int busy_poll_us);
+static void pin_worker(worker_t *worker);
+static uint64_t monotonic_us(void);
+static uint64_t monotonic_ns(void);
+static void resolve_listener_maps(void);
+static void init_ingest(void);
+static void mark_ready(worker_t *worker, listener_t *listener);
+static bool drain_listener(worker_t *worker, listener_t *listener);
+static bool drain_ring(worker_t *worker, listener_t *listener);
+static void discard_packets(int fd);
+static void clear_socket_error(int fd);
+static int recv_and_forward_packet(worker_t *worker, listener_t *listener, int max_packets, bool *empty);
+static void forward_packet(worker_t *worker, listener_t *listener, pktbuf_t *pkt, const char *data,
+        size_t len, size_t gso_size, uint32_t src_ip, uint16_t src_port);
+static void send_packet(worker_t *worker, listener_t *listener, pktbuf_t *pkt, const void* buf,
+        size_t len, size_t gso_size, const route_t *route);
+static void queue_datagram(worker_t *worker, const route_t *route, listener_t *listener,
+        pktbuf_t *pkt, const void *buf, size_t len, size_t gso_size, uint64_t txtime);
+static void flush_sends(worker_t *worker);
+static void flush_transmitter(worker_t *worker, transmitter_t *transmitter);
+static void send_ring(transmitter_t *transmitter);
+static int build_messages(transmitter_t *transmitter);
+static void send_one_by_one(worker_t *worker, transmitter_t *transmitter, int m);
+static void credit_datagram(send_batch_t *batch, int d);
+static unsigned long num_datagrams(size_t len, size_t gso_size);
+static bool hold_datagram(target_t *target, listener_t *listener, const void *buf, size_t len,
+        size_t gso_size);
+static void block_target(worker_t *worker, transmitter_t *transmitter, target_t *target);
+static void send_held(worker_t *worker);
+static send_result_t send_held_target(transmitter_t *transmitter, target_t *target);
+static void add_cmsg(struct msghdr *hdr, int level, int type, const void *data, size_t len);
+static void init_pacing(worker_t *worker);
+static uint64_t pace_start(const target_t *target, uint64_t now);
+static void pace_sent(target_t *target, uint64_t start, size_t len);
+static void pace_target(worker_t *worker, target_t *target);
+static void run_pacer(worker_t *worker);
+static void arm_pacer(worker_t *worker, uint64_t when);
+static void watch_writable(worker_t *worker, transmitter_t *transmitter, bool on);
+static void init_zerocopy(transmitter_t *transmitter);
+static int clone_socket(const transmitter_t *transmitter);
+static int next_run(worker_t *worker, transmitter_t *transmitter, int first, int num_msgs, int *flags);
+static void pin_buffers(worker_t *worker, transmitter_t *transmitter, int m);
+static void reap_zerocopy(worker_t *worker, transmitter_t *transmitter);
+static size_t send_split(int socket, const void *buf, size_t len, size_t gso_size,
+        const struct sockaddr_in *dest_addr);
+static void open_listener_socket(listener_t *listener, bool reuseport);
+static int open_socket(uint32_t address, uint16_t port, bool reuseport);
 
 /**
  * Starts the repeater. You should initialize all of your listeners,
@@ -52,6 +360,7 @@ static int open_socket(uint32_t address, uint16_t port);
 int start_repeater(char* logfile)
 {
 #ifdef DEBUG
+    print_listeners();
     print_transmitters();
     print_targets();
     print_maps();
@@ -94,451 +403,3745 @@ int start_repeater(char* logfile)
     fflush(logfd);
 #endif
 
-    // Main loop
-    int poll_rc;
-    while(1) {
-        poll_rc = poll(poll_fds, num_fds, -1);
-        if (poll_rc < 0) { // Poll had an error
-            perror("ERROR: Polling error");
+    // Give each listener its own list of maps
+    resolve_listener_maps();
+
+    // Join the listeners' multicast groups, and set up the transmitters sending to groups
+    init_multicast();
+
+    // Open the sockets of the targets that are sent to connected
+    connect_targets();
+
+    // Set up every worker's packet pool and rule tables
+    init_workers();
+
+    // Give the transmit threads their sockets and queues from every worker
+    init_tx_threads();
+
+    // Open the capture rings and XSKs of the listeners that use them
+    init_ingest();
+
+    // The io_uring engine only returns if this kernel can't run it
+    if (engine == ENGINE_IO_URING) {
+        run_uring_engine(listener_head, transmitter_hash_table);
+        fprintf(stderr, "io_uring engine not available, using the epoll loop\n");
+    }
+
+    // Start the transmit threads before anything is queued for them
+    for (int t = 0; t < num_tx_threads; t++) {
+        if (tx_threads[t].used && pthread_create(&tx_threads[t].thread, NULL, run_tx_thread, &tx_threads[t]) != 0) {
+            fprintf(stderr, "ERROR: Couldn't start transmit thread %d\n", t + 1);
+            exit(1);
+        }
+    }
+
+    // Start a thread for every shard after the first, and run the first here
+    for (int w = 1; w < num_workers; w++) {
+        if (pthread_create(&workers[w].thread, NULL, run_worker, &workers[w]) != 0) {
+            fprintf(stderr, "ERROR: Couldn't start worker thread %d\n", w);
             exit(1);
-        } else if (poll_rc > 0) { // Data is available
-            for (int i = 0; i < num_fds; i++) {
-                if (poll_fds[i].revents == POLLIN) {
-                    recv_and_forward_packet(poll_fds[i].fd);
-                }
-            }
         }
     }
+    run_worker(&workers[0]);
+    return 0;
 }
 
 /**
- * Receieve a packet from the fd specified. Try to match up the packet to any
- * maps, and export the packet if a match is found
- *
- * This should only be called once a fd has a packet waiting
- *
- * @param fd The file descriptor to receive the packet on
+ * Joins the multicast group of every listener bound to one, and sets the
+ * multicast options on the socket of every transmitter with a target that is
+ * a multicast group
  */
-static void recv_and_forward_packet(int fd)
+static void init_multicast(void)
 {
-    int                 n = 0;
-    int                 listener_id = listener_ids[fd];
-    char                buf[BUFFER_SIZE];
-    struct sockaddr_in  src_addr;
-    socklen_t           src_addr_size = sizeof(src_addr);
-    uint32_t            src_ip;
-    uint16_t            src_port;
-    map_t               *map = map_head;
-
-    memset(&buf, 0, sizeof(buf));
+    listener_t      *listener;
+    transmitter_t   *transmitter = NULL;
+    target_t        *target;
 
-    // Get packet
-    n = recvfrom(fd, buf, BUFFER_SIZE, 0, (struct sockaddr *)&src_addr, &src_addr_size);
-    if (n < 0) {
-        perror("ERROR: recvfrom");
-        fprintf(stderr, "ERROR: Couldn't receive packet on listener %d\n", listener_id);
-        return;
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (IN_MULTICAST(listener->address)) {
+            join_group(listener);
+        }
+    }
+    for (target = target_hash_table; target != NULL; target = target->hh.next) {
+        if (IN_MULTICAST(target->address)) {
+            HASH_FIND_INT(transmitter_hash_table, &target->transmitter_id, transmitter);
+            transmitter->multicast = true;
+        }
+    }
+    for (transmitter = transmitter_hash_table; transmitter != NULL; transmitter = transmitter->hh.next) {
+        if (transmitter->multicast) {
+            set_multicast_options(transmitter->sockfd, transmitter);
+        }
     }
+}
+
+/**
+ * Joins the multicast group a listener's socket is bound to, on the
+ * listener's interface (or the one the kernel routes the group to): for any
+ * source, or with IP_ADD_SOURCE_MEMBERSHIP for each of its sources. Every
+ * shard's socket only takes the groups joined on it (IP_MULTICAST_ALL off),
+ * and only the first shard joins, so each datagram is forwarded once. Exits
+ * on failure, like the other socket setup.
+ *
+ * @param listener  The listener socket bound to a multicast group
+ */
+static void join_group(listener_t *listener)
+{
+    struct ip_mreqn         mreq;
+    struct ip_mreq_source   mreq_source;
+    struct in_addr          group;
+    iface_t                 iface;
+    int                     disable = 0;
 
-    // listener_id of -1 denotes a transmitter, so we shouldn't do anything with this packet
-    if (listener_id == -1) {
+    if (setsockopt(listener->sockfd, IPPROTO_IP, IP_MULTICAST_ALL, &disable, sizeof(disable)) < 0) {
+        perror("Setting IP_MULTICAST_ALL");
+        exit(1);
+    }
+    if (listener->shard != 0) {
         return;
     }
 
-#ifdef DEBUG
-    fprintf(stderr, "Received packet on listener ID: %d from %s:%d\n",
-            listener_id, inet_ntoa(src_addr.sin_addr), ntohs(src_addr.sin_port));
-#endif
-
-    // Get the source IP and port, in host byte order
-    src_ip = ntohl(src_addr.sin_addr.s_addr);
-    src_port = ntohs(src_addr.sin_port);
+    memset(&iface, 0, sizeof(iface));
+    if (listener->interface != NULL && frame_get_iface(listener->interface, &iface) < 0) {
+        fprintf(stderr, "ERROR: Listener %d interface %s not found or has no IPv4 address\n",
+                listener->id, listener->interface);
+        exit(1);
+    }
 
-    // Iterate through the linked list of maps
-    while (map != NULL) {
-        // Check if listener and packet source match the map
-        if (map->listener_id == listener_id &&
-                (map->address == src_ip || map->address == 0) &&
-                (map->port == src_port || map->port == 0)) {
-            send_packet(buf, n, map->target_id);
+    group.s_addr = htonl(listener->address);
+    if (listener->num_sources == 0) {
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_multiaddr      = group;
+        mreq.imr_address.s_addr = INADDR_ANY;
+        mreq.imr_ifindex        = iface.ifindex;
+        if (setsockopt(listener->sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            fprintf(stderr, "ERROR: Listener %d couldn't join group %s: %s\n",
+                    listener->id, inet_ntoa(group), strerror(errno));
+            exit(1);
+        }
+    }
+    for (int s = 0; s < listener->num_sources; s++) {
+        memset(&mreq_source, 0, sizeof(mreq_source));
+        mreq_source.imr_multiaddr           = group;
+        mreq_source.imr_interface.s_addr    = htonl(iface.address);
+        mreq_source.imr_sourceaddr.s_addr   = htonl(listener->sources[s]);
+        if (setsockopt(listener->sockfd, IPPROTO_IP, IP_ADD_SOURCE_MEMBERSHIP,
+                    &mreq_source, sizeof(mreq_source)) < 0) {
+            fprintf(stderr, "ERROR: Listener %d couldn't join group %s for source %s: %s\n",
+                    listener->id, inet_ntoa(group), inet_ntoa(mreq_source.imr_sourceaddr), strerror(errno));
+            exit(1);
         }
-        map = map->next_map;
     }
+    fprintf(stderr, "Listener %d joined group %s", listener->id, inet_ntoa(group));
+    if (listener->num_sources > 0) {
+        fprintf(stderr, " for %d source(s)", listener->num_sources);
+    }
+    fprintf(stderr, "\n");
 }
 
 /**
- * Sends a UDP packet with the data specified to the target_id specified.
- *
- * Depends on the target_id belonging to a target_t in the hash table, and the
- * target_t's transmitter_id belonging to a transmitter_t in the hash table.
- * Will print an error and return if either of these aren't true.
+ * Sets the multicast options of a transmitter on one of its sockets: the
+ * TTL, whether the packets are looped back to local receivers, and the
+ * interface to send from, if the transmitter has one (otherwise the kernel
+ * routes the group). Exits on failure, like the other socket setup.
  *
- * @param buf       The pointer to the data to send
- * @param len       The number of bytes to send
- * @param target_id The target_id of the target_t to use for sending the packet
+ * @param sockfd        The socket
+ * @param transmitter   The transmitter it belongs to
  */
-static void send_packet(const void* buf, size_t len, int target_id)
+static void set_multicast_options(int sockfd, const transmitter_t *transmitter)
 {
-    target_t            *target         = NULL;
-    transmitter_t       *transmitter    = NULL;
-    int                 transmitter_id  = 0;
-    int                 socket          = 0;
-    struct sockaddr_in  dest_addr;
+    struct ip_mreqn mreq;
+    int             ttl = transmitter->multicast_ttl;
+    int             loop = transmitter->multicast_loop;
 
-    // Find the target from the hash table
-    HASH_FIND_INT(target_hash_table, &target_id, target);
-    if (target == NULL) {
-        fprintf(stderr, "ERROR: Target %d not found in hash table.\n", target_id);
-        return;
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        perror("Setting IP_MULTICAST_TTL");
+        exit(1);
     }
-
-    // Find the transmitter from the target
-    transmitter_id = target->transmitter_id;
-    HASH_FIND_INT(transmitter_hash_table, &transmitter_id, transmitter);
-    if (transmitter == NULL) {
-        fprintf(stderr, "ERROR: Transmitter %d not found in hash table.\n", transmitter_id);
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        perror("Setting IP_MULTICAST_LOOP");
+        exit(1);
+    }
+    if (transmitter->interface == NULL) {
         return;
     }
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_ifindex = if_nametoindex(transmitter->interface);
+    if (mreq.imr_ifindex == 0) {
+        fprintf(stderr, "ERROR: Transmitter %d interface %s not found\n", transmitter->id, transmitter->interface);
+        exit(1);
+    }
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0) {
+        perror("Setting IP_MULTICAST_IF");
+        exit(1);
+    }
+}
 
-    // Set up destination address struct
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family        = AF_INET;
-    dest_addr.sin_addr.s_addr   = htonl(target->address);
-    dest_addr.sin_port          = htons(target->port);
+/**
+ * Gives every target set to connect a transmitter of its own, with a socket
+ * bound to the same address and port as its transmitter's and connected to
+ * the target. The kernel then keeps the route rather than looking it up for
+ * every packet, and a slow target only fills its own send buffer. If the
+ * socket can't be connected, the target is sent to through its transmitter.
+ */
+static void connect_targets(void)
+{
+    target_t            *target;
+    transmitter_t       *transmitter = NULL;
+    transmitter_t       *own;
+    struct sockaddr_in  addr;
+    socklen_t           addrlen;
+    int                 sockfd;
+    int                 buffer_size = SOCKET_SEND_BUFFER;
+
+    for (target = target_hash_table; target != NULL; target = target->hh.next) {
+        if (!target->connect) {
+            continue;
+        }
+        HASH_FIND_INT(transmitter_hash_table, &target->transmitter_id, transmitter);
+        if (transmitter->egress == EGRESS_TPACKET) {
+            fprintf(stderr, "Target %d is sent to through transmitter %d's send ring, not connected\n",
+                    target->id, transmitter->id);
+            continue;
+        }
+
+        // An unbound transmitter gives 0.0.0.0:0, so the socket is left unbound too
+        addrlen = sizeof(addr);
+        if (getsockname(transmitter->sockfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+            perror("Getting transmitter address");
+            exit(1);
+        }
+        sockfd = open_socket(ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port), false);
+        if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size)) < 0) {
+            perror("Setting SO_SNDBUF");
+            exit(1);
+        }
+        if (transmitter->multicast) {
+            set_multicast_options(sockfd, transmitter);
+        }
 
-    // Get socket fd
-    socket = transmitter->sockfd;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(target->address);
+        addr.sin_port           = htons(target->port);
+        if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "ERROR: Couldn't connect a socket to target %d (%s), using transmitter %d\n",
+                    target->id, strerror(errno), transmitter->id);
+            close(sockfd);
+            continue;
+        }
 
-    // Send packet
-    if (sendto(socket, buf, len, 0, (struct sockaddr *)&dest_addr,
-                sizeof(dest_addr)) != len) {
-        fprintf(stderr, "ERROR: sendto failed on packet.\n");
-        perror("ERROR: sendto");
-    } else {
-#ifdef DEBUG
-        fprintf(stderr, "Sent packet to %s:%d\n", inet_ntoa(dest_addr.sin_addr), ntohs(dest_addr.sin_port));
-#endif
+        own = malloc(sizeof(transmitter_t));
+        if (own == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        memcpy(own, transmitter, sizeof(transmitter_t));
+        memset(&own->hh, 0, sizeof(own->hh));
+        own->sockfd = sockfd;
+        own->connected = true;
+        target->connected = own;
     }
 }
 
 /**
- * Verifies everything is properly configured
+ * Allocates a worker for every shard, each with its own packet pool and copy
+ * of the target and transmitter tables (sharing the transmitter sockets, each
+ * with its own send batch, except that zerocopy transmitters get a socket per
+ * worker), compiled into routes for its listeners' maps, and its pacing set
+ * up. Worker 0 uses the global tables.
  *
- * @return 0 if configuration good, -1 otherwise
+ * Workers serving a low-latency listener spin. The io_uring engine can't, nor
+ * pace targets or hand them to transmit threads, so it is turned off if any
+ * listener is low-latency or any target has a rate cap or a transmit thread.
  */
-static int verify_config()
+static void init_workers(void)
 {
-    int             rc = 0;
-    int             temp = 0;
-    target_t        *target = NULL;
-    transmitter_t   *transmitter = NULL;
-    map_t           *map = NULL;
+    listener_t      *listener;
+    transmitter_t   *transmitter;
+    transmitter_t   *transmitter_copy;
+    target_t        *target;
+    target_t        *target_copy;
+    worker_t        *worker;
+    int             max_payload = 0;
 
-    // Iterate through the maps, checking that targets exist
-    for (map = map_head; map != NULL; map = map->next_map) {
-        HASH_FIND_INT(target_hash_table, &map->target_id, target);
-        if (target == NULL) {
-            fprintf(stderr, "CONFIG: Target %d referenced in map but not defined.\n", map->target_id);
-            rc = -1;
+    for (transmitter = transmitter_hash_table; transmitter != NULL; transmitter = transmitter->hh.next) {
+        if (transmitter->zerocopy > 0) {
+            zerocopy_used = true;
         }
-        target = NULL;
     }
-
-    // Iterate through targets, checking that transmitters exist
     for (target = target_hash_table; target != NULL; target = target->hh.next) {
-        HASH_FIND_INT(transmitter_hash_table, &target->transmitter_id, transmitter);
-        if (transmitter == NULL) {
-            fprintf(stderr, "CONFIG: Transmitter %d referenced in target but not defined.\n", target->transmitter_id);
-            rc = -1;
+        if (target->thread > num_tx_threads) {
+            num_tx_threads = target->thread;
         }
-        transmitter = NULL;
-        // Check that the target is used in a map
-        temp = 0;
-        for (map = map_head; map != NULL; map = map->next_map) {
-            if (map->target_id == target->id) {
-                temp = 1;
+    }
+
+    // There is a worker for every shard of the most sharded listener
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->busy_poll < 0) {
+            listener->busy_poll = default_busy_poll;
+        }
+        if (listener->shard + 1 > num_workers) {
+            num_workers = listener->shard + 1;
+        }
+        if (listener->max_payload > max_payload) {
+            max_payload = listener->max_payload;
+        }
+    }
+
+    // Size the pool slots for the largest listener, rounded up to a cache line
+    if (max_payload == 0) {
+        max_payload = DEFAULT_MAX_PAYLOAD;
+    }
+    pool_slot_size = (max_payload + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+
+    workers = calloc(num_workers, sizeof(worker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    for (int w = 0; w < num_workers; w++) {
+        worker = &workers[w];
+        worker->id = w;
+        worker->epoll_fd = -1;
+        worker->cpu = worker_pinned[w] ? worker_cpus[w] : -1;
+        init_packet_pool(worker);
+        if (w == 0) {
+            worker->transmitters = transmitter_hash_table;
+            worker->targets = target_hash_table;
+            continue;
+        }
+        for (transmitter = transmitter_hash_table; transmitter != NULL; transmitter = transmitter->hh.next) {
+            transmitter_copy = malloc(sizeof(transmitter_t));
+            if (transmitter_copy == NULL) {
+                fprintf(stderr, "ERROR: malloc failed\n");
+                exit(1);
+            }
+            memcpy(transmitter_copy, transmitter, sizeof(transmitter_t));
+            if (transmitter_copy->zerocopy > 0) {
+                transmitter_copy->sockfd = clone_socket(transmitter);
             }
+            HASH_ADD_INT(worker->transmitters, id, transmitter_copy);
         }
-        if (temp == 0) {
-            fprintf(stderr, "CONFIG: Target %d defined, but not used in any maps.\n", target->id);
-            rc = -1;
+        for (target = target_hash_table; target != NULL; target = target->hh.next) {
+            target_copy = malloc(sizeof(target_t));
+            if (target_copy == NULL) {
+                fprintf(stderr, "ERROR: malloc failed\n");
+                exit(1);
+            }
+            memcpy(target_copy, target, sizeof(target_t));
+            if (target->connected != NULL) {
+                target_copy->connected = malloc(sizeof(transmitter_t));
+                if (target_copy->connected == NULL) {
+                    fprintf(stderr, "ERROR: malloc failed\n");
+                    exit(1);
+                }
+                memcpy(target_copy->connected, target->connected, sizeof(transmitter_t));
+                if (target_copy->connected->zerocopy > 0) {
+                    target_copy->connected->sockfd = clone_socket(target->connected);
+                }
+            }
+            HASH_ADD_INT(worker->targets, id, target_copy);
+        }
+    }
+    for (int w = 0; w < num_workers; w++) {
+        for (transmitter = workers[w].transmitters; transmitter != NULL; transmitter = transmitter->hh.next) {
+            init_send_batch(transmitter);
+            if (transmitter->zerocopy > 0) {
+                init_zerocopy(transmitter);
+            }
+        }
+        for (target = workers[w].targets; target != NULL; target = target->hh.next) {
+            if (target->connected != NULL) {
+                init_send_batch(target->connected);
+                if (target->connected->zerocopy > 0) {
+                    init_zerocopy(target->connected);
+                }
+            }
+            init_send_queue(target);
         }
+        compile_routes(&workers[w]);
+        init_send_rings(&workers[w]);
+        init_pacing(&workers[w]);
     }
 
-    // Check that all transmitters are used in a target
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->busy_poll < 0) {
+            continue;
+        }
+        worker = &workers[listener->shard];
+        worker->spin = true;
+        if (listener->busy_poll > worker->busy_poll) {
+            worker->busy_poll = listener->busy_poll;
+        }
+        if (engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Listener %d is low-latency, using the epoll loop\n", listener->id);
+            engine = ENGINE_EPOLL;
+        }
+    }
+    for (target = target_hash_table; target != NULL; target = target->hh.next) {
+        if (target->paced && engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Target %d is paced, using the epoll loop\n", target->id);
+            engine = ENGINE_EPOLL;
+        }
+        if (target->thread > 0 && engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Target %d has a transmit thread, using the epoll loop\n", target->id);
+            engine = ENGINE_EPOLL;
+        }
+        // io_uring retries a full socket itself, without the queue's bound or drops
+        if ((target->queue_length != DEFAULT_SEND_QUEUE || target->drop_policy != DROP_NEWEST) &&
+                engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Target %d has a send queue set, using the epoll loop\n", target->id);
+            engine = ENGINE_EPOLL;
+        }
+    }
     for (transmitter = transmitter_hash_table; transmitter != NULL; transmitter = transmitter->hh.next) {
-        temp = 0;
-        for (target = target_hash_table; target != NULL; target = target->hh.next) {
-            if (target->transmitter_id == transmitter->id) {
-                temp = 1;
+        if (transmitter->ring != NULL && engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Transmitter %d sends through a ring, using the epoll loop\n", transmitter->id);
+            engine = ENGINE_EPOLL;
+        }
+        if (transmitter->zerocopy > 0 && engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Transmitter %d uses MSG_ZEROCOPY, using the epoll loop\n", transmitter->id);
+            engine = ENGINE_EPOLL;
+        }
+    }
+    if (engine == ENGINE_IO_URING) {
+        fprintf(stderr, "io_uring engine sends each datagram on its own, without UDP_SEGMENT\n");
+    }
+}
+
+/**
+ * Allocates the send batch of one of a worker's transmitters
+ */
+static void init_send_batch(transmitter_t *transmitter)
+{
+    transmitter->batch = calloc(1, sizeof(send_batch_t));
+    if (transmitter->batch == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * Allocates the send queue of one of a worker's targets. The copies of the
+ * datagrams are allocated when they are first needed.
+ */
+static void init_send_queue(target_t *target)
+{
+    target->queue = calloc(1, sizeof(send_queue_t));
+    if (target->queue == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    target->queue->entries = calloc(target->queue_length, sizeof(send_entry_t));
+    if (target->queue->entries == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * Compiles a worker's targets into its array of routes, points the maps of
+ * the listeners it serves at them, and builds those listeners' classifiers.
+ * Depends on verify_config() having checked that every map's target and
+ * every target's transmitter exist.
+ *
+ * @param worker    The worker to compile the routes of
+ */
+static void compile_routes(worker_t *worker)
+{
+    listener_t      *listener;
+    transmitter_t   *transmitter;
+    target_t        *target;
+    route_t         *route;
+    map_t           *map;
+    int             r = 0;
+
+    worker->routes = calloc(HASH_COUNT(worker->targets) + 1, sizeof(route_t));
+    if (worker->routes == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    for (target = worker->targets; target != NULL; target = target->hh.next) {
+        if (target->connected != NULL) {
+            transmitter = target->connected;
+        } else {
+            HASH_FIND_INT(worker->transmitters, &target->transmitter_id, transmitter);
+        }
+        route = &worker->routes[r++];
+        route->sockfd                       = transmitter->sockfd;
+        route->dest_addr.sin_family         = AF_INET;
+        route->dest_addr.sin_addr.s_addr    = htonl(target->address);
+        route->dest_addr.sin_port           = htons(target->port);
+        route->transmitter                  = transmitter;
+        route->target                       = target;
+        target->sender                      = transmitter;
+    }
+
+    // Only done at startup, so the routes are simply searched
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->shard != worker->id) {
+            continue;
+        }
+        for (int m = 0; m < listener->num_maps; m++) {
+            map = &listener->maps[m];
+            for (route = worker->routes; route->target != NULL; route++) {
+                if (route->target->id == map->target_id) {
+                    map->route = route;
+                    break;
+                }
             }
         }
-        if (temp == 0) {
-            fprintf(stderr, "CONFIG: Transmitter %d defined, but not used in any targets.\n", transmitter->id);
+        classifier_build(listener);
+    }
+}
+
+/**
+ * Opens a send ring for each of a worker's transmitters with tpacket egress,
+ * and builds the frame headers of the targets sent through them. An unbound
+ * transmitter socket is bound to an ephemeral port here, so the frames have
+ * a source port, and the interface's address is used if the transmitter has
+ * none. If a ring can't be opened, this is logged and the transmitter sends
+ * through its socket. Multicast targets are always sent to through the
+ * socket, which applies the transmitter's multicast options.
+ *
+ * @param worker    The worker to set up the rings of
+ */
+static void init_send_rings(worker_t *worker)
+{
+    transmitter_t       *transmitter;
+    target_t            *target;
+    struct sockaddr_in  addr;
+    socklen_t           addrlen;
+    uint32_t            src_ip;
+
+    for (transmitter = worker->transmitters; transmitter != NULL; transmitter = transmitter->hh.next) {
+        if (transmitter->egress != EGRESS_TPACKET) {
+            continue;
+        }
+        transmitter->ring = malloc(sizeof(tpacket_tx_t));
+        if (transmitter->ring == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        if (tpacket_open_tx(transmitter->ring, transmitter->interface) < 0) {
+            fprintf(stderr, "Send ring not available for transmitter %d, sending through its socket\n",
+                    transmitter->id);
+            free(transmitter->ring);
+            transmitter->ring = NULL;
+        }
+    }
+
+    for (target = worker->targets; target != NULL; target = target->hh.next) {
+        transmitter = target->sender;
+        if (transmitter->ring == NULL || IN_MULTICAST(target->address)) {
+            continue;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addrlen = sizeof(addr);
+        if (getsockname(transmitter->sockfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+            perror("Getting transmitter address");
+            exit(1);
+        }
+        if (addr.sin_port == 0) {
+            addr.sin_family = AF_INET;
+            if (bind(transmitter->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+                    getsockname(transmitter->sockfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+                perror("Binding transmitter");
+                exit(1);
+            }
+        }
+        src_ip = ntohl(addr.sin_addr.s_addr);
+        if (src_ip == 0) {
+            src_ip = transmitter->ring->iface.address;
+        }
+
+        target->ring_path = malloc(sizeof(tpacket_path_t));
+        if (target->ring_path == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        tpacket_init_path(transmitter->ring, target->ring_path, src_ip, ntohs(addr.sin_port),
+                target->address, target->port);
+    }
+}
+
+/**
+ * Sets up a transmit thread for every number given to a target, with a queue
+ * from every worker and an eventfd to wake it, and gives each of its targets
+ * a route: a copy of the target's connected socket, or of its transmitter's
+ * socket, which the thread's other targets with that transmitter share.
+ * Every worker's copy of the target is pointed at the route and at the
+ * worker's queue to the thread.
+ */
+static void init_tx_threads(void)
+{
+    tx_thread_t     *thread;
+    target_t        *target;
+    target_t        *other;
+    target_t        *target_copy;
+    transmitter_t   *transmitter;
+    tx_route_t      *route;
+
+    if (num_tx_threads == 0) {
+        return;
+    }
+    tx_threads = calloc(num_tx_threads, sizeof(tx_thread_t));
+    if (tx_threads == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+
+    for (target = target_hash_table; target != NULL; target = target->hh.next) {
+        if (target->thread == 0) {
+            continue;
+        }
+        thread = &tx_threads[target->thread - 1];
+        if (!thread->used) {
+            thread->id = target->thread;
+            thread->used = true;
+            thread->queues = calloc(num_workers, sizeof(tx_queue_t));
+            thread->wake_fd = eventfd(0, 0);
+            if (thread->queues == NULL) {
+                fprintf(stderr, "ERROR: malloc failed\n");
+                exit(1);
+            }
+            if (thread->wake_fd < 0) {
+                perror("ERROR: eventfd");
+                exit(1);
+            }
+        }
+
+        route = calloc(1, sizeof(tx_route_t));
+        if (route == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        route->target_id                    = target->id;
+        route->transmitter_id               = target->transmitter_id;
+        route->dest_addr.sin_family         = AF_INET;
+        route->dest_addr.sin_addr.s_addr    = htonl(target->address);
+        route->dest_addr.sin_port           = htons(target->port);
+        route->sockfd                       = -1;
+        if (target->connected != NULL) {
+            route->sockfd = clone_socket(target->connected);
+            route->connected = true;
+        } else {
+            for (other = target_hash_table; other != target; other = other->hh.next) {
+                if (other->thread == target->thread && other->tx_route->transmitter_id == target->transmitter_id &&
+                        !other->tx_route->connected) {
+                    route->sockfd = other->tx_route->sockfd;
+                    break;
+                }
+            }
+            if (route->sockfd < 0) {
+                HASH_FIND_INT(transmitter_hash_table, &target->transmitter_id, transmitter);
+                route->sockfd = clone_socket(transmitter);
+            }
+        }
+        target->tx_route = route;
+
+        for (int w = 0; w < num_workers; w++) {
+            HASH_FIND_INT(workers[w].targets, &target->id, target_copy);
+            target_copy->tx_route = route;
+            target_copy->tx_queue = &thread->queues[w];
+        }
+    }
+}
+
+/**
+ * Runs the epoll loop of a worker. Never returns.
+ *
+ * @param arg   The worker_t to run
+ */
+static void *run_worker(void *arg)
+{
+    worker_t            *worker = arg;
+    struct epoll_event  events[MAX_EVENTS];
+    int                 num_events;
+    listener_t          *listener;
+    listener_t          *last;
+    transmitter_t       *transmitter;
+    int                 timeout;
+
+    if (worker->cpu >= 0) {
+        pin_worker(worker);
+    }
+
+    // Register every socket this worker serves
+    init_event_loop(worker);
+    worker->last_active = monotonic_us();
+
+    while(1) {
+        // Don't block while listeners or XSKs are still waiting for their next
+        // turn, or while a low-latency worker hasn't been idle for spin_idle
+        timeout = -1;
+        if (worker->ready_head != NULL || worker->xdp_ready) {
+            timeout = 0;
+        } else if (worker->spin &&
+                (spin_idle == 0 || monotonic_us() - worker->last_active < (uint64_t)spin_idle)) {
+            timeout = 0;
+        } else if (worker->blocked_head != NULL) {
+            timeout = SEND_RETRY;
+        }
+        num_events = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ERROR: epoll_wait");
+            exit(1);
+        }
+        if (num_events > 0 && worker->spin) {
+            worker->last_active = monotonic_us();
+        }
+        for (int i = 0; i < num_events; i++) {
+            // Every struct registered starts with its socket_type_t
+            if (*(socket_type_t *)events[i].data.ptr == SOCKET_XSK) {
+                worker->xdp_ready = true;
+            } else if (*(socket_type_t *)events[i].data.ptr == SOCKET_PACER) {
+                worker->pacer.fired = true;
+            } else if (*(socket_type_t *)events[i].data.ptr == SOCKET_TRANSMITTER) {
+                transmitter = events[i].data.ptr;
+                if (events[i].events & EPOLLERR) {
+                    if (transmitter->zc != NULL) {
+                        reap_zerocopy(worker, transmitter);
+                    }
+                    clear_socket_error(transmitter->sockfd);
+                }
+                if (events[i].events & EPOLLIN) {
+                    discard_packets(transmitter->sockfd);
+                }
+                if (events[i].events & EPOLLOUT) {
+                    transmitter->writable = true;
+                }
+            } else {
+                listener = events[i].data.ptr;
+                if (events[i].events & EPOLLERR) {
+                    clear_socket_error(listener->sockfd);
+                }
+                if (events[i].events & EPOLLIN) {
+                    mark_ready(worker, listener);
+                }
+            }
+        }
+
+        // Datagrams held for full sockets go before anything new
+        if (worker->blocked_head != NULL) {
+            send_held(worker);
+        }
+
+        // Then those of paced targets whose time has come
+        if (worker->pacer.fired) {
+            worker->pacer.fired = false;
+            run_pacer(worker);
+        }
+
+        // Give every ready listener one turn. Edge-triggered events won't be
+        // repeated, so listeners that still have data go to the back of the list
+        last = worker->ready_tail;
+        while (worker->ready_head != NULL) {
+            listener = worker->ready_head;
+            worker->ready_head = listener->next_ready;
+            if (worker->ready_head == NULL) {
+                worker->ready_tail = NULL;
+            }
+            listener->next_ready = NULL;
+            listener->ready = false;
+            if (drain_listener(worker, listener)) {
+                mark_ready(worker, listener);
+            }
+            if (listener == last) {
+                break;
+            }
+        }
+
+        // The XSKs get the same budget per turn
+        if (worker->xdp_ready) {
+            worker->xdp_ready = xdp_poll(fd_budget);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Creates a worker's epoll instance and registers the listener shards it
+ * serves with it, edge-triggered. Worker 0 also registers every transmitter
+ * socket (including the connected ones of targets) and XSK, and the other
+ * workers the sockets of their zerocopy transmitters. A worker pacing targets
+ * registers its timer too. Each event points straight at the listener_t,
+ * transmitter_t, XSK or pacer_t of the socket.
+ *
+ * Low-latency listeners with a busy poll time get SO_BUSY_POLL, and so does
+ * the epoll instance, where the kernel supports it.
+ */
+static void init_event_loop(worker_t *worker)
+{
+    struct epoll_event  ev;
+    struct epoll_params params;
+    listener_t          *listener;
+    transmitter_t       *transmitter;
+    target_t            *target;
+    int                 fd;
+
+    worker->epoll_fd = epoll_create1(0);
+    if (worker->epoll_fd < 0) {
+        perror("ERROR: epoll_create1");
+        exit(1);
+    }
+    if (worker->busy_poll > 0) {
+        memset(&params, 0, sizeof(params));
+        params.busy_poll_usecs  = worker->busy_poll;
+        params.busy_poll_budget = recv_batch;
+        params.prefer_busy_poll = 1;
+        if (ioctl(worker->epoll_fd, EPIOCSPARAMS, &params) < 0) {
+            fprintf(stderr, "epoll busy polling not available for worker %d (%s), sockets busy poll on receive\n",
+                    worker->id, strerror(errno));
+        }
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->shard != worker->id) {
+            continue;
+        }
+        fd = (listener->ring != NULL) ? listener->ring->fd : listener->sockfd;
+        if (listener->busy_poll > 0) {
+            enable_busy_poll(fd, listener->busy_poll);
+        }
+        ev.data.ptr = listener;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("ERROR: epoll_ctl");
+            exit(1);
+        }
+    }
+    for (transmitter = worker->transmitters; transmitter != NULL; transmitter = transmitter->hh.next) {
+        if (worker->id == 0 || transmitter->zerocopy > 0) {
+            register_transmitter(worker, transmitter);
+        }
+    }
+    for (target = worker->targets; target != NULL; target = target->hh.next) {
+        if (target->connected != NULL && (worker->id == 0 || target->connected->zerocopy > 0)) {
+            register_transmitter(worker, target->connected);
+        }
+    }
+    if (worker->pacer.fd >= 0) {
+        ev.events   = EPOLLIN | EPOLLET;
+        ev.data.ptr = &worker->pacer;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->pacer.fd, &ev) < 0) {
+            perror("ERROR: epoll_ctl");
+            exit(1);
+        }
+    }
+    if (worker->id == 0 && xdp_active) {
+        xdp_register(worker->epoll_fd);
+    }
+}
+
+/**
+ * Registers one of a worker's transmitter sockets with its epoll instance,
+ * edge-triggered, so errors are cleared, zerocopy notifications are read,
+ * and anything received is discarded
+ */
+static void register_transmitter(worker_t *worker, transmitter_t *transmitter)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = transmitter;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, transmitter->sockfd, &ev) < 0) {
+        perror("ERROR: epoll_ctl");
+        exit(1);
+    }
+    transmitter->registered = true;
+}
+
+/**
+ * Makes receives on a socket poll the device queue for up to busy_poll_us
+ * when no data is waiting, preferring busy polling to interrupts. Raising
+ * these above the sysctl defaults needs CAP_NET_ADMIN; failures are logged
+ * and the socket is used as is.
+ */
+static void enable_busy_poll(int fd, int busy_poll_us)
+{
+    int enable = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0) {
+        perror("Setting SO_BUSY_POLL");
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable)) < 0) {
+        perror("Setting SO_PREFER_BUSY_POLL");
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &recv_batch, sizeof(recv_batch)) < 0) {
+        perror("Setting SO_BUSY_POLL_BUDGET");
+    }
+}
+
+/**
+ * Pins the calling thread, which runs the worker, to the worker's CPU
+ */
+static void pin_worker(worker_t *worker)
+{
+    cpu_set_t   set;
+    int         rc;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        fprintf(stderr, "ERROR: Couldn't pin worker %d to CPU %d: %s\n", worker->id, worker->cpu, strerror(rc));
+        exit(1);
+    }
+    fprintf(stderr, "Worker %d pinned to CPU %d\n", worker->id, worker->cpu);
+}
+
+/**
+ * Returns the CLOCK_MONOTONIC time in microseconds
+ */
+static uint64_t monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Returns the CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Gives each listener a contiguous array of copies of the maps that belong
+ * to its ID, so packets are only compared against their own listener's rules
+ * and the scan reads consecutive memory. Map order is kept. Every shard has
+ * its own copies, so no two workers read the same rules.
+ */
+static void resolve_listener_maps(void)
+{
+    listener_t  *listener;
+    map_t       *map;
+    int         count;
+
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        count = 0;
+        for (map = map_head; map != NULL; map = map->next_map) {
+            if (map->listener_id == listener->id) {
+                count++;
+            }
+        }
+        listener->maps = malloc((count > 0 ? count : 1) * sizeof(map_t));
+        if (listener->maps == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        listener->num_maps = 0;
+        for (map = map_head; map != NULL; map = map->next_map) {
+            if (map->listener_id != listener->id) {
+                continue;
+            }
+            memcpy(&listener->maps[listener->num_maps], map, sizeof(map_t));
+            listener->maps[listener->num_maps++].next_map = NULL;
+        }
+    }
+}
+
+/**
+ * Opens a capture ring for every listener socket using INGEST_TPACKET, and
+ * mutes its UDP socket. The shards of a listener share a fanout group, so
+ * each flow is captured by one shard only.
+ *
+ * If any listener uses INGEST_XDP, the AF_XDP datapath is set up, served by
+ * worker 0. Those listeners keep their UDP sockets, which get whatever the XDP
+ * program passes on, and everything if AF_XDP can't be used. It is set up
+ * after the workers, so only worker 0's targets send through XSKs.
+ *
+ * The io_uring engine can't read the rings or XSKs, so it is turned off if
+ * any listener uses one.
+ */
+static void init_ingest(void)
+{
+    listener_t  *listener;
+    int         fanout_id = -1;
+    bool        sharded;
+    bool        use_xdp = false;
+
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->ingest == INGEST_XDP) {
+            use_xdp = true;
+        }
+        if (listener->ingest != INGEST_TPACKET) {
+            continue;
+        }
+        listener->ring = malloc(sizeof(tpacket_ring_t));
+        if (listener->ring == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+
+        // A listener's shards follow its first socket in the list
+        if (listener->shard == 0) {
+            fanout_id = -1;
+        }
+        sharded = listener->shard > 0 ||
+            (listener->next_listener != NULL && listener->next_listener->shard > 0);
+        tpacket_open(listener->ring, listener->address, listener->port, sharded ? &fanout_id : NULL);
+        tpacket_mute_socket(listener->sockfd);
+        if (engine == ENGINE_IO_URING) {
+            fprintf(stderr, "Listener %d uses a capture ring, using the epoll loop\n", listener->id);
+            engine = ENGINE_EPOLL;
+        }
+    }
+
+    if (!use_xdp) {
+        return;
+    }
+    if (xdp_init(listener_head, transmitter_hash_table, target_hash_table, xdp_mode) < 0) {
+        fprintf(stderr, "AF_XDP not available, XDP listeners use their sockets\n");
+        return;
+    }
+    xdp_active = true;
+    if (engine == ENGINE_IO_URING) {
+        fprintf(stderr, "AF_XDP is in use, using the epoll loop\n");
+        engine = ENGINE_EPOLL;
+    }
+}
+
+/**
+ * Adds a listener to the back of its worker's ready list, unless it is
+ * already on it
+ */
+static void mark_ready(worker_t *worker, listener_t *listener)
+{
+    if (listener->ready) {
+        return;
+    }
+    listener->ready = true;
+    listener->next_ready = NULL;
+    if (worker->ready_tail == NULL) {
+        worker->ready_head = listener;
+    } else {
+        worker->ready_tail->next_ready = listener;
+    }
+    worker->ready_tail = listener;
+}
+
+/**
+ * Receives and forwards packets from a readable listener until it would
+ * block, or until fd_budget packets have been handled, so one busy listener
+ * can't starve the others.
+ *
+ * @param worker    The worker the listener belongs to
+ * @param listener  The listener to drain
+ * @return          true if the listener may still have data waiting
+ */
+static bool drain_listener(worker_t *worker, listener_t *listener)
+{
+    int budget = fd_budget;
+    int want;
+    int n;
+    bool empty;
+
+    if (listener->ring != NULL) {
+        return drain_ring(worker, listener);
+    }
+
+    while (budget > 0) {
+        want = (budget < recv_batch) ? budget : recv_batch;
+        n = recv_and_forward_packet(worker, listener, want, &empty);
+        if (empty) {
+            return false;
+        }
+        // An error or a short pool ends the turn, but the data is still there
+        if (n < want) {
+            return true;
+        }
+        budget -= n;
+    }
+    return true;
+}
+
+/**
+ * Forwards the datagrams waiting in a listener's capture ring, until the ring
+ * is empty or fd_budget datagrams have been handled. The payloads are matched
+ * and sent straight from the ring.
+ *
+ * @param worker    The worker the listener belongs to
+ * @param listener  The listener to drain
+ * @return          true if the ring may still have datagrams waiting
+ */
+static bool drain_ring(worker_t *worker, listener_t *listener)
+{
+    const char  *payload;
+    size_t      len;
+    uint32_t    src_ip;
+    uint16_t    src_port;
+
+    for (int budget = fd_budget; budget > 0; budget--) {
+        // Reading past the end of a block hands it back, so send what points into it first
+        if (listener->ring->frames_left == 0) {
+            flush_sends(worker);
+        }
+        if (!tpacket_next(listener->ring, &payload, &len, &src_ip, &src_port)) {
+            return false;
+        }
+        listener->packets_received++;
+        forward_packet(worker, listener, NULL, payload, len, 0, src_ip, src_port);
+    }
+    flush_sends(worker);
+    return true;
+}
+
+/**
+ * Reads and throws away everything queued on a socket (data received by a
+ * transmitter is never forwarded)
+ *
+ * @param fd The file descriptor to empty
+ */
+static void discard_packets(int fd)
+{
+    char byte;
+
+    while (recv(fd, &byte, sizeof(byte), MSG_TRUNC) >= 0) {
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("ERROR: recv");
+    }
+}
+
+/**
+ * Reads and clears the pending error on a socket that epoll flagged with
+ * EPOLLERR (e.g. an ICMP error queued for a transmitter)
+ *
+ * @param fd The file descriptor with the error
+ */
+static void clear_socket_error(int fd)
+{
+    int         err = 0;
+    socklen_t   optlen = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &optlen) < 0) {
+        perror("Getting SO_ERROR");
+    } else if (err != 0) {
+        fprintf(stderr, "ERROR: Socket %d: %s\n", fd, strerror(err));
+    }
+}
+
+/**
+ * Preallocates a worker's packet buffer pool, with one buffer for every packet
+ * in a receive batch, and ZEROCOPY_BUFS more if any transmitter sends with
+ * MSG_ZEROCOPY, for the buffers the kernel hasn't finished sending. Each
+ * transmit thread queue can hold a buffer per entry, so there is a buffer
+ * for each of those too.
+ *
+ * Each buffer has a slot in the hot arena, sized for the largest max_payload
+ * of any listener, and a BUFFER_SIZE region in the jumbo arena. The jumbo
+ * arena is never written unless an oversized packet arrives, so its pages are
+ * not faulted in and it costs no cache. Buffers are never cleared; only the
+ * bytes received are read.
+ */
+static void init_packet_pool(worker_t *worker)
+{
+    char        *hot_arena;
+    char        *jumbo_arena;
+    pktbuf_t    *pkts;
+    int         num_pkts = recv_batch + (zerocopy_used ? ZEROCOPY_BUFS : 0) + num_tx_threads * TX_THREAD_QUEUE;
+
+    hot_arena = malloc((size_t)num_pkts * pool_slot_size);
+    jumbo_arena = malloc((size_t)num_pkts * BUFFER_SIZE);
+    pkts = malloc((size_t)num_pkts * sizeof(pktbuf_t));
+    if (hot_arena == NULL || jumbo_arena == NULL || pkts == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_pkts; i++) {
+        pkts[i].slot    = hot_arena + (size_t)i * pool_slot_size;
+        pkts[i].spill   = jumbo_arena + (size_t)i * BUFFER_SIZE;
+        pkts[i].data    = pkts[i].slot;
+        pkts[i].len     = 0;
+        pkts[i].refs    = 0;
+        pkts[i].thread_refs = 0;
+        pool_put(worker, &pkts[i]);
+    }
+
+    // Point each message header in the receive batch at its iovecs and source address struct
+    for (int i = 0; i < recv_batch; i++) {
+        worker->recv_msgs[i].msg_hdr.msg_iov    = worker->recv_iovs[i];
+        worker->recv_msgs[i].msg_hdr.msg_name   = &worker->recv_addrs[i];
+    }
+}
+
+/**
+ * Takes a packet buffer from a worker's pool
+ *
+ * @return The buffer, or NULL if the pool is empty
+ */
+static pktbuf_t *pool_get(worker_t *worker)
+{
+    pktbuf_t *pkt = worker->pool_free;
+    if (pkt != NULL) {
+        worker->pool_free = pkt->next;
+        pkt->next = NULL;
+    }
+    return pkt;
+}
+
+/**
+ * Returns a packet buffer to a worker's pool
+ */
+static void pool_put(worker_t *worker, pktbuf_t *pkt)
+{
+    pkt->next = worker->pool_free;
+    worker->pool_free = pkt;
+}
+
+/**
+ * Receieve a batch of packets from the fd specified. Try to match up each
+ * packet to any maps, and export the packet if a match is found
+ *
+ * Up to max_packets packets are read with a single recvmmsg() call, so the
+ * syscall cost is shared by every packet in a burst. Each packet lands in a
+ * pool slot sized for the listener's max_payload; anything longer runs over
+ * into the buffer's jumbo region and is made contiguous there.
+ *
+ * With UDP_GRO the kernel may hand over several datagrams from one source
+ * coalesced into one buffer, with their segment size in a control message.
+ * Every segment has the same source, so the maps are matched once for all of
+ * them, and send_packet() keeps the segments apart.
+ *
+ * The datagrams for every target are queued on their transmitters, and sent
+ * with one sendmmsg() call per transmitter before the buffers are returned.
+ *
+ * This should only be called once a fd has a packet waiting
+ *
+ * @param worker      The worker the listener belongs to
+ * @param listener    The listener to receive the packets on
+ * @param max_packets The most packets to receive (1 to recv_batch)
+ * @param empty       Set to true if the socket was emptied (recvmmsg() hit EAGAIN)
+ * @return            The number of packets received (0 if none or on error)
+ */
+static int recv_and_forward_packet(worker_t *worker, listener_t *listener, int max_packets, bool *empty)
+{
+    struct mmsghdr      *recv_msgs = worker->recv_msgs;
+    int                 n = 0;
+    int                 num_bufs = 0;
+    size_t              max_payload = listener->max_payload;
+    pktbuf_t            *bufs[MAX_RECV_BATCH];
+    pktbuf_t            *pkt;
+    struct sockaddr_in  *src_addr;
+    struct cmsghdr      *cmsg;
+    int                 segment_size;
+
+    *empty = false;
+
+    // Take a buffer from the pool for every message in the batch
+    while (num_bufs < max_packets && (pkt = pool_get(worker)) != NULL) {
+        worker->recv_iovs[num_bufs][0].iov_base = pkt->slot;
+        worker->recv_iovs[num_bufs][0].iov_len  = max_payload;
+        worker->recv_iovs[num_bufs][1].iov_base = pkt->spill + max_payload;
+        worker->recv_iovs[num_bufs][1].iov_len  = BUFFER_SIZE - max_payload;
+        // The kernel overwrites the name and control lengths, so reset them for every message
+        recv_msgs[num_bufs].msg_hdr.msg_iovlen      = (max_payload < BUFFER_SIZE) ? 2 : 1;
+        recv_msgs[num_bufs].msg_hdr.msg_namelen     = sizeof(struct sockaddr_in);
+        recv_msgs[num_bufs].msg_hdr.msg_control     = listener->gro ? worker->recv_ctrls[num_bufs] : NULL;
+        recv_msgs[num_bufs].msg_hdr.msg_controllen  = listener->gro ? sizeof(worker->recv_ctrls[num_bufs]) : 0;
+        bufs[num_bufs++] = pkt;
+    }
+    if (num_bufs == 0) {
+        fprintf(stderr, "ERROR: Packet buffer pool is empty\n");
+        return 0;
+    }
+
+    // Get packets
+    n = recvmmsg(listener->sockfd, recv_msgs, num_bufs, 0, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            *empty = true;
+        } else {
+            perror("ERROR: recvmmsg");
+            fprintf(stderr, "ERROR: Couldn't receive packet on listener %d\n", listener->id);
+        }
+        n = 0;
+    } else if (n < num_bufs) {
+        // recvmmsg() only stops short of the buffers it was given at EAGAIN
+        *empty = true;
+    }
+
+    for (int i = 0; i < n; i++) {
+        pkt = bufs[i];
+        pkt->len = recv_msgs[i].msg_len;
+        pkt->data = pkt->slot;
+        pkt->gso_size = 0;
+
+        // Find the segment size of a coalesced packet
+        for (cmsg = CMSG_FIRSTHDR(&recv_msgs[i].msg_hdr); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&recv_msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(int));
+                pkt->gso_size = segment_size;
+            }
+        }
+        if (pkt->gso_size >= pkt->len) {
+            pkt->gso_size = 0;
+        }
+        listener->packets_received += (pkt->gso_size > 0) ? (pkt->len + pkt->gso_size - 1) / pkt->gso_size : 1;
+
+        // Oversized packet, copy the head in front of the tail in the jumbo region
+        if (pkt->len > max_payload) {
+            memcpy(pkt->spill, pkt->slot, max_payload);
+            pkt->data = pkt->spill;
+            if (pkt->gso_size == 0) {
+                listener->packets_jumbo++;
+            }
+        }
+
+        // Get the source IP and port, in host byte order
+        src_addr = &worker->recv_addrs[i];
+        forward_packet(worker, listener, pkt, pkt->data, pkt->len, pkt->gso_size,
+                ntohl(src_addr->sin_addr.s_addr), ntohs(src_addr->sin_port));
+    }
+
+    // Send everything queued, then return the buffers to the pool, except
+    // those still being sent with MSG_ZEROCOPY, which reap_zerocopy() returns,
+    // or queued for a transmit thread, which reclaim_offloaded() returns
+    flush_sends(worker);
+    for (int i = 0; i < num_bufs; i++) {
+        if (bufs[i]->refs == 0) {
+            pool_put(worker, bufs[i]);
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Looks up what a received packet matches in the listener's classifier, and
+ * queues it for the target of every map it matches
+ *
+ * @param worker    The worker the listener belongs to
+ * @param listener  The listener the packet arrived on
+ * @param pkt       The pool buffer holding the packet, or NULL (a capture ring)
+ * @param data      The packet payload
+ * @param len       The length of the payload (bytes)
+ * @param gso_size  The size of each coalesced datagram, or 0 for one datagram
+ * @param src_ip    The source address of the packet (host byte order)
+ * @param src_port  The source port of the packet (host byte order)
+ */
+static void forward_packet(worker_t *worker, listener_t *listener, pktbuf_t *pkt, const char *data,
+        size_t len, size_t gso_size, uint32_t src_ip, uint16_t src_port)
+{
+    const match_t   *match;
+
+#ifdef DEBUG
+    struct in_addr src_addr;
+    src_addr.s_addr = htonl(src_ip);
+    fprintf(stderr, "Received packet on listener ID: %d from %s:%d\n",
+            listener->id, inet_ntoa(src_addr), src_port);
+#endif
+
+    // Send it on the route of every map its source matches
+    match = classifier_match(listener, src_ip, src_port);
+    for (int r = 0; r < match->num_routes; r++) {
+        send_packet(worker, listener, pkt, data, len, gso_size, match->routes[r]);
+    }
+}
+
+/**
+ * Queues a UDP packet with the data specified for the route's target, on the
+ * route's transmitter. It is sent by flush_sends(), so the data must stay
+ * valid until then.
+ *
+ * If gso_size is set, the data is several datagrams of that size (the last
+ * may be shorter) received coalesced with UDP_GRO. They are sent on still
+ * coalesced with UDP_SEGMENT, so the kernel splits them on the way out. If
+ * the kernel or the route to the target can't do that, the target is marked
+ * and the datagrams are queued one at a time from then on.
+ *
+ * While the target has datagrams held for a full socket, the packet is held
+ * behind them.
+ *
+ * A target with a transmit thread is handed straight to that thread instead.
+ *
+ * The datagrams to a target with a rate cap are spaced out, one at a time.
+ * Paced with a timer, a datagram that is early is held until the worker's
+ * timer wheel says its time has come. Paced with SO_TXTIME, it is sent at
+ * once with its send time, and dropped if that is more than TXTIME_HORIZON ms
+ * away.
+ *
+ * @param worker    The worker sending the packet
+ * @param listener  The listener the packet arrived on, credited once it is sent
+ * @param pkt       The pool buffer holding the data, or NULL
+ * @param buf       The pointer to the data to send
+ * @param len       The number of bytes to send
+ * @param gso_size  The size of each datagram in buf, or 0 for one datagram
+ * @param route     The worker's compiled route to the target
+ */
+static void send_packet(worker_t *worker, listener_t *listener, pktbuf_t *pkt, const void* buf,
+        size_t len, size_t gso_size, const route_t *route)
+{
+    target_t    *target = route->target;
+    uint64_t    txtime = 0;
+    uint64_t    start;
+    uint64_t    now;
+    size_t      seg_len;
+
+    if (target->tx_queue != NULL) {
+        offload_datagram(worker, listener, pkt, buf, len, gso_size, target);
+        return;
+    }
+
+    // Coalesced datagrams to a paced target each get their own time, and
+    // those to a target that can't take them are held and sent one at a time
+    if (gso_size > 0 && (target->paced || target->no_gso)) {
+        for (size_t offset = 0; offset < len; offset += gso_size) {
+            seg_len = (len - offset < gso_size) ? len - offset : gso_size;
+            send_packet(worker, listener, pkt, (const char *)buf + offset, seg_len, 0, route);
+        }
+        return;
+    }
+
+    // Held behind the datagrams still waiting for the socket (or their time)
+    if (target->queue->count > 0) {
+        hold_datagram(target, listener, buf, len, gso_size);
+        return;
+    }
+
+    if (target->paced) {
+        now = monotonic_ns();
+        start = pace_start(target, now);
+        if (target->pacing == PACING_TXTIME) {
+            if (start > now + (uint64_t)TXTIME_HORIZON * 1000000) {
+                target->packets_dropped++;
+                return;
+            }
+            txtime = start;
+        } else if (start > now) {
+            if (hold_datagram(target, listener, buf, len, 0)) {
+                pace_target(worker, target);
+            }
+            return;
+        }
+        pace_sent(target, start, len);
+    }
+
+    queue_datagram(worker, route, listener, pkt, buf, len, gso_size, txtime);
+}
+
+/**
+ * Adds a datagram (or coalesced datagrams, with their UDP_SEGMENT size) to a
+ * transmitter's send batch, chained to the last one for the same target, and
+ * puts the transmitter on the worker's flush list. A full batch is sent first.
+ * A datagram with a txtime is sent with it as its SO_TXTIME send time.
+ */
+static void queue_datagram(worker_t *worker, const route_t *route, listener_t *listener,
+        pktbuf_t *pkt, const void *buf, size_t len, size_t gso_size, uint64_t txtime)
+{
+    transmitter_t   *transmitter = route->transmitter;
+    target_t        *target = route->target;
+    send_batch_t    *batch = transmitter->batch;
+    int             i;
+
+    if (batch->count == SEND_BATCH) {
+        flush_transmitter(worker, transmitter);
+    }
+    if (!batch->listed) {
+        batch->listed = true;
+        transmitter->next_flush = worker->flush_head;
+        worker->flush_head = transmitter;
+    }
+
+    i = batch->count++;
+    batch->iovs[i].iov_base = (void *)buf;
+    batch->iovs[i].iov_len  = len;
+    batch->addrs[i]         = route->dest_addr;
+    batch->gso_sizes[i]     = gso_size;
+    batch->targets[i]       = target;
+    batch->listeners[i]     = listener;
+    batch->pkts[i]          = pkt;
+    batch->txtimes[i]       = txtime;
+    batch->next_same[i]     = -1;
+    batch->used[i]          = false;
+    if (target->send_tail >= 0) {
+        batch->next_same[target->send_tail] = i;
+    }
+    target->send_tail = i;
+}
+
+/**
+ * Sends the datagrams queued on every transmitter on the worker's flush list,
+ * with one sendmmsg() call each (more if the kernel stops part way), and
+ * publishes those queued for the transmit threads
+ */
+static void flush_sends(worker_t *worker)
+{
+    transmitter_t *transmitter;
+
+    while (worker->flush_head != NULL) {
+        transmitter = worker->flush_head;
+        worker->flush_head = transmitter->next_flush;
+        transmitter->next_flush = NULL;
+        transmitter->batch->listed = false;
+        flush_transmitter(worker, transmitter);
+    }
+    if (num_tx_threads > 0) {
+        publish_offloaded(worker);
+    }
+}
+
+/**
+ * Sends a transmitter's send batch. sendmmsg() stops at the first message it
+ * can't send, reporting how many went before it (or the error, if none did),
+ * so the rest is sent from there on. When the socket is full, the rest of the
+ * batch is held in its targets' send queues. If the kernel or the route can't
+ * take a UDP_SEGMENT message, its target is marked and its datagrams are sent
+ * one at a time. Runs of messages sent with MSG_ZEROCOPY get their own calls.
+ */
+static void flush_transmitter(worker_t *worker, transmitter_t *transmitter)
+{
+    send_batch_t    *batch = transmitter->batch;
+    int             num_msgs;
+    int             sent = 0;
+    int             run;
+    int             flags;
+    int             rc;
+    int             d;
+
+    if (transmitter->ring != NULL) {
+        send_ring(transmitter);
+    }
+    num_msgs = build_messages(transmitter);
+    while (sent < num_msgs) {
+        run = next_run(worker, transmitter, sent, num_msgs, &flags);
+        rc = sendmmsg(transmitter->sockfd, &batch->msgs[sent], run, flags);
+        if (rc > 0) {
+            for (int m = sent; m < sent + rc; m++) {
+                if (flags & MSG_ZEROCOPY) {
+                    pin_buffers(worker, transmitter, m);
+                }
+                d = batch->msg_first[m];
+                for (int k = 0; k < batch->msg_count[m]; k++) {
+                    credit_datagram(batch, d);
+                    d = batch->next_same[d];
+                }
+#ifdef DEBUG
+                fprintf(stderr, "Sent %d packet(s) to %s:%d\n", batch->msg_count[m],
+                        inet_ntoa(batch->addrs[batch->msg_first[m]].sin_addr),
+                        ntohs(batch->addrs[batch->msg_first[m]].sin_port));
+#endif
+            }
+            sent += rc;
+            continue;
+        }
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // batch->msgs[sent] couldn't be sent
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            for (int m = sent; m < num_msgs; m++) {
+                d = batch->msg_first[m];
+                for (int k = 0; k < batch->msg_count[m]; k++) {
+                    if (hold_datagram(batch->targets[d], batch->listeners[d], batch->iovs[d].iov_base,
+                            batch->iovs[d].iov_len, batch->gso_sizes[d])) {
+                        block_target(worker, transmitter, batch->targets[d]);
+                    }
+                    d = batch->next_same[d];
+                }
+            }
+            break;
+        }
+        if (batch->msg_segments[sent] > 0 &&
+                (errno == EIO || errno == EINVAL || errno == EMSGSIZE || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+            perror("UDP_SEGMENT");
+            fprintf(stderr, "Target %d can't take coalesced packets, splitting them\n",
+                    batch->targets[batch->msg_first[sent]]->id);
+            batch->targets[batch->msg_first[sent]]->no_gso = true;
+            send_one_by_one(worker, transmitter, sent);
+        } else {
+            fprintf(stderr, "ERROR: sendmmsg failed on packet.\n");
+            perror("ERROR: sendmmsg");
+        }
+        sent++;
+    }
+
+    for (int i = 0; i < batch->count; i++) {
+        batch->targets[i]->send_tail = -1;
+    }
+    batch->count = 0;
+}
+
+/**
+ * Writes the datagrams of a transmitter's send batch whose targets are sent
+ * to through its send ring into the ring, and has the kernel send them all
+ * with one call. They are marked used, so build_messages() leaves them out.
+ * Coalesced datagrams get a frame each. The payload of a packet going to
+ * many targets is summed for the UDP checksum once, as long as its datagrams
+ * follow each other in the batch.
+ *
+ * Datagrams with a txtime or too large for a frame, those to targets whose
+ * next hop's MAC address isn't known yet, and those that don't fit once the
+ * ring is full are left to the socket.
+ */
+static void send_ring(transmitter_t *transmitter)
+{
+    send_batch_t    *batch = transmitter->batch;
+    tpacket_tx_t    *ring = transmitter->ring;
+    tpacket_path_t  *path;
+    const char      *buf;
+    const char      *summed = NULL;
+    size_t          summed_len = 0;
+    uint32_t        sum = 0;
+    size_t          len;
+    size_t          gso_size;
+    size_t          seg_len;
+    unsigned long   frames;
+
+    for (int d = 0; d < batch->count; d++) {
+        path = batch->targets[d]->ring_path;
+        if (path == NULL || batch->txtimes[d] > 0) {
+            continue;
+        }
+        buf         = batch->iovs[d].iov_base;
+        len         = batch->iovs[d].iov_len;
+        gso_size    = batch->gso_sizes[d];
+        if ((gso_size > 0 ? gso_size : len) > ring->max_payload || !tpacket_path_ready(ring, path)) {
+            continue;
+        }
+
+        // The frames are only free again once sent, so send what is written before giving up
+        frames = num_datagrams(len, gso_size);
+        if (!tpacket_tx_room(ring, frames)) {
+            tpacket_tx_kick(ring);
+            if (!tpacket_tx_room(ring, frames)) {
+                break;
+            }
+        }
+
+        if (gso_size == 0) {
+            if (buf != summed || len != summed_len) {
+                sum         = frame_payload_sum(buf, len);
+                summed      = buf;
+                summed_len  = len;
+            }
+            tpacket_tx_frame(ring, path, buf, len, sum);
+        } else {
+            for (size_t offset = 0; offset < len; offset += gso_size) {
+                seg_len = (len - offset < gso_size) ? len - offset : gso_size;
+                tpacket_tx_frame(ring, path, buf + offset, seg_len, frame_payload_sum(buf + offset, seg_len));
+            }
+        }
+        batch->used[d] = true;
+        credit_datagram(batch, d);
+    }
+    tpacket_tx_kick(ring);
+}
+
+/**
+ * Builds the messages for a send batch. Every datagram gets its own message,
+ * except that a datagram starts a UDP_SEGMENT message for its target's later
+ * datagrams of the same size (the last may be shorter), up to
+ * GSO_MAX_SEGMENTS datagrams and BUFFER_SIZE bytes. Datagrams received
+ * coalesced, and datagrams for targets marked no_gso or paced, aren't
+ * combined. The messages of a connected socket carry no address, and those
+ * of paced datagrams carry their SO_TXTIME send time.
+ *
+ * @return The number of messages
+ */
+static int build_messages(transmitter_t *transmitter)
+{
+    send_batch_t    *batch = transmitter->batch;
+    struct msghdr   *hdr;
+    int             num_msgs = 0;
+    int             num_iovs = 0;
+    int             count;
+    size_t          seg_len;
+    size_t          total;
+    size_t          len;
+    uint16_t        segment;
+
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->used[i]) {
+            continue;
+        }
+        hdr = &batch->msgs[num_msgs].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        if (!transmitter->connected) {
+            hdr->msg_name       = &batch->addrs[i];
+            hdr->msg_namelen    = sizeof(struct sockaddr_in);
+        }
+        hdr->msg_iov        = &batch->msg_iovs[num_iovs];
+
+        batch->msg_iovs[num_iovs++] = batch->iovs[i];
+        batch->used[i] = true;
+        batch->msg_pooled[num_msgs] = batch->pkts[i] != NULL;
+        count = 1;
+        seg_len = batch->iovs[i].iov_len;
+        total = seg_len;
+        batch->msg_segments[num_msgs] = batch->gso_sizes[i];
+
+        // Add the target's next datagrams while they are the same size
+        if (batch->gso_sizes[i] == 0 && !batch->targets[i]->no_gso && !batch->targets[i]->paced && seg_len > 0) {
+            for (int j = batch->next_same[i]; j >= 0 && count < GSO_MAX_SEGMENTS; j = batch->next_same[j]) {
+                len = batch->iovs[j].iov_len;
+                if (batch->used[j] || batch->gso_sizes[j] != 0 || len == 0 || len > seg_len || total + len > BUFFER_SIZE) {
+                    break;
+                }
+                batch->msg_iovs[num_iovs++] = batch->iovs[j];
+                batch->used[j] = true;
+                batch->msg_pooled[num_msgs] &= batch->pkts[j] != NULL;
+                count++;
+                total += len;
+                // Only the last segment may be shorter
+                if (len < seg_len) {
+                    break;
+                }
+            }
+            if (count > 1) {
+                batch->msg_segments[num_msgs] = seg_len;
+            }
+        }
+        hdr->msg_iovlen = count;
+        batch->msg_bytes[num_msgs] = total;
+
+        if (batch->msg_segments[num_msgs] > 0 || batch->txtimes[i] > 0) {
+            hdr->msg_control = batch->ctrls[num_msgs];
+        }
+        if (batch->msg_segments[num_msgs] > 0) {
+            segment = batch->msg_segments[num_msgs];
+            add_cmsg(hdr, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+        }
+        if (batch->txtimes[i] > 0) {
+            add_cmsg(hdr, SOL_SOCKET, SCM_TXTIME, &batch->txtimes[i], sizeof(uint64_t));
+        }
+        batch->msg_first[num_msgs] = i;
+        batch->msg_count[num_msgs] = count;
+        num_msgs++;
+    }
+    return num_msgs;
+}
+
+/**
+ * Sends the datagrams of one message of a send batch one at a time, splitting
+ * those received coalesced. What a full socket won't take is held in the
+ * target's send queue, as flush_transmitter() does.
+ */
+static void send_one_by_one(worker_t *worker, transmitter_t *transmitter, int m)
+{
+    send_batch_t    *batch = transmitter->batch;
+    int             d = batch->msg_first[m];
+    target_t        *target;
+    const char      *buf;
+    size_t          len;
+    size_t          gso_size;
+    size_t          sent;
+
+    for (int k = 0; k < batch->msg_count[m]; k++, d = batch->next_same[d]) {
+        target = batch->targets[d];
+        buf = batch->iovs[d].iov_base;
+        len = batch->iovs[d].iov_len;
+        gso_size = batch->gso_sizes[d];
+
+        // Held behind the datagrams the socket didn't take
+        if (target->queue->count > 0) {
+            hold_datagram(target, batch->listeners[d], buf, len, gso_size);
+            continue;
+        }
+        if (gso_size > 0) {
+            sent = send_split(transmitter->sockfd, buf, len, gso_size, &batch->addrs[d]);
+        } else {
+            sent = (sendto(transmitter->sockfd, buf, len, 0, (struct sockaddr *)&batch->addrs[d],
+                        sizeof(batch->addrs[d])) == len) ? len : 0;
+        }
+        if (sent == len) {
+            credit_datagram(batch, d);
+            continue;
+        }
+        if (sent > 0) {
+            batch->listeners[d]->packets_forwarded += num_datagrams(sent, gso_size);
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            if (hold_datagram(target, batch->listeners[d], buf + sent, len - sent, gso_size)) {
+                block_target(worker, transmitter, target);
+            }
+        } else {
+            fprintf(stderr, "ERROR: sendto failed on packet.\n");
+            perror("ERROR: sendto");
+            target->packets_dropped += num_datagrams(len - sent, gso_size);
+        }
+    }
+}
+
+/**
+ * Sends one datagram to a route's target straight away, outside the send
+ * batches, for the AF_XDP datapath (served by worker 0). Like the batches, it
+ * is held behind the datagrams already held for the target, or in the
+ * target's send queue if the socket is full, and credited once it is sent.
+ *
+ * @param route     Worker 0's compiled route to the target
+ * @param listener  The listener the datagram arrived on
+ * @param buf       The datagram
+ * @param len       The length of the datagram (bytes)
+ */
+void send_datagram(const route_t *route, listener_t *listener, const void *buf, size_t len)
+{
+    target_t *target = route->target;
+
+    if (target->queue->count > 0) {
+        hold_datagram(target, listener, buf, len, 0);
+        return;
+    }
+    if (sendto(route->sockfd, buf, len, 0, (const struct sockaddr *)&route->dest_addr,
+                sizeof(route->dest_addr)) == len) {
+        listener->packets_forwarded++;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        if (hold_datagram(target, listener, buf, len, 0)) {
+            block_target(&workers[0], route->transmitter, target);
+        }
+    } else {
+        fprintf(stderr, "ERROR: sendto failed on packet.\n");
+        perror("ERROR: sendto");
+        target->packets_dropped++;
+    }
+}
+
+/**
+ * Counts a sent datagram (every segment, if it was received coalesced) as
+ * forwarded by its listener
+ */
+static void credit_datagram(send_batch_t *batch, int d)
+{
+    size_t len = batch->iovs[d].iov_len;
+    size_t gso_size = batch->gso_sizes[d];
+
+    batch->listeners[d]->packets_forwarded += num_datagrams(len, gso_size);
+}
+
+/**
+ * Counts the datagrams in a buffer of len bytes, coalesced into gso_size
+ * segments if gso_size isn't 0
+ */
+static unsigned long num_datagrams(size_t len, size_t gso_size)
+{
+    return (gso_size > 0) ? (len + gso_size - 1) / gso_size : 1;
+}
+
+/**
+ * Sends several datagrams of gso_size bytes (the last may be shorter) one
+ * sendto() call at a time, stopping at the first that fails (with errno set)
+ *
+ * @return The number of bytes sent, len if all of them were
+ */
+static size_t send_split(int socket, const void *buf, size_t len, size_t gso_size,
+        const struct sockaddr_in *dest_addr)
+{
+    size_t offset = 0;
+    size_t seg_len;
+
+    while (offset < len) {
+        seg_len = (len - offset < gso_size) ? len - offset : gso_size;
+        if (sendto(socket, (const char *)buf + offset, seg_len, 0, (struct sockaddr *)dest_addr,
+                    sizeof(*dest_addr)) != seg_len) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        offset += seg_len;
+    }
+    return offset;
+}
+
+/**
+ * Holds a copy of a datagram (or coalesced datagrams) that can't be sent yet
+ * in the target's send queue. When the queue is full, the datagram or the
+ * oldest one held is dropped, as the target's policy says. The caller puts a
+ * target that has just started holding datagrams on the list of whatever it
+ * is waiting for.
+ *
+ * @param target    The worker's copy of the target
+ * @param listener  The listener the datagram arrived on, credited once it is sent
+ * @param buf       The datagram
+ * @param len       The length of the datagram (bytes)
+ * @param gso_size  The size of each coalesced datagram, or 0 for one datagram
+ * @return          true if it is the only datagram held
+ */
+static bool hold_datagram(target_t *target, listener_t *listener, const void *buf, size_t len,
+        size_t gso_size)
+{
+    send_queue_t    *queue = target->queue;
+    send_entry_t    *entry;
+    char            *data;
+    bool            first = (queue->count == 0);
+
+    if (queue->count == target->queue_length && target->drop_policy == DROP_NEWEST) {
+        target->packets_dropped += num_datagrams(len, gso_size);
+        return false;
+    }
+
+    // In a full queue this is the oldest datagram's slot, which is only given
+    // up once it has room for the new one
+    entry = &queue->entries[(queue->head + queue->count) % target->queue_length];
+    if (entry->size < len) {
+        data = realloc(entry->data, len);
+        if (data == NULL) {
+            target->packets_dropped += num_datagrams(len, gso_size);
+            return false;
+        }
+        entry->data = data;
+        entry->size = len;
+    }
+    if (queue->count == target->queue_length) {
+        target->packets_dropped += num_datagrams(entry->len, entry->gso_size);
+        queue->head = (queue->head + 1) % target->queue_length;
+        queue->count--;
+    }
+    memcpy(entry->data, buf, len);
+    entry->len      = len;
+    entry->gso_size = gso_size;
+    entry->listener = listener;
+    target->packets_queued += num_datagrams(len, gso_size);
+    queue->count++;
+    return first;
+}
+
+/**
+ * Puts a target that has just started holding datagrams for a full socket on
+ * its transmitter's blocked list, and the transmitter on the worker's,
+ * watched for EPOLLOUT
+ */
+static void block_target(worker_t *worker, transmitter_t *transmitter, target_t *target)
+{
+    fprintf(stderr, "Target %d is blocked, holding up to %d packets for it\n", target->id, target->queue_length);
+    target->next_blocked = transmitter->blocked;
+    transmitter->blocked = target;
+    if (target->next_blocked == NULL) {
+        transmitter->writable = false;
+        transmitter->next_blocked = worker->blocked_head;
+        worker->blocked_head = transmitter;
+        watch_writable(worker, transmitter, true);
+    }
+}
+
+/**
+ * Sends the datagrams held for the targets of the worker's blocked
+ * transmitters that got EPOLLOUT, and of all of them every SEND_RETRY ms (a
+ * full device queue fails with ENOBUFS, and no EPOLLOUT follows). A paced
+ * target whose next datagram isn't due yet goes on the worker's timer wheel.
+ * A transmitter whose targets have nothing left held is no longer watched.
+ */
+static void send_held(worker_t *worker)
+{
+    transmitter_t   **link = &worker->blocked_head;
+    transmitter_t   *transmitter;
+    target_t        *target;
+    send_result_t   result;
+    uint64_t        now = monotonic_us();
+    bool            retry = now >= worker->next_retry;
+
+    if (retry) {
+        worker->next_retry = now + SEND_RETRY * 1000;
+    }
+    while (*link != NULL) {
+        transmitter = *link;
+        if (!transmitter->writable && !retry) {
+            link = &transmitter->next_blocked;
+            continue;
+        }
+        transmitter->writable = false;
+        while (transmitter->blocked != NULL &&
+                (result = send_held_target(transmitter, transmitter->blocked)) != SEND_FULL) {
+            target = transmitter->blocked;
+            transmitter->blocked = target->next_blocked;
+            target->next_blocked = NULL;
+            fprintf(stderr, "Target %d is unblocked, %lu packets dropped so far\n",
+                    target->id, target->packets_dropped);
+            if (result == SEND_PACED) {
+                pace_target(worker, target);
+            }
+        }
+        if (transmitter->blocked != NULL) {
+            link = &transmitter->next_blocked;
+            continue;
+        }
+        *link = transmitter->next_blocked;
+        transmitter->next_blocked = NULL;
+        watch_writable(worker, transmitter, false);
+    }
+}
+
+/**
+ * Sends the datagrams held for a target, oldest first, one sendmsg() call
+ * each, as fast as its pace allows. A datagram that fails with anything but
+ * a full socket is dropped.
+ *
+ * @return SEND_DONE if none are left held, SEND_FULL if the socket is full
+ *         again, or SEND_PACED if the next one isn't due yet
+ */
+static send_result_t send_held_target(transmitter_t *transmitter, target_t *target)
+{
+    send_queue_t        *queue = target->queue;
+    send_entry_t        *entry;
+    struct sockaddr_in  dest_addr;
+    struct msghdr       hdr;
+    struct iovec        iov;
+    char                ctrl[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    uint16_t            segment;
+    uint64_t            start = 0;
+    uint64_t            now;
+    ssize_t             rc;
+    size_t              sent;
+
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family        = AF_INET;
+    dest_addr.sin_addr.s_addr   = htonl(target->address);
+    dest_addr.sin_port          = htons(target->port);
+
+    while (queue->count > 0) {
+        entry = &queue->entries[queue->head];
+        if (target->paced) {
+            now = monotonic_ns();
+            start = pace_start(target, now);
+            if (target->pacing == PACING_TIMER && start > now) {
+                return SEND_PACED;
+            }
+        }
+        if (entry->gso_size > 0 && target->no_gso) {
+            sent = send_split(transmitter->sockfd, entry->data, entry->len, entry->gso_size, &dest_addr);
+            entry->listener->packets_forwarded += num_datagrams(sent, entry->gso_size);
+            rc = 0;
+            if (sent < entry->len) {
+                // Keep the segments that weren't sent for the next try
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                    memmove(entry->data, entry->data + sent, entry->len - sent);
+                    entry->len -= sent;
+                    return SEND_FULL;
+                }
+                fprintf(stderr, "ERROR: sendto failed on held packet.\n");
+                perror("ERROR: sendto");
+                target->packets_dropped += num_datagrams(entry->len - sent, entry->gso_size);
+            }
+            queue->head = (queue->head + 1) % target->queue_length;
+            queue->count--;
+            continue;
+        } else {
+            memset(&hdr, 0, sizeof(hdr));
+            if (!transmitter->connected) {
+                hdr.msg_name    = &dest_addr;
+                hdr.msg_namelen = sizeof(dest_addr);
+            }
+            iov.iov_base    = entry->data;
+            iov.iov_len     = entry->len;
+            hdr.msg_iov     = &iov;
+            hdr.msg_iovlen  = 1;
+            hdr.msg_control = ctrl;
+            if (entry->gso_size > 0) {
+                segment = entry->gso_size;
+                add_cmsg(&hdr, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+            }
+            if (target->paced && target->pacing == PACING_TXTIME) {
+                add_cmsg(&hdr, SOL_SOCKET, SCM_TXTIME, &start, sizeof(start));
+            }
+            if (hdr.msg_controllen == 0) {
+                hdr.msg_control = NULL;
+            }
+            rc = sendmsg(transmitter->sockfd, &hdr, 0);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+                return SEND_FULL;
+            }
+            if (rc < 0 && entry->gso_size > 0 &&
+                    (errno == EIO || errno == EINVAL || errno == EMSGSIZE || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                perror("UDP_SEGMENT");
+                fprintf(stderr, "Target %d can't take coalesced packets, splitting them\n", target->id);
+                target->no_gso = true;
+                continue;
+            }
+            if (rc < 0) {
+                fprintf(stderr, "ERROR: sendmsg failed on held packet.\n");
+                perror("ERROR: sendmsg");
+            }
+        }
+        if (rc < 0) {
+            target->packets_dropped += num_datagrams(entry->len, entry->gso_size);
+        } else {
+            entry->listener->packets_forwarded += num_datagrams(entry->len, entry->gso_size);
+            if (target->paced) {
+                pace_sent(target, start, entry->len);
+            }
+        }
+        queue->head = (queue->head + 1) % target->queue_length;
+        queue->count--;
+    }
+    return SEND_DONE;
+}
+
+/**
+ * Appends a control message to the control buffer of a message, which must
+ * have room for it
+ */
+static void add_cmsg(struct msghdr *hdr, int level, int type, const void *data, size_t len)
+{
+    struct cmsghdr *cmsg = (struct cmsghdr *)((char *)hdr->msg_control + hdr->msg_controllen);
+
+    cmsg->cmsg_level    = level;
+    cmsg->cmsg_type     = type;
+    cmsg->cmsg_len      = CMSG_LEN(len);
+    memcpy(CMSG_DATA(cmsg), data, len);
+    hdr->msg_controllen += CMSG_SPACE(len);
+}
+
+/**
+ * Sets up the pacing of a worker's targets with a rate cap. SO_TXTIME is
+ * turned on for the sockets of the targets paced with it; if the kernel
+ * can't, this is logged and the target is paced with a timer instead. A
+ * worker pacing any target with a timer gets a timerfd for its timer wheel.
+ */
+static void init_pacing(worker_t *worker)
+{
+    pacer_t             *pacer = &worker->pacer;
+    struct sock_txtime  txtime;
+    target_t            *target;
+
+    pacer->type = SOCKET_PACER;
+    pacer->fd   = -1;
+    pacer->tick = monotonic_us() / PACE_TICK;
+
+    memset(&txtime, 0, sizeof(txtime));
+    txtime.clockid = CLOCK_MONOTONIC;
+    for (target = worker->targets; target != NULL; target = target->hh.next) {
+        if (!target->paced) {
+            continue;
+        }
+        if (target->pacing == PACING_TXTIME &&
+                setsockopt(target->sender->sockfd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) {
+            fprintf(stderr, "Target %d can't be paced with SO_TXTIME (%s), pacing it with a timer\n",
+                    target->id, strerror(errno));
+            target->pacing = PACING_TIMER;
+        }
+        if (target->pacing == PACING_TIMER && pacer->fd < 0) {
+            pacer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (pacer->fd < 0) {
+                perror("ERROR: timerfd_create");
+                exit(1);
+            }
+        }
+    }
+}
+
+/**
+ * Returns when the next datagram to a paced target may be sent: once the
+ * last one's interval is over, but no earlier than PACE_TICK us ago, so a
+ * target sent to late (the timer wheel runs once a tick) catches up by at
+ * most one tick's worth of datagrams, and an idle one doesn't save up more.
+ *
+ * @param target    The worker's copy of the target
+ * @param now       The CLOCK_MONOTONIC time (ns)
+ * @return          The time it may be sent (ns), later than now if it's early
+ */
+static uint64_t pace_start(const target_t *target, uint64_t now)
+{
+    uint64_t earliest = now - (uint64_t)PACE_TICK * 1000;
+
+    return (target->pace_next > earliest) ? target->pace_next : earliest;
+}
+
+/**
+ * Spaces a paced target's next datagram out from one sent at start, by the
+ * time one packet takes at max_pps or its payload takes at max_bps,
+ * whichever is longer
+ *
+ * @param target    The worker's copy of the target
+ * @param start     The time the datagram was sent at (ns)
+ * @param len       The length of the datagram (bytes)
+ */
+static void pace_sent(target_t *target, uint64_t start, size_t len)
+{
+    uint64_t interval = 0;
+    uint64_t bytes_interval;
+
+    if (target->max_pps > 0) {
+        interval = 1000000000 / (uint64_t)target->max_pps;
+    }
+    if (target->max_bps > 0) {
+        bytes_interval = (uint64_t)len * 1000000000 / (uint64_t)target->max_bps;
+        if (bytes_interval > interval) {
+            interval = bytes_interval;
+        }
+    }
+    target->pace_next = start + interval;
+}
+
+/**
+ * Puts a target whose held datagrams are waiting for their time on the
+ * worker's timer wheel, in the slot of the tick its next one is due in, and
+ * makes sure the timer fires by then
+ */
+static void pace_target(worker_t *worker, target_t *target)
+{
+    pacer_t     *pacer = &worker->pacer;
+    uint64_t    due = (target->pace_next + 999) / 1000;
+    int         slot;
+
+    target->pace_tick = due / PACE_TICK;
+    if (target->pace_tick < pacer->tick) {
+        target->pace_tick = pacer->tick;
+    }
+    slot = target->pace_tick % PACE_SLOTS;
+    target->next_paced = pacer->slots[slot];
+    pacer->slots[slot] = target;
+    pacer->count++;
+    if (pacer->armed == 0 || due < pacer->armed) {
+        arm_pacer(worker, due);
+    }
+}
+
+/**
+ * Runs the ticks of the worker's timer wheel that are over. The held
+ * datagrams of the targets due in them are sent, as many as their pace
+ * allows; a target whose next one isn't due yet goes back on the wheel, and
+ * one whose socket is full on its transmitter's blocked list. Then the timer
+ * is set for the earliest target left, looking up to a turn of the wheel
+ * ahead (a target further away than that is looked at again a turn later).
+ */
+static void run_pacer(worker_t *worker)
+{
+    pacer_t         *pacer = &worker->pacer;
+    target_t        *due = NULL;
+    target_t        *target;
+    target_t        **link;
+    send_result_t   result;
+    uint64_t        expirations;
+    uint64_t        now_tick = monotonic_us() / PACE_TICK;
+    uint64_t        last;
+    uint64_t        when;
+
+    if (read(pacer->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("ERROR: read (pacing timer)");
+    }
+    pacer->armed = 0;
+
+    // Take the targets due out of the slots of the ticks that are over
+    if (now_tick >= pacer->tick) {
+        last = (now_tick - pacer->tick < PACE_SLOTS) ? now_tick : pacer->tick + PACE_SLOTS - 1;
+        for (uint64_t tick = pacer->tick; tick <= last; tick++) {
+            link = &pacer->slots[tick % PACE_SLOTS];
+            while (*link != NULL) {
+                target = *link;
+                if (target->pace_tick > now_tick) {
+                    link = &target->next_paced;
+                    continue;
+                }
+                *link = target->next_paced;
+                target->next_paced = due;
+                due = target;
+                pacer->count--;
+            }
+        }
+        pacer->tick = now_tick + 1;
+    }
+
+    while (due != NULL) {
+        target = due;
+        due = target->next_paced;
+        target->next_paced = NULL;
+        result = send_held_target(target->sender, target);
+        if (result == SEND_FULL) {
+            block_target(worker, target->sender, target);
+        } else if (result == SEND_PACED) {
+            pace_target(worker, target);
+        }
+    }
+
+    for (uint64_t tick = pacer->tick; pacer->count > 0 && tick < pacer->tick + PACE_SLOTS; tick++) {
+        if (pacer->armed != 0 && pacer->armed <= tick * PACE_TICK) {
+            break;
+        }
+        for (target = pacer->slots[tick % PACE_SLOTS]; target != NULL; target = target->next_paced) {
+            when = (target->pace_next + 999) / 1000;
+            if (target->pace_tick == tick && (pacer->armed == 0 || when < pacer->armed)) {
+                arm_pacer(worker, when);
+            }
+        }
+    }
+    if (pacer->count > 0 && pacer->armed == 0) {
+        arm_pacer(worker, (pacer->tick + PACE_SLOTS) * PACE_TICK);
+    }
+}
+
+/**
+ * Sets the worker's pacing timer to fire at a CLOCK_MONOTONIC time (us)
+ */
+static void arm_pacer(worker_t *worker, uint64_t when)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec    = when / 1000000;
+    spec.it_value.tv_nsec   = (when % 1000000) * 1000;
+    if (timerfd_settime(worker->pacer.fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("ERROR: timerfd_settime");
+        exit(1);
+    }
+    worker->pacer.armed = when;
+}
+
+/**
+ * Turns EPOLLOUT events for one of a worker's transmitters on or off. Worker
+ * 0 already has every transmitter registered, and the other workers their
+ * zerocopy ones; the rest are only registered while they are watched.
+ * Failures are logged, and the held datagrams are then sent every SEND_RETRY
+ * ms.
+ */
+static void watch_writable(worker_t *worker, transmitter_t *transmitter, bool on)
+{
+    struct epoll_event  ev;
+    int                 op;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLET | (on ? EPOLLOUT : 0) | (transmitter->registered ? EPOLLIN : 0);
+    ev.data.ptr = transmitter;
+    if (transmitter->registered) {
+        op = EPOLL_CTL_MOD;
+    } else {
+        op = on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+    }
+    if (epoll_ctl(worker->epoll_fd, op, transmitter->sockfd, &ev) < 0) {
+        perror("ERROR: epoll_ctl (EPOLLOUT)");
+    }
+}
+
+/**
+ * Turns SO_ZEROCOPY on for one of a worker's zerocopy transmitters, and sets
+ * up the tracking of its sends. If the kernel can't, this is logged and the
+ * transmitter sends with copies.
+ */
+static void init_zerocopy(transmitter_t *transmitter)
+{
+    int enable = 1;
+
+    if (setsockopt(transmitter->sockfd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0) {
+        fprintf(stderr, "Zerocopy not available for transmitter %d (%s), sending with copies\n",
+                transmitter->id, strerror(errno));
+        return;
+    }
+    transmitter->zc = calloc(1, sizeof(zerocopy_t));
+    if (transmitter->zc == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * Opens a socket bound to the same address and port as a transmitter's
+ * (which needs SO_REUSEADDR, as open_socket() sets), with the same multicast
+ * options, and connected to the same address if it is connected
+ *
+ * @param transmitter   The transmitter whose socket to copy
+ * @return              The new socket
+ */
+static int clone_socket(const transmitter_t *transmitter)
+{
+    struct sockaddr_in  addr;
+    socklen_t           addrlen = sizeof(addr);
+    int                 buffer_size = SOCKET_SEND_BUFFER;
+    int                 sockfd = transmitter->sockfd;
+    int                 clone;
+
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("Getting transmitter address");
+        exit(1);
+    }
+    clone = open_socket(ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port), false);
+    if (setsockopt(clone, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size)) < 0) {
+        perror("Setting SO_SNDBUF");
+        exit(1);
+    }
+    if (transmitter->multicast) {
+        set_multicast_options(clone, transmitter);
+    }
+    addrlen = sizeof(addr);
+    if (getpeername(sockfd, (struct sockaddr *)&addr, &addrlen) == 0 &&
+            connect(clone, (struct sockaddr *)&addr, addrlen) < 0) {
+        perror("Connecting transmitter socket");
+        exit(1);
+    }
+    return clone;
+}
+
+/**
+ * Finds how many messages of a transmitter's send batch, from first on, go
+ * in one sendmmsg() call: a run sent with MSG_ZEROCOPY, or a run that isn't.
+ * A message is sent with MSG_ZEROCOPY if it is at least the transmitter's
+ * threshold, all its datagrams are in pool buffers, and the sends and buffers
+ * in flight leave room for it.
+ *
+ * @param worker        The worker sending the batch
+ * @param transmitter   The transmitter of the batch
+ * @param first         The first message of the run
+ * @param num_msgs      The number of messages in the batch
+ * @param flags         Set to the flags for sendmmsg()
+ * @return              The number of messages in the run (at least 1)
+ */
+static int next_run(worker_t *worker, transmitter_t *transmitter, int first, int num_msgs, int *flags)
+{
+    send_batch_t    *batch = transmitter->batch;
+    zerocopy_t      *zc = transmitter->zc;
+    int             sends;
+    int             pins;
+    int             bufs;
+    bool            zerocopy;
+    int             m;
+
+    *flags = 0;
+    if (zc == NULL) {
+        return num_msgs - first;
+    }
+    sends = ZEROCOPY_SENDS - (int)(zc->next_id - zc->oldest);
+    pins = ZEROCOPY_PINS - zc->pins_count;
+    bufs = ZEROCOPY_BUFS - worker->zc_pinned;
+    for (m = first; m < num_msgs; m++) {
+        zerocopy = batch->msg_pooled[m] && batch->msg_bytes[m] >= transmitter->zerocopy &&
+                sends > 0 && pins >= batch->msg_count[m] && bufs >= batch->msg_count[m];
+        if (m == first) {
+            *flags = zerocopy ? MSG_ZEROCOPY : 0;
+        } else if (zerocopy != (*flags != 0)) {
+            break;
+        }
+        if (zerocopy) {
+            sends--;
+            pins -= batch->msg_count[m];
+            bufs -= batch->msg_count[m];
+        }
+    }
+    return m - first;
+}
+
+/**
+ * Keeps the pool buffers of a message sent with MSG_ZEROCOPY until the kernel
+ * reports the send complete. The kernel numbers zerocopy sends on a socket in
+ * order, so the send is given the next number.
+ */
+static void pin_buffers(worker_t *worker, transmitter_t *transmitter, int m)
+{
+    send_batch_t    *batch = transmitter->batch;
+    zerocopy_t      *zc = transmitter->zc;
+    int             d = batch->msg_first[m];
+    int             slot = zc->next_id % ZEROCOPY_SENDS;
+    pktbuf_t        *pkt;
+
+    zc->done[slot] = false;
+    zc->num_pins[slot] = batch->msg_count[m];
+    zc->next_id++;
+    for (int k = 0; k < batch->msg_count[m]; k++) {
+        pkt = batch->pkts[d];
+        zc->pins[(zc->pins_head + zc->pins_count) % ZEROCOPY_PINS] = pkt;
+        zc->pins_count++;
+        if (pkt->refs++ == pkt->thread_refs) {
+            worker->zc_pinned++;
+        }
+        d = batch->next_same[d];
+    }
+}
+
+/**
+ * Reads the completion notifications from a zerocopy transmitter's error
+ * queue, and returns the buffers of the oldest sends that are complete to the
+ * pool, in send order. The first time the kernel reports having copied the
+ * data after all (as it does for local destinations, or devices that can't
+ * send from user pages), this is logged.
+ */
+static void reap_zerocopy(worker_t *worker, transmitter_t *transmitter)
+{
+    zerocopy_t                  *zc = transmitter->zc;
+    struct msghdr               hdr;
+    struct cmsghdr              *cmsg;
+    struct sock_extended_err    err;
+    char                        ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+    uint32_t                    id;
+    int                         slot;
+    pktbuf_t                    *pkt;
+
+    while (1) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control     = ctrl;
+        hdr.msg_controllen  = sizeof(ctrl);
+        if (recvmsg(transmitter->sockfd, &hdr, MSG_ERRQUEUE) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("ERROR: Reading zerocopy notifications");
+            }
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !zc->copied) {
+                zc->copied = true;
+                fprintf(stderr, "Transmitter %d: the kernel copies zerocopy sends on this route\n",
+                        transmitter->id);
+            }
+            // Sends ee_info to ee_data are complete (the numbers wrap)
+            for (id = err.ee_info; ; id++) {
+                if (id - zc->oldest < zc->next_id - zc->oldest) {
+                    zc->done[id % ZEROCOPY_SENDS] = true;
+                }
+                if (id == err.ee_data) {
+                    break;
+                }
+            }
+        }
+    }
+
+    while (zc->oldest != zc->next_id && zc->done[zc->oldest % ZEROCOPY_SENDS]) {
+        slot = zc->oldest % ZEROCOPY_SENDS;
+        zc->done[slot] = false;
+        for (int k = 0; k < zc->num_pins[slot]; k++) {
+            pkt = zc->pins[zc->pins_head];
+            zc->pins_head = (zc->pins_head + 1) % ZEROCOPY_PINS;
+            zc->pins_count--;
+            if (--pkt->refs == pkt->thread_refs) {
+                worker->zc_pinned--;
+            }
+            if (pkt->refs == 0) {
+                pool_put(worker, pkt);
+            }
+        }
+        zc->oldest++;
+    }
+}
+
+/**
+ * Queues a datagram (or coalesced datagrams) for a target on the worker's
+ * queue to the target's transmit thread. The pool buffer holding it is kept
+ * until the thread has sent it; one read from a capture ring is first copied
+ * into a pool buffer of its own. It is dropped if the queue is full even
+ * after giving back what the thread has sent. The thread sees it once
+ * flush_sends() publishes it, and the listener is credited with what the
+ * thread sent once the worker gives the buffer back.
+ *
+ * @param worker    The worker queueing the datagram
+ * @param listener  The listener the datagram arrived on
+ * @param pkt       The pool buffer holding the datagram, or NULL
+ * @param buf       The datagram
+ * @param len       The length of the datagram (bytes)
+ * @param gso_size  The size of each coalesced datagram, or 0 for one datagram
+ * @param target    The worker's copy of the target
+ */
+static void offload_datagram(worker_t *worker, listener_t *listener, pktbuf_t *pkt, const void *buf,
+        size_t len, size_t gso_size, target_t *target)
+{
+    tx_queue_t  *queue = target->tx_queue;
+    tx_entry_t  *entry;
+
+    if (queue->fill - queue->done == TX_THREAD_QUEUE) {
+        reclaim_offloaded(worker, queue);
+    }
+    if (queue->fill - queue->done == TX_THREAD_QUEUE) {
+        target->packets_dropped += num_datagrams(len, gso_size);
+        return;
+    }
+    if (pkt == NULL) {
+        pkt = pool_get(worker);
+        if (pkt == NULL) {
+            target->packets_dropped += num_datagrams(len, gso_size);
+            return;
+        }
+        pkt->data = (len <= pool_slot_size) ? pkt->slot : pkt->spill;
+        memcpy(pkt->data, buf, len);
+        buf = pkt->data;
+    }
+    pkt->refs++;
+    pkt->thread_refs++;
+
+    entry = &queue->entries[queue->fill % TX_THREAD_QUEUE];
+    entry->pkt      = pkt;
+    entry->data     = buf;
+    entry->len      = len;
+    entry->gso_size = gso_size;
+    entry->route    = target->tx_route;
+    entry->listener = listener;
+    entry->target   = target;
+    entry->sent     = 0;
+    queue->fill++;
+}
+
+/**
+ * Gives back the buffers of what the transmit threads have sent from the
+ * worker's queues, publishes what the worker has queued since, and wakes the
+ * threads it was queued for that are asleep
+ */
+static void publish_offloaded(worker_t *worker)
+{
+    tx_queue_t  *queue;
+    bool        queued[MAX_TX_THREADS];
+    uint64_t    one = 1;
+
+    for (int t = 0; t < num_tx_threads; t++) {
+        queued[t] = false;
+        if (!tx_threads[t].used) {
+            continue;
+        }
+        queue = &tx_threads[t].queues[worker->id];
+        reclaim_offloaded(worker, queue);
+        if (queue->fill != queue->tail) {
+            __atomic_store_n(&queue->tail, queue->fill, __ATOMIC_SEQ_CST);
+            queued[t] = true;
+        }
+    }
+
+    // A thread sets sleeping before its last look at the queues, so either it
+    // sees the new tail or this sees it asleep
+    for (int t = 0; t < num_tx_threads; t++) {
+        if (queued[t] && __atomic_load_n(&tx_threads[t].sleeping, __ATOMIC_SEQ_CST)) {
+            if (write(tx_threads[t].wake_fd, &one, sizeof(one)) < 0) {
+                perror("ERROR: Waking transmit thread");
+            }
+        }
+    }
+}
+
+/**
+ * Gives back to the pool the buffers of the entries of a worker's queue that
+ * its transmit thread has sent, unless something else still holds them. The
+ * datagrams the thread sent are credited to their listener, and those it
+ * couldn't send are counted as dropped by the target.
+ */
+static void reclaim_offloaded(worker_t *worker, tx_queue_t *queue)
+{
+    uint32_t    head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    tx_entry_t  *entry;
+    pktbuf_t    *pkt;
+
+    while (queue->done != head) {
+        entry = &queue->entries[queue->done % TX_THREAD_QUEUE];
+        entry->listener->packets_forwarded += entry->sent;
+        entry->target->packets_dropped += num_datagrams(entry->len, entry->gso_size) - entry->sent;
+        pkt = entry->pkt;
+        pkt->thread_refs--;
+        if (--pkt->refs == 0) {
+            pool_put(worker, pkt);
+        }
+        queue->done++;
+    }
+}
+
+/**
+ * Runs a transmit thread, sending what every worker queues for it in order,
+ * and sleeping on its eventfd while every queue is empty. Never returns.
+ *
+ * @param arg   The tx_thread_t to run
+ */
+static void *run_tx_thread(void *arg)
+{
+    tx_thread_t *thread = arg;
+    tx_queue_t  *queue;
+    tx_entry_t  *entry;
+    uint32_t    head;
+    uint32_t    tail;
+    uint64_t    count;
+    bool        idle;
+
+    while (1) {
+        idle = true;
+        for (int w = 0; w < num_workers; w++) {
+            queue = &thread->queues[w];
+            tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+            for (head = queue->head; head != tail; head++) {
+                entry = &queue->entries[head % TX_THREAD_QUEUE];
+                entry->sent = send_offloaded(thread, entry);
+                __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+                idle = false;
+            }
+        }
+        if (!idle) {
+            continue;
+        }
+
+        // Say it is going to sleep before the last look, so no wakeup is missed
+        __atomic_store_n(&thread->sleeping, 1, __ATOMIC_SEQ_CST);
+        for (int w = 0; w < num_workers; w++) {
+            if (__atomic_load_n(&thread->queues[w].tail, __ATOMIC_SEQ_CST) != thread->queues[w].head) {
+                idle = false;
+            }
+        }
+        if (idle && read(thread->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            perror("ERROR: Reading transmit thread eventfd");
+            exit(1);
+        }
+        __atomic_store_n(&thread->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/**
+ * Sends one entry of a transmit thread's queue. Coalesced datagrams go as one
+ * UDP_SEGMENT message unless the target can't take that, in which case it is
+ * marked and they are sent one at a time.
+ *
+ * @param thread    The thread sending it
+ * @param entry     The entry to send
+ * @return          The number of datagrams sent
+ */
+static unsigned long send_offloaded(tx_thread_t *thread, const tx_entry_t *entry)
+{
+    tx_route_t      *route = entry->route;
+    size_t          seg_len;
+    unsigned long   sent = 0;
+
+    if (entry->gso_size == 0 || !route->no_gso) {
+        if (send_waiting(route, entry->data, entry->len, entry->gso_size) == 0) {
+            return num_datagrams(entry->len, entry->gso_size);
+        }
+        if (entry->gso_size == 0 || (errno != EIO && errno != EINVAL && errno != EMSGSIZE &&
+                    errno != ENOPROTOOPT && errno != EOPNOTSUPP)) {
+            fprintf(stderr, "ERROR: Transmit thread %d couldn't send to target %d: %s\n",
+                    thread->id, route->target_id, strerror(errno));
+            return 0;
+        }
+        perror("UDP_SEGMENT");
+        fprintf(stderr, "Target %d can't take coalesced packets, splitting them\n", route->target_id);
+        route->no_gso = true;
+    }
+    for (size_t offset = 0; offset < entry->len; offset += entry->gso_size) {
+        seg_len = (entry->len - offset < entry->gso_size) ? entry->len - offset : entry->gso_size;
+        if (send_waiting(route, entry->data + offset, seg_len, 0) < 0) {
+            fprintf(stderr, "ERROR: Transmit thread %d couldn't send to target %d: %s\n",
+                    thread->id, route->target_id, strerror(errno));
+        } else {
+            sent++;
+        }
+    }
+    return sent;
+}
+
+/**
+ * Sends one message from a transmit thread, waiting (up to SEND_RETRY ms at a
+ * time) for as long as the socket is full or the kernel is out of buffers
+ *
+ * @param route     The route to send it on
+ * @param buf       The datagram (or coalesced datagrams)
+ * @param len       The length of the datagram (bytes)
+ * @param gso_size  The UDP_SEGMENT segment size, or 0 for one datagram
+ * @return          0 if sent, -1 (with errno set) otherwise
+ */
+static int send_waiting(const tx_route_t *route, const char *buf, size_t len, size_t gso_size)
+{
+    struct msghdr   hdr;
+    struct iovec    iov;
+    struct pollfd   pfd;
+    char            ctrl[CMSG_SPACE(sizeof(uint16_t))];
+    uint16_t        segment = gso_size;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (!route->connected) {
+        hdr.msg_name    = (void *)&route->dest_addr;
+        hdr.msg_namelen = sizeof(route->dest_addr);
+    }
+    iov.iov_base    = (void *)buf;
+    iov.iov_len     = len;
+    hdr.msg_iov     = &iov;
+    hdr.msg_iovlen  = 1;
+    if (gso_size > 0) {
+        hdr.msg_control = ctrl;
+        add_cmsg(&hdr, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+    }
+
+    while (sendmsg(route->sockfd, &hdr, 0) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            pfd.fd      = route->sockfd;
+            pfd.events  = POLLOUT;
+            poll(&pfd, 1, SEND_RETRY);
+        } else if (errno == ENOBUFS) {
+            poll(NULL, 0, SEND_RETRY);
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Verifies everything is properly configured
+ *
+ * @return 0 if configuration good, -1 otherwise
+ */
+static int verify_config()
+{
+    int             rc = 0;
+    int             temp = 0;
+    target_t        *target = NULL;
+    transmitter_t   *transmitter = NULL;
+    map_t           *map = NULL;
+    listener_t      *listener = NULL;
+
+    // Check that AF_XDP listeners have an interface to receive on
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->ingest == INGEST_XDP && listener->interface == NULL && listener->shard == 0) {
+            fprintf(stderr, "CONFIG: Listener %d uses xdp ingest but has no interface.\n", listener->id);
+            rc = -1;
+        }
+    }
+
+    // Check that transmitters sending through a ring have an interface for it
+    for (transmitter = transmitter_hash_table; transmitter != NULL; transmitter = transmitter->hh.next) {
+        if (transmitter->egress == EGRESS_TPACKET && transmitter->interface == NULL) {
+            fprintf(stderr, "CONFIG: Transmitter %d uses tpacket egress but has no interface.\n", transmitter->id);
+            rc = -1;
+        }
+    }
+    transmitter = NULL;
+
+    // Check that no target is both paced by a worker and sent by a transmit thread
+    for (target = target_hash_table; target != NULL; target = target->hh.next) {
+        if (target->paced && target->thread > 0) {
+            fprintf(stderr, "CONFIG: Target %d has a rate cap and a transmit thread, which can't pace it.\n", target->id);
+            rc = -1;
+        }
+    }
+    target = NULL;
+
+    // Iterate through the maps, checking that targets exist
+    for (map = map_head; map != NULL; map = map->next_map) {
+        HASH_FIND_INT(target_hash_table, &map->target_id, target);
+        if (target == NULL) {
+            fprintf(stderr, "CONFIG: Target %d referenced in map but not defined.\n", map->target_id);
             rc = -1;
         }
+        target = NULL;
+    }
+
+    // Iterate through targets, checking that transmitters exist
+    for (target = target_hash_table; target != NULL; target = target->hh.next) {
+        HASH_FIND_INT(transmitter_hash_table, &target->transmitter_id, transmitter);
+        if (transmitter == NULL) {
+            fprintf(stderr, "CONFIG: Transmitter %d referenced in target but not defined.\n", target->transmitter_id);
+            rc = -1;
+        }
+        transmitter = NULL;
+        // Check that the target is used in a map
+        temp = 0;
+        for (map = map_head; map != NULL; map = map->next_map) {
+            if (map->target_id == target->id) {
+                temp = 1;
+            }
+        }
+        if (temp == 0) {
+            fprintf(stderr, "CONFIG: Target %d defined, but not used in any maps.\n", target->id);
+            rc = -1;
+        }
+    }
+
+    // Check that all transmitters are used in a target
+    for (transmitter = transmitter_hash_table; transmitter != NULL; transmitter = transmitter->hh.next) {
+        temp = 0;
+        for (target = target_hash_table; target != NULL; target = target->hh.next) {
+            if (target->transmitter_id == transmitter->id) {
+                temp = 1;
+            }
+        }
+        if (temp == 0) {
+            fprintf(stderr, "CONFIG: Transmitter %d defined, but not used in any targets.\n", transmitter->id);
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Opens a new socket listening on the address and port specified, and adds a
+ * new listener_t for the ID given to the listener linked list
+ *
+ * All parameters should be in host byte order
+ */
+void create_listener(int id, uint32_t address, uint16_t port)
+{
+    listener_t  *listener = NULL;
+    bool        exit_now = false;
+
+    // Error checking
+    if (id <= 0) {
+        fprintf(stderr, "ERROR: You must define a positive ID for each listener!\n");
+        exit_now = true;
+    }
+    if (port == 0) {
+        fprintf(stderr, "ERROR: Listeners must have at least a port defined!\n");
+        exit_now = true;
+    }
+    if (exit_now) {
+        exit(1);
+    }
+
+    // Create new listener
+    listener = malloc(sizeof(listener_t));
+    if (listener == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    memset(listener, 0, sizeof(listener_t));
+    listener->type = SOCKET_LISTENER;
+    listener->id = id;
+    listener->address = address;
+    listener->port = port;
+    listener->max_payload = DEFAULT_MAX_PAYLOAD;
+    listener->busy_poll = -1;
+
+    // Create the listener socket
+    open_listener_socket(listener, false);
+
+    // Add listener to the linked list
+    listener->next_listener = listener_head;
+    listener_head = listener;
+}
+
+/**
+ * Opens the socket for a listener, bound to the listener's address and port,
+ * and enables UDP_GRO on it if the kernel supports it
+ *
+ * @param listener  The listener to open the socket for
+ * @param reuseport Set SO_REUSEPORT, so the listener's shards can share the port
+ */
+static void open_listener_socket(listener_t *listener, bool reuseport)
+{
+    int         socket;
+    int         enable = 1;
+    int         buffer_size = 0;
+    socklen_t   optlen = sizeof(buffer_size);
+
+    socket = open_socket(listener->address, listener->port, reuseport);
+
+    // Let the kernel coalesce datagrams from one source (UDP_GRO)
+    if (setsockopt(socket, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) < 0) {
+        perror("Setting UDP_GRO");
+        enable = 0;
+    }
+
+    // Log the RCVBUF size
+    if (getsockopt(socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, &optlen) < 0) {
+        perror("Getting SO_RCVBUF");
+    } else {
+        struct in_addr ip_addr;
+        ip_addr.s_addr = listener->address;
+        printf("Listener socket (%s:%d) receive buffer size = %d bytes\n",
+                inet_ntoa(ip_addr), listener->port, buffer_size);
+    }
+
+    listener->sockfd = socket;
+    listener->gro = enable;
+}
+
+/**
+ * Creates a new transmitter_t, adding it to the Hash Table. The socket for the
+ * transmitter will be bound to the address and port specified (or unbound if
+ * the address and port are 0)
+ *
+ * Any data received by a transmitter socket is thrown away.
+ *
+ * All parameters should be in host byte order
+ */
+void create_transmitter(int id, uint32_t address, uint16_t port)
+{
+    transmitter_t   *transmitter = NULL;
+    int             socket;
+    int             buffer_size = SOCKET_SEND_BUFFER;
+    socklen_t       optlen = sizeof(buffer_size);
+    bool            exit_now = false;
+
+    // Error checking
+    HASH_FIND_INT(transmitter_hash_table, &id, transmitter);
+    if (transmitter != NULL) {
+        fprintf(stderr, "ERROR: Duplicate transmitter ID\n");
+        exit_now = true;
+    }
+    if (id <= 0) {
+        fprintf(stderr, "ERROR: You must define a positive ID for each transmitter!\n");
+        exit_now = true;
+    }
+    if (exit_now) {
+        exit(1);
+    }
+
+    // Create the transmitter socket
+    socket = open_socket(address, port, false);
+    // Increase the sockets send buffer
+    if (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, optlen) < 0) {
+        perror("Setting SO_SNDBUF");
+        exit(1);
+    }
+
+    // Log the SNDBUF size
+    buffer_size = 0;
+    optlen = sizeof(buffer_size);
+    if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, &optlen) < 0) {
+        perror("Getting SO_RCVBUF");
+    } else {
+        struct in_addr ip_addr;
+        ip_addr.s_addr = address;
+        printf("Transmitter socket (%s:%d) send buffer size = %d bytes\n",
+                inet_ntoa(ip_addr), port, buffer_size);
+    }
+
+    // Create new transmitter
+    transmitter = malloc(sizeof(transmitter_t));
+    if (transmitter == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    transmitter->type = SOCKET_TRANSMITTER;
+    transmitter->id = id;
+    transmitter->sockfd = socket;
+    transmitter->interface = NULL;
+    transmitter->egress = EGRESS_SOCKET;
+    transmitter->ring = NULL;
+    transmitter->connected = false;
+    transmitter->zerocopy = 0;
+    transmitter->zc = NULL;
+    transmitter->registered = false;
+    transmitter->multicast = false;
+    transmitter->multicast_ttl = 1;
+    transmitter->multicast_loop = true;
+    transmitter->batch = NULL;
+    transmitter->next_flush = NULL;
+    transmitter->blocked = NULL;
+    transmitter->writable = false;
+    transmitter->next_blocked = NULL;
+
+    // Add transmitter to the hash table
+    HASH_ADD_INT(transmitter_hash_table, id, transmitter);
+}
+
+/**
+ * Creates a new target_t, adding it to the Hash Table
+ *
+ * A target is where a packet may be forwarded. The address and port are the
+ * destination IP address and destination UDP port for the sent packet, and
+ * the transmitter_id corresponds to the transmitter to be used to send the
+ * packet.
+ *
+ * All parameters should be in host byte order
+ */
+void create_target(int id, uint32_t address, uint16_t port, int transmitter_id)
+{
+    target_t    *target = NULL;
+    bool        exit_now = false;
+
+    // Error checking
+    HASH_FIND_INT(target_hash_table, &id, target);
+    if (target != NULL) {
+        fprintf(stderr, "ERROR: Duplicate target ID: %d\n", id);
+        exit_now = true;
+    }
+    if (id <= 0) {
+        fprintf(stderr, "ERROR: You must define a positive ID for each Target!\n");
+        exit_now = true;
+    }
+    if (address == 0) {
+        fprintf(stderr, "ERROR: Target %d must have an address defined!\n", id);
+        exit_now = true;
+    }
+    if (port == 0) {
+        fprintf(stderr, "ERROR: Target %d must have a port defined!\n", id);
+        exit_now = true;
+    }
+    if (transmitter_id <= 0) {
+        fprintf(stderr, "ERROR: Target %d must have a transmitter defined!\n", id);
+        exit_now = true;
+    }
+    if (exit_now) {
+        exit(1);
+    }
+
+    // Create new target
+    target = malloc(sizeof(target_t));
+    if (target == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    target->id = id;
+    target->address = address;
+    target->port = port;
+    target->transmitter_id = transmitter_id;
+    target->no_gso = false;
+    target->connect = false;
+    target->connected = NULL;
+    target->send_tail = -1;
+    target->queue_length = DEFAULT_SEND_QUEUE;
+    target->drop_policy = DROP_NEWEST;
+    target->queue = NULL;
+    target->next_blocked = NULL;
+    target->paced = false;
+    target->max_pps = 0;
+    target->max_bps = 0;
+    target->pacing = PACING_TIMER;
+    target->pace_next = 0;
+    target->pace_tick = 0;
+    target->sender = NULL;
+    target->next_paced = NULL;
+    target->packets_queued = 0;
+    target->packets_dropped = 0;
+    target->xdp = NULL;
+    target->ring_path = NULL;
+    target->thread = 0;
+    target->tx_queue = NULL;
+    target->tx_route = NULL;
+
+    // Add target to the hash table
+    HASH_ADD_INT(target_hash_table, id, target);
+}
+
+/**
+ * Creates a new map_t with the parameters provided, adding it to the map_head
+ * linked list. Packets received that match a map are forwarded to a target.
+ *
+ * Packets received on "listener_id" from "src_address:src_port" will be sent
+ * using "target_id"
+ *
+ * All parameters should be in host byte order
+ */
+void create_map(int listener_id, uint32_t src_address, uint16_t src_port, int target_id)
+{
+    create_map_prefix(listener_id, src_address, (src_address == 0) ? 0 : 32, src_port, target_id);
+}
+
+/**
+ * Creates a new map_t matching every source address that shares its first
+ * "prefix_len" bits with "src_address" (a CIDR prefix), adding it to the
+ * map_head linked list. The address bits past the prefix are ignored. A
+ * prefix length of 0 matches any address, and 32 only "src_address"
+ *
+ * All parameters should be in host byte order
+ */
+void create_map_prefix(int listener_id, uint32_t src_address, int prefix_len, uint16_t src_port, int target_id)
+{
+    create_map_range(listener_id, src_address, prefix_len, src_port, src_port, target_id);
+}
+
+/**
+ * Creates a new map_t matching every source port from "port_first" to
+ * "port_last" inclusive, from the addresses of a CIDR prefix (see
+ * create_map_prefix()), adding it to the map_head linked list. A
+ * "port_first" of 0 matches any port, and "port_last" is then ignored
+ *
+ * All parameters should be in host byte order
+ */
+void create_map_range(int listener_id, uint32_t src_address, int prefix_len, uint16_t port_first, uint16_t port_last, int target_id)
+{
+    map_t *map;
+
+    if (prefix_len < 0 || prefix_len > 32) {
+        fprintf(stderr, "ERROR: Map prefix length must be 0 to 32\n");
+        exit(1);
+    }
+    if (port_first != 0 && port_last < port_first) {
+        fprintf(stderr, "ERROR: Map port range %u-%u ends before it starts\n", port_first, port_last);
+        exit(1);
+    }
+
+    // Create new map
+    map = malloc(sizeof(map_t));
+    if (map == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    map->listener_id    = listener_id;
+    map->address        = (prefix_len == 0) ? 0 : src_address & (0xFFFFFFFFu << (32 - prefix_len));
+    map->prefix_len     = prefix_len;
+    map->port           = port_first;
+    map->port_last      = (port_first == 0) ? 0 : port_last;
+    map->target_id      = target_id;
+    map->route          = NULL;
+    map->next_map       = NULL;
+
+    // Add map to the linked list
+    if (map_head == NULL) {
+        map_head = map;
+    } else {
+        if (map_tail == NULL) {
+            fprintf(stderr, "ERROR: map_tail should never be null here!\n");
+            exit(1);
+        }
+        map_tail->next_map = map;
+    }
+    map_tail = map;
+}
+
+/**
+ * Sets the maximum number of packets read from a socket with a single
+ * recvmmsg() call. Must be called before start_repeater()
+ *
+ * @param size  Number of packets per batch (1 to MAX_RECV_BATCH)
+ */
+void set_recv_batch(int size)
+{
+    if (size <= 0 || size > MAX_RECV_BATCH) {
+        fprintf(stderr, "ERROR: recv_batch must be between 1 and %d\n", MAX_RECV_BATCH);
+        exit(1);
+    }
+    recv_batch = size;
+}
+
+/**
+ * Sets the most packets handled from one ready socket before moving on to the
+ * next, so one busy listener can't starve the others. Must be called before
+ * start_repeater()
+ *
+ * @param budget    Number of packets (at least 1)
+ */
+void set_fd_budget(int budget)
+{
+    if (budget <= 0) {
+        fprintf(stderr, "ERROR: fd_budget must be at least 1\n");
+        exit(1);
+    }
+    fd_budget = budget;
+}
+
+/**
+ * Selects the engine used to forward packets. If the io_uring engine is
+ * selected but not supported by the kernel, the epoll loop is used instead.
+ * Must be called before start_repeater()
+ *
+ * @param e ENGINE_EPOLL or ENGINE_IO_URING
+ */
+void set_engine(engine_t e)
+{
+    engine = e;
+}
+
+/**
+ * Sets the largest payload expected on a listener. Packets up to this size are
+ * received straight into a pool slot; larger ones still arrive intact, at the
+ * cost of a copy. Applies to every socket created with the listener ID given.
+ * Must be called after create_listener() and before start_repeater()
+ *
+ * @param id            The ID of the listener
+ * @param max_payload   Payload size in bytes (1 to BUFFER_SIZE)
+ */
+void set_listener_max_payload(int id, int max_payload)
+{
+    listener_t  *listener;
+    bool        found = false;
+
+    if (max_payload <= 0 || max_payload > BUFFER_SIZE) {
+        fprintf(stderr, "ERROR: Listener %d max_payload must be between 1 and %d\n", id, BUFFER_SIZE);
+        exit(1);
+    }
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->id == id) {
+            listener->max_payload = max_payload;
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "ERROR: Listener %d not found\n", id);
+        exit(1);
+    }
+}
+
+/**
+ * Splits a listener into shards: one SO_REUSEPORT socket per shard on the
+ * same address and port, each served by its own worker thread with its own
+ * copy of the rule tables. The kernel spreads packets over the sockets by
+ * their source, so packets from one source stay in order. Applies to every
+ * socket created with the listener ID given. Must be called after
+ * create_listener() and before start_repeater()
+ *
+ * @param id        The ID of the listener
+ * @param shards    Number of sockets and worker threads (1 to MAX_SHARDS)
+ */
+void set_listener_shards(int id, int shards)
+{
+    listener_t  *listener;
+    listener_t  *shard;
+    bool        found = false;
+
+    if (shards <= 0 || shards > MAX_SHARDS) {
+        fprintf(stderr, "ERROR: Listener %d shards must be between 1 and %d\n", id, MAX_SHARDS);
+        exit(1);
+    }
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->id != id || listener->shard != 0) {
+            continue;
+        }
+        found = true;
+        if (shards == 1) {
+            continue;
+        }
+
+        // Reopen the first socket with SO_REUSEPORT, then add a socket for every other shard
+        close(listener->sockfd);
+        open_listener_socket(listener, true);
+        for (int s = shards - 1; s > 0; s--) {
+            shard = malloc(sizeof(listener_t));
+            if (shard == NULL) {
+                fprintf(stderr, "ERROR: malloc failed\n");
+                exit(1);
+            }
+            memcpy(shard, listener, sizeof(listener_t));
+            shard->shard = s;
+            open_listener_socket(shard, true);
+            shard->next_listener = listener->next_listener;
+            listener->next_listener = shard;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "ERROR: Listener %d not found\n", id);
+        exit(1);
+    }
+}
+
+/**
+ * Selects where a listener receives its packets from. With INGEST_TPACKET,
+ * the datagrams for the listener's port are read from an AF_PACKET ring
+ * instead of the UDP socket (which then drops everything). With INGEST_XDP,
+ * an XDP program on the listener's interface (see set_listener_interface())
+ * steers them to an AF_XDP socket, and the UDP socket gets whatever else
+ * arrives. Applies to every socket created with the listener ID given. Must
+ * be called after create_listener() and before start_repeater()
+ *
+ * @param id        The ID of the listener
+ * @param ingest    INGEST_SOCKET, INGEST_TPACKET or INGEST_XDP
+ */
+void set_listener_ingest(int id, ingest_t ingest)
+{
+    listener_t  *listener;
+    bool        found = false;
+
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->id == id) {
+            listener->ingest = ingest;
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "ERROR: Listener %d not found\n", id);
+        exit(1);
     }
-
-    return rc;
 }
 
 /**
- * Opens a new socket listening on the address and port specified. Adds this
- * socket to the poll_fds array, and sets the listener_ids array to point to
- * this socket for the ID given
+ * Sets the network interface an INGEST_XDP listener receives on, which is
+ * also the one a multicast listener joins its group on. Applies to every
+ * socket created with the listener ID given. Must be called after
+ * create_listener() and before start_repeater()
  *
- * All parameters should be in host byte order
+ * @param id        The ID of the listener
+ * @param interface The interface name
  */
-void create_listener(int id, uint32_t address, uint16_t port)
+void set_listener_interface(int id, const char *interface)
 {
-    int         socket;
-    bool        exit_now = false;
-    int         buffer_size = 0;
-    socklen_t   optlen = sizeof(buffer_size);
+    listener_t  *listener;
+    bool        found = false;
 
-    // Error checking
-    if (id <= 0) {
-        fprintf(stderr, "ERROR: You must define a positive ID for each listener!\n");
-        exit_now = true;
+    if (strlen(interface) == 0 || strlen(interface) >= IF_NAMESIZE) {
+        fprintf(stderr, "ERROR: Listener %d has an invalid interface name\n", id);
+        exit(1);
     }
-    if (port == 0) {
-        fprintf(stderr, "ERROR: Listeners must have at least a port defined!\n");
-        exit_now = true;
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->id == id) {
+            listener->interface = strdup(interface);
+            found = true;
+        }
     }
-    if (exit_now) {
+    if (!found) {
+        fprintf(stderr, "ERROR: Listener %d not found\n", id);
         exit(1);
     }
+}
 
-    // Create the listener socket (adding it to poll_fds)
-    socket = open_socket(address, port);
+/**
+ * Makes a multicast listener join its group only for a source given
+ * (source-specific multicast), adding to the sources already given. The
+ * listener must be bound to a multicast group. Must be called after
+ * create_listener() and before start_repeater()
+ *
+ * @param id        The ID of the listener
+ * @param source    The source address (host byte order)
+ */
+void add_listener_source(int id, uint32_t source)
+{
+    listener_t  *listener;
+    uint32_t    *sources;
+    bool        found = false;
 
-    // Log the RCVBUF size
-    buffer_size = 0;
-    optlen = sizeof(buffer_size);
-    if (getsockopt(socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, &optlen) < 0) {
-        perror("Getting SO_RCVBUF");
-    } else {
-        struct in_addr ip_addr;
-        ip_addr.s_addr = address;
-        printf("Listener socket (%s:%d) receive buffer size = %d bytes\n",
-                inet_ntoa(ip_addr), port, buffer_size);
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->id != id || listener->shard != 0) {
+            continue;
+        }
+        found = true;
+        if (!IN_MULTICAST(listener->address)) {
+            fprintf(stderr, "ERROR: Listener %d must be bound to a multicast group to take sources\n", id);
+            exit(1);
+        }
+        sources = realloc(listener->sources, (listener->num_sources + 1) * sizeof(uint32_t));
+        if (sources == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        sources[listener->num_sources++] = source;
+        listener->sources = sources;
+    }
+    if (!found) {
+        fprintf(stderr, "ERROR: Listener %d not found\n", id);
+        exit(1);
     }
-
-    // Set the listener_ids array to point to the given ID for this socket
-    listener_ids[socket] = id;
 }
 
 /**
- * Creates a new transmitter_t, adding it to the Hash Table. The socket for the
- * transmitter will be bound to the address and port specified (or unbound if
- * the address and port are 0)
+ * Sets the network interface a transmitter sends from. Packets received
+ * through AF_XDP are sent to the transmitter's targets through an AF_XDP
+ * socket on this interface, once the MAC address of their next hop is known,
+ * and so are all packets with tpacket egress, through its send ring. Packets
+ * to multicast groups are sent from it (IP_MULTICAST_IF). Must be called
+ * after create_transmitter() and before start_repeater()
  *
- * Creating the socket also adds it to the poll_fds array. This function also
- * sets the listener_ids[socket] to -1 so that we know to throw away any data
- * received by a transmitter.
- *
- * All parameters should be in host byte order
+ * @param id        The ID of the transmitter
+ * @param interface The interface name
  */
-void create_transmitter(int id, uint32_t address, uint16_t port)
+void set_transmitter_interface(int id, const char *interface)
 {
-    transmitter_t   *transmitter = NULL;
-    int             socket;
-    int             buffer_size = SOCKET_SEND_BUFFER;
-    socklen_t       optlen = sizeof(buffer_size);
-    bool            exit_now = false;
+    transmitter_t *transmitter = NULL;
 
-    // Error checking
+    if (strlen(interface) == 0 || strlen(interface) >= IF_NAMESIZE) {
+        fprintf(stderr, "ERROR: Transmitter %d has an invalid interface name\n", id);
+        exit(1);
+    }
     HASH_FIND_INT(transmitter_hash_table, &id, transmitter);
-    if (transmitter != NULL) {
-        fprintf(stderr, "ERROR: Duplicate transmitter ID\n");
-        exit_now = true;
+    if (transmitter == NULL) {
+        fprintf(stderr, "ERROR: Transmitter %d not found\n", id);
+        exit(1);
     }
-    if (id <= 0) {
-        fprintf(stderr, "ERROR: You must define a positive ID for each transmitter!\n");
-        exit_now = true;
+    transmitter->interface = strdup(interface);
+}
+
+/**
+ * Sets a transmitter to send messages of at least threshold bytes with
+ * MSG_ZEROCOPY, so the kernel sends them from the receive buffers rather than
+ * copying them once per target. The buffers are kept out of the pool until
+ * the kernel reports the sends complete. Only packets received from a UDP
+ * socket by the epoll loop are sent this way. Must be called after
+ * create_transmitter() and before start_repeater()
+ *
+ * @param id        The ID of the transmitter
+ * @param threshold The smallest message sent with MSG_ZEROCOPY (bytes), 0 for none
+ */
+void set_transmitter_zerocopy(int id, int threshold)
+{
+    transmitter_t *transmitter = NULL;
+
+    if (threshold < 0 || threshold > BUFFER_SIZE) {
+        fprintf(stderr, "ERROR: Transmitter %d zerocopy threshold must be between 0 and %d\n", id, BUFFER_SIZE);
+        exit(1);
     }
-    if (exit_now) {
+    HASH_FIND_INT(transmitter_hash_table, &id, transmitter);
+    if (transmitter == NULL) {
+        fprintf(stderr, "ERROR: Transmitter %d not found\n", id);
         exit(1);
     }
+    transmitter->zerocopy = threshold;
+}
 
-    // Create the transmitter socket (and add to poll_fds)
-    socket = open_socket(address, port);
-    // Increase the sockets send buffer
-    if (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, optlen) < 0) {
-        perror("Setting SO_SNDBUF");
+/**
+ * Sets the multicast options of a transmitter's sockets, used if any of its
+ * targets is a multicast group. Must be called after create_transmitter()
+ * and before start_repeater()
+ *
+ * @param id    The ID of the transmitter
+ * @param ttl   IP_MULTICAST_TTL (0 to 255, default 1)
+ * @param loop  IP_MULTICAST_LOOP: true (default) to deliver to local receivers too
+ */
+void set_transmitter_multicast(int id, int ttl, bool loop)
+{
+    transmitter_t *transmitter = NULL;
+
+    if (ttl < 0 || ttl > 255) {
+        fprintf(stderr, "ERROR: Transmitter %d multicast TTL must be between 0 and 255\n", id);
         exit(1);
     }
-
-    // Log the SNDBUF size
-    buffer_size = 0;
-    optlen = sizeof(buffer_size);
-    if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, &optlen) < 0) {
-        perror("Getting SO_RCVBUF");
-    } else {
-        struct in_addr ip_addr;
-        ip_addr.s_addr = address;
-        printf("Transmitter socket (%s:%d) send buffer size = %d bytes\n",
-                inet_ntoa(ip_addr), port, buffer_size);
+    HASH_FIND_INT(transmitter_hash_table, &id, transmitter);
+    if (transmitter == NULL) {
+        fprintf(stderr, "ERROR: Transmitter %d not found\n", id);
+        exit(1);
     }
+    transmitter->multicast_ttl = ttl;
+    transmitter->multicast_loop = loop;
+}
 
-    // listener ID -1 indicates this socket is for a transmitter
-    listener_ids[socket] = -1;
+/**
+ * Sets how a transmitter sends its packets. With EGRESS_TPACKET, each worker
+ * writes whole frames for the transmitter's targets into a PACKET_TX_RING on
+ * the transmitter's interface (which must be set), with headers built once
+ * per target, and has the kernel send a whole batch with one call. Must be
+ * called after create_transmitter() and before start_repeater()
+ *
+ * @param id        The ID of the transmitter
+ * @param egress    EGRESS_SOCKET (default) or EGRESS_TPACKET
+ */
+void set_transmitter_egress(int id, egress_t egress)
+{
+    transmitter_t *transmitter = NULL;
 
-    // Create new transmitter
-    transmitter = malloc(sizeof(transmitter_t));
+    HASH_FIND_INT(transmitter_hash_table, &id, transmitter);
     if (transmitter == NULL) {
-        fprintf(stderr, "ERROR: malloc failed\n");
+        fprintf(stderr, "ERROR: Transmitter %d not found\n", id);
         exit(1);
     }
-    transmitter->id = id;
-    transmitter->sockfd = socket;
-
-    // Add transmitter to the hash table
-    HASH_ADD_INT(transmitter_hash_table, id, transmitter);
+    transmitter->egress = egress;
 }
 
 /**
- * Creates a new target_t, adding it to the Hash Table
- *
- * A target is where a packet may be forwarded. The address and port are the
- * destination IP address and destination UDP port for the sent packet, and
- * the transmitter_id corresponds to the transmitter to be used to send the
- * packet.
+ * Sets whether a target is sent to through a socket of its own, connected to
+ * it, rather than its transmitter's socket. The socket is bound to the same
+ * address and port as the transmitter's. Must be called after create_target()
+ * and before start_repeater()
  *
- * All parameters should be in host byte order
+ * @param id        The ID of the target
+ * @param connect   true to send through a connected socket
  */
-void create_target(int id, uint32_t address, uint16_t port, int transmitter_id)
+void set_target_connect(int id, bool connect)
 {
-    target_t    *target = NULL;
-    bool        exit_now = false;
+    target_t *target = NULL;
 
-    // Error checking
     HASH_FIND_INT(target_hash_table, &id, target);
-    if (target != NULL) {
-        fprintf(stderr, "ERROR: Duplicate target ID: %d\n", id);
-        exit_now = true;
-    }
-    if (id <= 0) {
-        fprintf(stderr, "ERROR: You must define a positive ID for each Target!\n");
-        exit_now = true;
+    if (target == NULL) {
+        fprintf(stderr, "ERROR: Target %d not found\n", id);
+        exit(1);
     }
-    if (address == 0) {
-        fprintf(stderr, "ERROR: Target %d must have an address defined!\n", id);
-        exit_now = true;
+    target->connect = connect;
+}
+
+/**
+ * Sets how many datagrams are held for a target while its transmitter's
+ * socket is full, and which are dropped when that many are held. Must be
+ * called after create_target() and before start_repeater()
+ *
+ * @param id        The ID of the target
+ * @param length    Datagrams held (1 to MAX_SEND_QUEUE, default DEFAULT_SEND_QUEUE)
+ * @param policy    DROP_NEWEST (default) or DROP_OLDEST
+ */
+void set_target_queue(int id, int length, drop_policy_t policy)
+{
+    target_t *target = NULL;
+
+    if (length < 1 || length > MAX_SEND_QUEUE) {
+        fprintf(stderr, "ERROR: Target %d queue length must be between 1 and %d\n", id, MAX_SEND_QUEUE);
+        exit(1);
     }
-    if (port == 0) {
-        fprintf(stderr, "ERROR: Target %d must have a port defined!\n", id);
-        exit_now = true;
+    HASH_FIND_INT(target_hash_table, &id, target);
+    if (target == NULL) {
+        fprintf(stderr, "ERROR: Target %d not found\n", id);
+        exit(1);
     }
-    if (transmitter_id <= 0) {
-        fprintf(stderr, "ERROR: Target %d must have a transmitter defined!\n", id);
-        exit_now = true;
+    target->queue_length = length;
+    target->drop_policy = policy;
+}
+
+/**
+ * Caps the rate a target is sent packets at, spacing them out evenly. Each
+ * worker thread paces the packets it sends to the target on its own. With
+ * PACING_TIMER, packets that are early are held in the target's send queue
+ * until their time. With PACING_TXTIME, they are sent at once with their
+ * send time (SO_TXTIME), which the fq qdisc on the way out holds them until.
+ * Must be called after create_target() and before start_repeater()
+ *
+ * @param id        The ID of the target
+ * @param max_pps   Packets per second, or 0 for no cap
+ * @param max_bps   Payload bytes per second, or 0 for no cap
+ * @param pacing    PACING_TIMER (default) or PACING_TXTIME
+ */
+void set_target_rate(int id, int max_pps, int max_bps, pacing_t pacing)
+{
+    target_t *target = NULL;
+
+    if (max_pps < 0 || max_bps < 0) {
+        fprintf(stderr, "ERROR: Target %d rate caps can't be negative\n", id);
+        exit(1);
     }
-    if (exit_now) {
+    HASH_FIND_INT(target_hash_table, &id, target);
+    if (target == NULL) {
+        fprintf(stderr, "ERROR: Target %d not found\n", id);
         exit(1);
     }
+    target->max_pps = max_pps;
+    target->max_bps = max_bps;
+    target->pacing = pacing;
+    target->paced = (max_pps > 0 || max_bps > 0);
+}
 
-    // Create new target
-    target = malloc(sizeof(target_t));
+/**
+ * Gives a target to a transmit thread, which sends its packets with its own
+ * copy of the target's socket, so that a target slow to take them holds up
+ * that thread instead of the workers. Targets given the same number share a
+ * thread. Can't be combined with a rate cap.
+ *
+ * @param id        The ID of the target
+ * @param thread    The transmit thread (1 to MAX_TX_THREADS), or 0 to send from the workers
+ */
+void set_target_thread(int id, int thread)
+{
+    target_t *target = NULL;
+
+    if (thread < 0 || thread > MAX_TX_THREADS) {
+        fprintf(stderr, "ERROR: Target %d transmit thread must be 0 to %d\n", id, MAX_TX_THREADS);
+        exit(1);
+    }
+    HASH_FIND_INT(target_hash_table, &id, target);
     if (target == NULL) {
-        fprintf(stderr, "ERROR: malloc failed\n");
+        fprintf(stderr, "ERROR: Target %d not found\n", id);
         exit(1);
     }
-    target->id = id;
-    target->address = address;
-    target->port = port;
-    target->transmitter_id = transmitter_id;
+    target->thread = thread;
+}
 
-    // Add target to the hash table
-    HASH_ADD_INT(target_hash_table, id, target);
+/**
+ * Selects how XDP programs are attached: XDP_MODE_SKB (generic, works on any
+ * interface, frames are copied) or XDP_MODE_NATIVE (in the driver, which
+ * must support it). Must be called before start_repeater()
+ *
+ * @param mode  XDP_MODE_SKB or XDP_MODE_NATIVE
+ */
+void set_xdp_mode(xdp_mode_t mode)
+{
+    xdp_mode = mode;
 }
 
 /**
- * Creates a new map_t with the parameters provided, adding it to the map_head
- * linked list. Packets received that match a map are forwarded to a target.
+ * Puts a listener in low-latency mode: the workers serving it poll their
+ * sockets without blocking, until nothing has arrived for the spin idle time
+ * (see set_spin_idle()). With a busy poll time, its sockets also poll the
+ * device queue on receive (SO_BUSY_POLL). Applies to every socket created
+ * with the listener ID given. Must be called after create_listener() and
+ * before start_repeater()
  *
- * Packets received on "listener_id" from "src_address:src_port" will be sent
- * using "target_id"
+ * @param id            The ID of the listener
+ * @param busy_poll_us  SO_BUSY_POLL time (us), or 0 to only spin
+ */
+void set_listener_busy_poll(int id, int busy_poll_us)
+{
+    listener_t  *listener;
+    bool        found = false;
+
+    if (busy_poll_us < 0) {
+        fprintf(stderr, "ERROR: Listener %d busy_poll must not be negative\n", id);
+        exit(1);
+    }
+    for (listener = listener_head; listener != NULL; listener = listener->next_listener) {
+        if (listener->id == id) {
+            listener->busy_poll = busy_poll_us;
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "ERROR: Listener %d not found\n", id);
+        exit(1);
+    }
+}
+
+/**
+ * Puts every listener without its own setting in low-latency mode (see
+ * set_listener_busy_poll()). Must be called before start_repeater()
  *
- * All parameters should be in host byte order
+ * @param busy_poll_us  SO_BUSY_POLL time (us), or 0 to only spin
  */
-void create_map(int listener_id, uint32_t src_address, uint16_t src_port, int target_id)
+void set_busy_poll(int busy_poll_us)
 {
-    map_t *map;
+    if (busy_poll_us < 0) {
+        fprintf(stderr, "ERROR: busy_poll must not be negative\n");
+        exit(1);
+    }
+    default_busy_poll = busy_poll_us;
+}
 
-    // Create new map
-    map = malloc(sizeof(map_t));
-    if (map == NULL) {
-        fprintf(stderr, "ERROR: malloc failed\n");
+/**
+ * Sets how long a worker serving a low-latency listener keeps spinning after
+ * the last packet arrived, before it blocks until the next one. Must be
+ * called before start_repeater()
+ *
+ * @param idle_us   Idle time (us), or 0 to never block
+ */
+void set_spin_idle(int idle_us)
+{
+    if (idle_us < 0) {
+        fprintf(stderr, "ERROR: spin_idle must not be negative\n");
         exit(1);
     }
-    map->listener_id    = listener_id;
-    map->address        = src_address;
-    map->port           = src_port;
-    map->target_id      = target_id;
-    map->next_map       = NULL;
+    spin_idle = idle_us;
+}
 
-    // Add map to the linked list
-    if (map_head == NULL) {
-        map_head = map;
-    } else {
-        if (map_tail == NULL) {
-            fprintf(stderr, "ERROR: map_tail should never be null here!\n");
-            exit(1);
-        }
-        map_tail->next_map = map;
+/**
+ * Pins a worker thread to a CPU. Worker N serves shard N of every listener;
+ * worker 0 also serves the unsharded listeners. Must be called before
+ * start_repeater()
+ *
+ * @param worker    The worker index (0 to MAX_SHARDS - 1)
+ * @param cpu       The CPU number
+ */
+void set_worker_cpu(int worker, int cpu)
+{
+    if (worker < 0 || worker >= MAX_SHARDS) {
+        fprintf(stderr, "ERROR: Worker %d must be between 0 and %d\n", worker, MAX_SHARDS - 1);
+        exit(1);
     }
-    map_tail = map;
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "ERROR: CPU %d for worker %d is out of range\n", cpu, worker);
+        exit(1);
+    }
+    worker_cpus[worker] = cpu;
+    worker_pinned[worker] = true;
 }
 
 /*
  * Open a new UDP socket on a port specified. Also sets the socket option
- * SO_REUSEADDR and sets the O_NONBLOCK file descriptor flag. Binds the fd to
- * the port before returning, assuming the port is specified
+ * SO_REUSEADDR (and SO_REUSEPORT if asked) and sets the O_NONBLOCK file
+ * descriptor flag. Binds the fd to the port before returning, assuming the
+ * port is specified
  *
- * Also adds the socket to the poll_fds array, incrementing num_fds.
- *
- * Both parameters should be in host byte order
+ * Both address parameters should be in host byte order
  *
  * @param address   The 32-bit IP address to bind the socket to (or 0 for any)
  * @param port      The port number to bind the socket to (or 0 for any)
+ * @param reuseport Set SO_REUSEPORT, so other sockets can bind the same port
  * @return          The file descriptor for the new socket
  */
-static int open_socket(uint32_t address, uint16_t port)
+static int open_socket(uint32_t address, uint16_t port, bool reuseport)
 {
     int                 sock;
     int                 flags;
     struct sockaddr_in  addr;
     int                 enable = 1;
     int                 buffer_size = SOCKET_RECV_BUFFER;
-    short               events = POLLIN;
-
-    // Error checking
-    if (num_fds >= MAX_FDS) {
-        fprintf(stderr, "ERROR: num_fds (%d) exceeded MAX_FDS\n", (int)num_fds);
-        exit(1);
-    }
 
     // Attempt to initialize socket
     sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         perror("Opening socket");
         exit(1);
-    } else if (sock >= MAX_FDS) {
-        fprintf(stderr, "ERROR: Socket (%d) exceeded MAX_FDS", sock);
-        exit(1);
     }
 
-    // Add socket to the poll_fds array
-    poll_fds[num_fds].fd = sock;
-    poll_fds[num_fds].events = events;
-    num_fds++;
-
     // Set SO_REUSEADDR and SO_RCVBUF
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
         perror("Setting SO_REUSEADDR");
         exit(1);
     }
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("Setting SO_REUSEPORT");
+        exit(1);
+    }
     if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)) < 0) {
         perror("Setting SO_RCVBUF");
         exit(1);
@@ -577,6 +4180,33 @@ static int open_socket(uint32_t address, uint16_t port)
     return sock;
 }
 
+/**
+ * Iterates through the listener linked list, printing the contents
+ */
+void print_listeners()
+{
+    listener_t      *cur = listener_head;
+    while (cur != NULL) {
+        printf("Listener: %d\n", cur->id);
+        printf(" shard: %d\n", cur->shard);
+        printf(" sockfd: %d\n", cur->sockfd);
+        printf(" max_payload: %d\n", cur->max_payload);
+        printf(" ingest: %s\n", (cur->ingest == INGEST_TPACKET) ? "tpacket" :
+                (cur->ingest == INGEST_XDP) ? "xdp" : "socket");
+        if (cur->interface != NULL) {
+            printf(" interface: %s\n", cur->interface);
+        }
+        printf(" busy_poll: %d\n", cur->busy_poll);
+        printf(" packets_received: %lu\n", cur->packets_received);
+        printf(" packets_jumbo: %lu\n", cur->packets_jumbo);
+        printf(" packets_forwarded: %lu\n", cur->packets_forwarded);
+        printf(" packets_bad_checksum: %lu\n", cur->packets_bad_checksum);
+        printf(" flow_hits: %lu\n", cur->flow_hits);
+        printf(" flow_misses: %lu\n", cur->flow_misses);
+        cur = cur->next_listener;
+    }
+}
+
 /**
  * Iterates through the transmitter hash table, printing the contents
  */
@@ -586,6 +4216,9 @@ void print_transmitters()
     while (cur != NULL) {
         printf("Transmitter: %d\n", cur->id);
         printf(" sockfd:%d\n", cur->sockfd);
+        printf(" zerocopy: %lu\n", (unsigned long)cur->zerocopy);
+        printf(" multicast_ttl: %d (loop %d)\n", cur->multicast_ttl, cur->multicast_loop);
+        printf(" egress: %s\n", (cur->egress == EGRESS_TPACKET) ? "tpacket" : "socket");
         cur = cur->hh.next;
     }
 }
@@ -601,6 +4234,14 @@ void print_targets()
         printf(" address: %lu\n", (long unsigned int)cur->address);
         printf(" port: %d\n", cur->port);
         printf(" transmitter_id: %d\n", cur->transmitter_id);
+        printf(" connect: %d\n", cur->connect);
+        printf(" queue_length: %d (drop %s)\n", cur->queue_length,
+                (cur->drop_policy == DROP_OLDEST) ? "oldest" : "newest");
+        printf(" rate: %d pps, %d bytes/s (%s)\n", cur->max_pps, cur->max_bps,
+                (cur->pacing == PACING_TXTIME) ? "txtime" : "timer");
+        printf(" thread: %d\n", cur->thread);
+        printf(" packets_queued: %lu\n", cur->packets_queued);
+        printf(" packets_dropped: %lu\n", cur->packets_dropped);
         cur = cur->hh.next;
     }
 }
@@ -615,8 +4256,15 @@ void print_maps()
     while (map != NULL) {
         printf("Map: %d(%p)\n", i, (void *)map);
         printf(" listener_id: %d\n",map->listener_id);
-        printf(" address: %lu\n", (long unsigned int)map->address);
+        // Address 0 is a real prefix unless its length is 0 (e.g. 0.0.0.0/8)
+        if (map->prefix_len == 0) {
+            printf(" address: *\n");
+        } else {
+            printf(" address: %lu\n", (long unsigned int)map->address);
+        }
+        printf(" prefix_len: %d\n", map->prefix_len);
         printf(" port: %d\n", map->port);
+        printf(" port_last: %d\n", map->port_last);
         printf(" target_id: %d\n", map->target_id);
         printf(" next_map: %p\n", (void *)map->next_map);
         map = map->next_map;
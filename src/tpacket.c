@@ -0,0 +1,490 @@
+/*
+ * tpacket.c
+ *
+ * AF_PACKET ring ingest (TPACKET_V3) and egress (TPACKET_V2 PACKET_TX_RING)
+ * for the UDP Packet Repeater
+ *
+ * A listener using the ring still binds its UDP socket, so the port stays
+ * reserved and the kernel doesn't answer with ICMP port unreachable, but that
+ * socket drops everything. The datagrams are read from a packet socket ring
+ * instead, which a generated BPF program limits to the listener's UDP port
+ * (and address). The kernel fills whole blocks of the ring, and only wakes the
+ * repeater when a block is handed over, so there's no syscall per datagram
+ * and the payloads are read where the kernel wrote them.
+ *
+ * A transmitter can send the other way: whole frames, with headers built once
+ * per target, are written into a PACKET_TX_RING on its interface, and one
+ * send() call has the kernel send every frame written since the last, rather
+ * than one sendto() call (and route lookup) per target.
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#define _GNU_SOURCE     // SO_ATTACH_FILTER
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+#include "tpacket.h"
+
+// Static method prototypes
+static void attach_filter(int sockfd, struct sock_filter *code, unsigned short len);
+static struct tpacket2_hdr *tx_frame(const tpacket_tx_t *tx, unsigned int n);
+static void close_tx(tpacket_tx_t *tx);
+
+/**
+ * Opens an AF_PACKET socket with a TPACKET_V3 receive ring, capturing the
+ * unfragmented IPv4 UDP datagrams sent to the address and port given, on
+ * every interface. Exits on failure, like the other socket setup.
+ *
+ * If fanout_id is given, the socket joins a PACKET_FANOUT group, so the
+ * shards of a listener split the datagrams by flow. Pass -1 to start a new
+ * group; it is set to the ID to pass for the other shards.
+ *
+ * @param ring      The ring to open
+ * @param address   Destination address to capture (0 for any)
+ * @param port      Destination UDP port to capture
+ * @param fanout_id The fanout group to join (-1 for a new one), or NULL
+ */
+void tpacket_open(tpacket_ring_t *ring, uint32_t address, uint16_t port, int *fanout_id)
+{
+    int                 sockfd;
+    int                 version = TPACKET_V3;
+    int                 enable = 1;
+    int                 fanout_arg;
+    socklen_t           optlen = sizeof(fanout_arg);
+    struct tpacket_req3 req;
+    struct sockaddr_ll  addr;
+
+    // Offsets are from the IP header. Every failed check jumps to the last instruction
+    struct sock_filter  code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),                          // IP protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                          // IP flags and fragment offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 6, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),                         // IP destination
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, address, 0, 4),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                         // IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                          // UDP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    // Any destination address passes
+    if (address == 0) {
+        code[5].code = BPF_JMP | BPF_JGE | BPF_K;
+    }
+
+    // Protocol 0 captures nothing until the socket is bound, after the filter is in place
+    sockfd = socket(AF_PACKET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("Opening AF_PACKET socket");
+        exit(1);
+    }
+    attach_filter(sockfd, code, sizeof(code) / sizeof(code[0]));
+
+    if (setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("Setting PACKET_VERSION");
+        exit(1);
+    }
+    // Only an optimization, outgoing packets are skipped anyway
+    setsockopt(sockfd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &enable, sizeof(enable));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = TPACKET_BLOCK_SIZE;
+    req.tp_block_nr         = TPACKET_BLOCK_NR;
+    req.tp_frame_size       = TPACKET_FRAME_SIZE;
+    req.tp_frame_nr         = (TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE) * TPACKET_BLOCK_NR;
+    req.tp_retire_blk_tov   = TPACKET_BLOCK_TOV;
+    if (setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        perror("Setting PACKET_RX_RING");
+        exit(1);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->map_len = (size_t)TPACKET_BLOCK_SIZE * TPACKET_BLOCK_NR;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0);
+    if (ring->map == MAP_FAILED) {
+        perror("Mapping the AF_PACKET ring");
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family     = AF_PACKET;
+    addr.sll_protocol   = htons(ETH_P_IP);
+    addr.sll_ifindex    = 0;
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Binding AF_PACKET socket");
+        exit(1);
+    }
+
+    if (fanout_id != NULL) {
+        if (*fanout_id < 0) {
+            fanout_arg = (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+        } else {
+            fanout_arg = *fanout_id | (PACKET_FANOUT_HASH << 16);
+        }
+        if (setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0) {
+            perror("Setting PACKET_FANOUT");
+            exit(1);
+        }
+        if (*fanout_id < 0) {
+            if (getsockopt(sockfd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, &optlen) < 0) {
+                perror("Getting PACKET_FANOUT");
+                exit(1);
+            }
+            *fanout_id = fanout_arg & 0xffff;
+        }
+    }
+
+    ring->fd = sockfd;
+}
+
+/**
+ * Steps to the next UDP datagram in the ring. Blocks are handed back to the
+ * kernel once every frame in them has been read, so the payload returned
+ * stays valid until the next call.
+ *
+ * Frames that aren't a whole, valid UDP datagram are skipped.
+ *
+ * @param ring      The ring to read
+ * @param payload   Set to the UDP payload
+ * @param len       Set to the length of the UDP payload (bytes)
+ * @param src_ip    Set to the source address (host byte order)
+ * @param src_port  Set to the source port (host byte order)
+ * @return          true if a datagram was found, false if the ring is empty
+ */
+bool tpacket_next(tpacket_ring_t *ring, const char **payload, size_t *len,
+        uint32_t *src_ip, uint16_t *src_port)
+{
+    struct tpacket_block_desc   *desc;
+    struct tpacket3_hdr         *frame;
+    struct sockaddr_ll          *sll;
+    const unsigned char         *ip;
+    udp_info_t                  info;
+
+    while (1) {
+        desc = (struct tpacket_block_desc *)(ring->map + (size_t)ring->block * TPACKET_BLOCK_SIZE);
+
+        if (ring->frames_left == 0) {
+            // Every frame in the block has been read, so hand it back
+            if (ring->frame != NULL) {
+                __sync_synchronize();
+                desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+                ring->frame = NULL;
+                ring->block = (ring->block + 1) % TPACKET_BLOCK_NR;
+                continue;
+            }
+            if ((desc->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+                return false;
+            }
+            __sync_synchronize();
+            ring->frames_left = desc->hdr.bh1.num_pkts;
+            ring->frame = (struct tpacket3_hdr *)((char *)desc + desc->hdr.bh1.offset_to_first_pkt);
+            continue;
+        }
+
+        frame = ring->frame;
+        ring->frames_left--;
+        ring->frame = (struct tpacket3_hdr *)((char *)frame + frame->tp_next_offset);
+
+        // Skip anything sent by this host, and anything cut short
+        sll = (struct sockaddr_ll *)((char *)frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (sll->sll_pkttype == PACKET_OUTGOING || frame->tp_snaplen != frame->tp_len) {
+            continue;
+        }
+
+        ip = (const unsigned char *)frame + frame->tp_net;
+        if (!frame_parse_ip(ip, frame->tp_snaplen, &info)) {
+            continue;
+        }
+
+        // The stack hasn't checked the checksum unless the NIC did (or the packet is local)
+        if ((frame->tp_status & (TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY)) == 0 &&
+                !frame_udp_checksum_ok(ip, info.payload - UDP_HEADER_SIZE, info.payload_len + UDP_HEADER_SIZE)) {
+            fprintf(stderr, "ERROR: Dropped datagram with bad UDP checksum from ring %d\n", ring->fd);
+            continue;
+        }
+
+        *src_ip     = info.src_ip;
+        *src_port   = info.src_port;
+        *payload    = (const char *)info.payload;
+        *len        = info.payload_len;
+        return true;
+    }
+}
+
+/**
+ * Attaches a filter dropping everything to a UDP socket. Used for listeners
+ * that receive through a ring, so their socket's queue never fills.
+ *
+ * @param sockfd The socket to mute
+ */
+void tpacket_mute_socket(int sockfd)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    attach_filter(sockfd, code, 1);
+}
+
+/**
+ * Opens an AF_PACKET socket with a TPACKET_V2 send ring on an interface.
+ * Unlike the other socket setup, failures are logged and returned, so the
+ * transmitter can go on sending through its socket.
+ *
+ * The socket is bound with protocol 0, so it captures nothing, and the
+ * protocol is given with each send() call instead.
+ *
+ * @param tx        The ring to open
+ * @param interface The interface to send from
+ * @return          0 on success, -1 (with nothing left open) on failure
+ */
+int tpacket_open_tx(tpacket_tx_t *tx, const char *interface)
+{
+    int                 version = TPACKET_V2;
+    int                 enable = 1;
+    struct tpacket_req  req;
+    struct sockaddr_ll  addr;
+    struct ifreq        ifr;
+    size_t              mtu;
+
+    memset(tx, 0, sizeof(*tx));
+    tx->fd = -1;
+    if (frame_get_iface(interface, &tx->iface) < 0) {
+        fprintf(stderr, "ERROR: Interface %s not found, or has no IPv4 address\n", interface);
+        return -1;
+    }
+
+    tx->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (tx->fd < 0) {
+        perror("Opening AF_PACKET socket");
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, tx->iface.name);
+    if (ioctl(tx->fd, SIOCGIFMTU, &ifr) < 0) {
+        perror("Getting interface MTU");
+        close_tx(tx);
+        return -1;
+    }
+    mtu = ifr.ifr_mtu;
+    if (setsockopt(tx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("Setting PACKET_VERSION");
+        close_tx(tx);
+        return -1;
+    }
+    // Malformed frames are skipped rather than stopping the ring
+    setsockopt(tx->fd, SOL_PACKET, PACKET_LOSS, &enable, sizeof(enable));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size   = TPACKET_TX_BLOCK_SIZE;
+    req.tp_block_nr     = TPACKET_TX_FRAME_NR / (TPACKET_TX_BLOCK_SIZE / TPACKET_TX_FRAME_SIZE);
+    req.tp_frame_size   = TPACKET_TX_FRAME_SIZE;
+    req.tp_frame_nr     = TPACKET_TX_FRAME_NR;
+    if (setsockopt(tx->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        perror("Setting PACKET_TX_RING");
+        close_tx(tx);
+        return -1;
+    }
+    tx->map_len = (size_t)TPACKET_TX_FRAME_SIZE * TPACKET_TX_FRAME_NR;
+    tx->map = mmap(NULL, tx->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, tx->fd, 0);
+    if (tx->map == MAP_FAILED) {
+        perror("Mapping the AF_PACKET send ring");
+        tx->map = NULL;
+        close_tx(tx);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family     = AF_PACKET;
+    addr.sll_protocol   = 0;
+    addr.sll_ifindex    = tx->iface.ifindex;
+    if (bind(tx->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Binding AF_PACKET socket");
+        close_tx(tx);
+        return -1;
+    }
+
+    // Frames aren't fragmented, so a datagram has to fit the MTU as well as the frame
+    tx->max_payload = TPACKET_TX_FRAME_SIZE - TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) - FRAME_HEADERS_SIZE;
+    if (mtu - IP_HEADER_SIZE - UDP_HEADER_SIZE < tx->max_payload) {
+        tx->max_payload = mtu - IP_HEADER_SIZE - UDP_HEADER_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * Builds the headers of the frames sent to a target through a send ring, and
+ * looks up the MAC address of its next hop
+ *
+ * @param tx        The ring the target is sent to through
+ * @param path      The path to build
+ * @param src_ip    The source address of the frames (host byte order)
+ * @param src_port  The source port of the frames (host byte order)
+ * @param dst_ip    The target's address (host byte order)
+ * @param dst_port  The target's port (host byte order)
+ */
+void tpacket_init_path(const tpacket_tx_t *tx, tpacket_path_t *path, uint32_t src_ip, uint16_t src_port,
+        uint32_t dst_ip, uint16_t dst_port)
+{
+    unsigned char dst_mac[MAC_SIZE];
+
+    memset(path, 0, sizeof(*path));
+    memset(dst_mac, 0, sizeof(dst_mac));
+    frame_init_template(&path->headers, tx->iface.mac, dst_mac, src_ip, src_port, dst_ip, dst_port);
+    path->dst_ip = dst_ip;
+    tpacket_path_ready(tx, path);
+}
+
+/**
+ * Checks whether frames can be sent on a path, looking the next hop's MAC
+ * address up if it is unknown (at most every TPACKET_RESOLVE_RETRY seconds)
+ * or due for a refresh. The address is the first field of the headers, so
+ * the checksum sums don't change.
+ *
+ * @return true if the MAC address is known
+ */
+bool tpacket_path_ready(const tpacket_tx_t *tx, tpacket_path_t *path)
+{
+    time_t now = time(NULL);
+
+    if (now < path->next_resolve) {
+        return path->resolved;
+    }
+    path->resolved = (frame_resolve_mac(&tx->iface, path->dst_ip, path->headers.headers) == 0);
+    path->next_resolve = now + (path->resolved ? TPACKET_RESOLVE_REFRESH : TPACKET_RESOLVE_RETRY);
+    return path->resolved;
+}
+
+/**
+ * Checks that the next frames of a send ring are free, so a datagram and
+ * the ones coalesced with it can all be sent through the ring
+ *
+ * @param tx    The ring
+ * @param count The number of frames needed
+ * @return      true if there are that many free
+ */
+bool tpacket_tx_room(const tpacket_tx_t *tx, unsigned int count)
+{
+    unsigned int status;
+
+    if (count > TPACKET_TX_FRAME_NR) {
+        return false;
+    }
+    for (unsigned int n = 0; n < count; n++) {
+        status = __atomic_load_n(&tx_frame(tx, tx->frame + n)->tp_status, __ATOMIC_ACQUIRE);
+        if (status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes a datagram to a path's target into the next frame of a send ring:
+ * the path's headers, with the lengths, IP ID and checksums filled in, then
+ * the payload. The kernel sends it at the next tpacket_tx_kick().
+ *
+ * @param tx            The ring
+ * @param path          The target's path, which must be ready
+ * @param payload       The payload
+ * @param len           The payload length, up to the ring's max_payload (bytes)
+ * @param payload_sum   The payload's frame_payload_sum()
+ * @return              true if written, false if the frame is still in use
+ */
+bool tpacket_tx_frame(tpacket_tx_t *tx, const tpacket_path_t *path, const void *payload, size_t len,
+        uint32_t payload_sum)
+{
+    struct tpacket2_hdr *hdr = tx_frame(tx, tx->frame);
+    unsigned char       *frame = (unsigned char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket2_hdr));
+
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+        return false;
+    }
+    memcpy(frame + FRAME_HEADERS_SIZE, payload, len);
+    frame_fill_headers(frame, &path->headers, len, payload_sum, tx->ip_id++);
+    hdr->tp_len = FRAME_HEADERS_SIZE + len;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    tx->frame = (tx->frame + 1) % TPACKET_TX_FRAME_NR;
+    tx->pending++;
+    return true;
+}
+
+/**
+ * Asks the kernel to send every frame written to a send ring since the last
+ * call, with one send() call. It doesn't wait for them to go out; a frame is
+ * free again once the device is done with it.
+ *
+ * @param tx The ring
+ */
+void tpacket_tx_kick(tpacket_tx_t *tx)
+{
+    struct sockaddr_ll addr;
+
+    if (tx->pending == 0) {
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family     = AF_PACKET;
+    addr.sll_protocol   = htons(ETH_P_IP);
+    addr.sll_ifindex    = tx->iface.ifindex;
+    if (sendto(tx->fd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+            errno != EAGAIN && errno != ENOBUFS) {
+        perror("ERROR: Sending AF_PACKET ring");
+    }
+    tx->pending = 0;
+}
+
+/**
+ * Finds the header of frame n of a send ring. The blocks hold whole frames,
+ * so the frames follow each other through the mapping.
+ */
+static struct tpacket2_hdr *tx_frame(const tpacket_tx_t *tx, unsigned int n)
+{
+    return (struct tpacket2_hdr *)(tx->map + (size_t)(n % TPACKET_TX_FRAME_NR) * TPACKET_TX_FRAME_SIZE);
+}
+
+/**
+ * Closes a send ring that couldn't be set up
+ */
+static void close_tx(tpacket_tx_t *tx)
+{
+    if (tx->map != NULL) {
+        munmap(tx->map, tx->map_len);
+        tx->map = NULL;
+    }
+    close(tx->fd);
+    tx->fd = -1;
+}
+
+/**
+ * Attaches a classic BPF program to a socket, exiting on failure
+ */
+static void attach_filter(int sockfd, struct sock_filter *code, unsigned short len)
+{
+    struct sock_fprog prog;
+
+    prog.len    = len;
+    prog.filter = code;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("Setting SO_ATTACH_FILTER");
+        exit(1);
+    }
+}
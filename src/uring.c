@@ -0,0 +1,654 @@
+/*
+ * uring.c
+ *
+ * io_uring engine for the UDP Packet Repeater
+ *
+ * Every listener and transmitter socket gets one multishot recvmsg request
+ * that pulls its buffers from a provided buffer ring, so receiving needs no
+ * syscall per packet. The sends for a packet are queued as one hard-linked
+ * chain of sendmsg requests, and only the last one in the chain posts a
+ * completion on success. That completion hands the buffer back to the ring.
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#define _GNU_SOURCE     // syscall()
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "classify.h"
+#include "uring.h"
+
+#define TAG_SEND    1UL     // Set in the user_data of send requests
+
+/*
+ * One sendmsg request of a forwarded packet. The sends of a packet form a
+ * chain; the first send in the chain keeps the totals for it.
+ */
+typedef struct uring_send_s
+{
+    struct msghdr       msg;
+    struct iovec        iov;
+    const route_t       *route;     // Transmitter socket and destination address
+    int                 bid;        // Provided buffer holding the payload
+    int                 count;      // Sends in the chain (first send only)
+    int                 failed;     // Sends in the chain that failed (first send only)
+    bool                last;       // Last send in the chain
+    listener_t          *listener;  // Listener the packet arrived on
+    struct uring_send_s *head;      // First send in the chain
+    struct uring_send_s *next;      // Next send in the chain, or in the free list
+} uring_send_t;
+
+/* Global Variables */
+static int                      ring_fd = -1;
+static void                     *sq_ptr = NULL;
+static void                     *cq_ptr = NULL;
+static size_t                   sq_size = 0;
+static size_t                   cq_size = 0;
+static struct io_uring_sqe      *sqes = NULL;
+static size_t                   sqes_size = 0;
+static unsigned                 *sq_head;
+static unsigned                 *sq_tail;
+static unsigned                 *sq_array;
+static unsigned                 sq_mask;
+static unsigned                 sq_entries;
+static unsigned                 sq_local_tail;      // Tail including queued, unpublished entries
+static unsigned                 *cq_head;
+static unsigned                 *cq_tail;
+static unsigned                 cq_mask;
+static struct io_uring_cqe      *cqes;
+
+// Provided buffer ring
+static struct io_uring_buf_ring *buf_ring = NULL;
+static size_t                   buf_ring_size = 0;
+static unsigned                 num_bufs = 0;
+static unsigned short           buf_tail = 0;       // Tail including recycled, unpublished buffers
+static unsigned short           buf_published = 0;  // Tail the kernel has seen
+static char                     *bufs = NULL;
+static size_t                   buf_size = 0;
+
+// Send requests
+static uring_send_t             *sends = NULL;
+static uring_send_t             *send_free = NULL;
+
+// Sockets whose multishot receive ran out of buffers
+static void                     **starved = NULL;
+static int                      num_starved = 0;
+
+// Shared header for every multishot receive, copied by the kernel when armed
+static struct msghdr            recv_msg;
+
+// Static method prototypes
+static int setup_ring(unsigned entries);
+static void teardown_ring(void);
+static void restore_gro(listener_t **gro_off, int num_gro_off);
+static int enter_ring(unsigned to_submit, unsigned min_complete);
+static struct io_uring_sqe *get_sqe(void);
+static unsigned sq_space(void);
+static void flush_sqes(void);
+static void arm_recv(void *owner);
+static void recycle_buf(int bid);
+static void handle_recv(void *owner, int res, unsigned flags);
+static void handle_send(uring_send_t *send, int res);
+
+/**
+ * Runs the io_uring engine over the listeners and transmitters given. The
+ * receive buffers are sized for the largest UDP payload, as the epoll loop's
+ * are with their jumbo regions, so selecting the engine doesn't change which
+ * datagrams get through.
+ *
+ * Returns only if io_uring (or multishot recvmsg with provided buffer rings)
+ * is not available on this kernel, after releasing everything it set up and
+ * turning UDP_GRO back on where it turned it off, so the caller can fall
+ * back to the epoll loop.
+ *
+ * @param listeners     The listener linked list
+ * @param transmitters  The transmitter hash table
+ * @return              -1 if io_uring can't be used
+ */
+int run_uring_engine(listener_t *listeners, transmitter_t *transmitters)
+{
+    listener_t          *listener;
+    transmitter_t       *transmitter;
+    int                 max_fanout = 1;
+    int                 num_sockets = 0;
+    unsigned            entries = URING_MIN_ENTRIES;
+    unsigned            max_sends;
+    listener_t          **gro_off;
+    int                 num_gro_off = 0;
+    unsigned            head;
+    unsigned            tail;
+    struct io_uring_cqe *cqe;
+    uint64_t            user_data;
+    int                 res;
+    unsigned            flags;
+
+    // Every send of a packet must fit in the submission queue at once
+    for (listener = listeners; listener != NULL; listener = listener->next_listener) {
+        if (listener->num_maps > max_fanout) {
+            max_fanout = listener->num_maps;
+        }
+        num_sockets++;
+    }
+    for (transmitter = transmitters; transmitter != NULL; transmitter = transmitter->hh.next) {
+        num_sockets++;
+    }
+    while (entries < (unsigned)max_fanout + 1 && entries < URING_MAX_ENTRIES) {
+        entries <<= 1;
+    }
+    if (entries < (unsigned)max_fanout + 1) {
+        fprintf(stderr, "io_uring: %d targets for one listener is too many\n", max_fanout);
+        return -1;
+    }
+
+    // Every buffer in flight may need a send per map, so trade buffers for fanout
+    num_bufs = URING_MAX_BUFS;
+    while (num_bufs > URING_MIN_BUFS && num_bufs * (unsigned)max_fanout > URING_MAX_SENDS) {
+        num_bufs >>= 1;
+    }
+    max_sends = num_bufs * max_fanout;
+
+    if (setup_ring(entries) < 0) {
+        teardown_ring();
+        return -1;
+    }
+
+    // Allocate the receive buffers, and hand all of them to the kernel
+    buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + BUFFER_SIZE;
+    buf_size = (buf_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    bufs = malloc(num_bufs * buf_size);
+    sends = malloc(max_sends * sizeof(uring_send_t));
+    starved = malloc(num_sockets * sizeof(void *));
+    gro_off = malloc(num_sockets * sizeof(listener_t *));
+    if (bufs == NULL || sends == NULL || starved == NULL || gro_off == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    for (unsigned i = 0; i < num_bufs; i++) {
+        recycle_buf(i);
+    }
+    buf_published = buf_tail;
+    __atomic_store_n(&buf_ring->tail, buf_published, __ATOMIC_RELEASE);
+    for (unsigned i = 0; i < max_sends; i++) {
+        sends[i].next = send_free;
+        send_free = &sends[i];
+    }
+
+    // Arm a multishot receive on every socket
+    memset(&recv_msg, 0, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    for (listener = listeners; listener != NULL; listener = listener->next_listener) {
+        // The provided buffers hold one datagram each, so turn UDP_GRO back off
+        if (listener->gro) {
+            setsockopt(listener->sockfd, SOL_UDP, UDP_GRO, &(int){0}, sizeof(int));
+            listener->gro = false;
+            gro_off[num_gro_off++] = listener;
+        }
+        arm_recv(listener);
+    }
+    for (transmitter = transmitters; transmitter != NULL; transmitter = transmitter->hh.next) {
+        arm_recv(transmitter);
+    }
+    if (enter_ring(sq_local_tail - *sq_head, 0) < 0) {
+        perror("io_uring_enter");
+        teardown_ring();
+        restore_gro(gro_off, num_gro_off);
+        return -1;
+    }
+
+    // Kernels without multishot recvmsg fail the request as soon as it is submitted
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &cqes[head & cq_mask];
+        if (!(cqe->user_data & TAG_SEND) && cqe->res == -EINVAL) {
+            fprintf(stderr, "io_uring: multishot recvmsg not supported\n");
+            teardown_ring();
+            restore_gro(gro_off, num_gro_off);
+            return -1;
+        }
+    }
+    free(gro_off);
+
+    printf("io_uring engine started (%u entries, %u buffers of %lu bytes)\n",
+            entries, num_bufs, (long unsigned int)buf_size);
+
+    // Main loop
+    while (1) {
+        flush_sqes();
+        if (enter_ring(sq_local_tail - *sq_head, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("ERROR: io_uring_enter");
+            exit(1);
+        }
+
+        // Reap every completion that is ready
+        head = *cq_head;
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &cqes[head & cq_mask];
+            user_data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (user_data & TAG_SEND) {
+                handle_send((uring_send_t *)(uintptr_t)(user_data & ~TAG_SEND), res);
+            } else {
+                handle_recv((void *)(uintptr_t)user_data, res, flags);
+            }
+        }
+
+        // Give recycled buffers back to the kernel, then rearm starved sockets
+        if (buf_published != buf_tail) {
+            buf_published = buf_tail;
+            __atomic_store_n(&buf_ring->tail, buf_published, __ATOMIC_RELEASE);
+            for (int i = 0; i < num_starved; i++) {
+                arm_recv(starved[i]);
+            }
+            num_starved = 0;
+        }
+    }
+}
+
+/**
+ * Creates the ring, maps its queues, and registers the provided buffer ring
+ *
+ * @param entries   Submission queue size (power of 2)
+ * @return          0 on success, -1 if io_uring can't be used
+ */
+static int setup_ring(unsigned entries)
+{
+    struct io_uring_params  params;
+    struct io_uring_buf_reg reg;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = entries * 4;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    // Map the submission and completion queues
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) {
+            sq_size = cq_size;
+        }
+        cq_size = 0;
+    }
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("io_uring mmap");
+        sq_ptr = NULL;
+        return -1;
+    }
+    if (cq_size == 0) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("io_uring mmap");
+            cq_ptr = NULL;
+            return -1;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        sqes = NULL;
+        return -1;
+    }
+
+    sq_head     = (unsigned *)((char *)sq_ptr + params.sq_off.head);
+    sq_tail     = (unsigned *)((char *)sq_ptr + params.sq_off.tail);
+    sq_array    = (unsigned *)((char *)sq_ptr + params.sq_off.array);
+    sq_mask     = *(unsigned *)((char *)sq_ptr + params.sq_off.ring_mask);
+    sq_entries  = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    cq_head     = (unsigned *)((char *)cq_ptr + params.cq_off.head);
+    cq_tail     = (unsigned *)((char *)cq_ptr + params.cq_off.tail);
+    cq_mask     = *(unsigned *)((char *)cq_ptr + params.cq_off.ring_mask);
+    cqes        = (struct io_uring_cqe *)((char *)cq_ptr + params.cq_off.cqes);
+
+    // SQEs are always used in order, so the index array never changes
+    for (unsigned i = 0; i < sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    // Register the provided buffer ring (buffer group 0)
+    buf_ring_size = num_bufs * sizeof(struct io_uring_buf);
+    buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        perror("io_uring buffer ring mmap");
+        buf_ring = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = num_bufs;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring provided buffer ring");
+        return -1;
+    }
+    buf_tail = 0;
+
+    return 0;
+}
+
+/**
+ * Releases the ring and its mappings (pending requests die with it)
+ */
+static void teardown_ring(void)
+{
+    if (sqes != NULL) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != NULL && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != NULL) {
+        munmap(sq_ptr, sq_size);
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+    if (buf_ring != NULL) {
+        munmap(buf_ring, buf_ring_size);
+    }
+    free(bufs);
+    free(sends);
+    free(starved);
+    sqes = NULL;
+    sq_ptr = cq_ptr = NULL;
+    ring_fd = -1;
+    buf_ring = NULL;
+    bufs = NULL;
+    sends = NULL;
+    starved = NULL;
+    send_free = NULL;
+}
+
+/**
+ * Turns UDP_GRO back on for the listeners the engine turned it off for,
+ * when it gives up so the epoll loop can take over
+ *
+ * @param gro_off       The listeners UDP_GRO was turned off for
+ * @param num_gro_off   Number of entries in gro_off
+ */
+static void restore_gro(listener_t **gro_off, int num_gro_off)
+{
+    for (int i = 0; i < num_gro_off; i++) {
+        setsockopt(gro_off[i]->sockfd, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int));
+        gro_off[i]->gro = true;
+    }
+    free(gro_off);
+}
+
+/**
+ * Submits queued entries and optionally waits for completions
+ *
+ * @return The result of io_uring_enter()
+ */
+static int enter_ring(unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * @return The number of submission queue entries free for queueing
+ */
+static unsigned sq_space(void)
+{
+    return sq_entries - (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Takes the next free submission queue entry, cleared. Submits the queued
+ * entries first if the queue is full.
+ */
+static struct io_uring_sqe *get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (sq_space() == 0) {
+        flush_sqes();
+        enter_ring(sq_local_tail - *sq_head, 0);
+    }
+    sqe = &sqes[sq_local_tail & sq_mask];
+    sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Publishes the queued entries to the kernel
+ */
+static void flush_sqes(void)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues a multishot recvmsg on a socket, taking buffers from group 0
+ *
+ * @param owner The listener_t or transmitter_t of the socket
+ */
+static void arm_recv(void *owner)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode     = IORING_OP_RECVMSG;
+    // Both structs start with their socket_type_t
+    if (*(socket_type_t *)owner == SOCKET_LISTENER) {
+        sqe->fd     = ((listener_t *)owner)->sockfd;
+    } else {
+        sqe->fd     = ((transmitter_t *)owner)->sockfd;
+    }
+    sqe->addr       = (uint64_t)(uintptr_t)&recv_msg;
+    sqe->len        = 1;
+    sqe->ioprio     = IORING_RECV_MULTISHOT;
+    sqe->flags      = IOSQE_BUFFER_SELECT;
+    sqe->buf_group  = 0;
+    sqe->user_data  = (uint64_t)(uintptr_t)owner;
+}
+
+/**
+ * Gives a buffer back to the provided buffer ring. The kernel only sees it
+ * once the ring tail is published.
+ */
+static void recycle_buf(int bid)
+{
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (num_bufs - 1)];
+
+    buf->addr   = (uint64_t)(uintptr_t)(bufs + (size_t)bid * buf_size);
+    buf->len    = buf_size;
+    buf->bid    = bid;
+    buf_tail++;
+}
+
+/**
+ * Handles a completion of a multishot receive. Looks up the packet in the
+ * listener's classifier and queues one hard-linked chain of sends for it.
+ *
+ * @param owner The listener_t or transmitter_t the receive was armed for
+ * @param res   Bytes placed in the buffer, or -errno
+ * @param flags The completion flags (buffer ID and IORING_CQE_F_MORE)
+ */
+static void handle_recv(void *owner, int res, unsigned flags)
+{
+    listener_t                  *listener = owner;
+    struct io_uring_recvmsg_out *out;
+    struct sockaddr_in          *src_addr;
+    char                        *payload;
+    int                         bid;
+    uint32_t                    src_ip;
+    uint16_t                    src_port;
+    const match_t               *match;
+    route_t                     *route;
+    uring_send_t                *head = NULL;
+    uring_send_t                *tail = NULL;
+    uring_send_t                *send;
+    int                         count = 0;
+    struct io_uring_sqe         *sqe;
+
+    // The multishot request ends on errors, so it has to be armed again.
+    // Without buffers that waits until some are recycled
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (res == -ENOBUFS) {
+            starved[num_starved++] = owner;
+        } else {
+            arm_recv(owner);
+        }
+    }
+    if (res < 0) {
+        if (res != -ENOBUFS) {
+            fprintf(stderr, "ERROR: io_uring recvmsg: %s\n", strerror(-res));
+        }
+        return;
+    }
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    // Data received by a transmitter is never forwarded
+    if (*(socket_type_t *)owner == SOCKET_TRANSMITTER) {
+        recycle_buf(bid);
+        return;
+    }
+
+    out = (struct io_uring_recvmsg_out *)(bufs + (size_t)bid * buf_size);
+    src_addr = (struct sockaddr_in *)(out + 1);
+    payload = (char *)(out + 1) + sizeof(struct sockaddr_in);
+    listener->packets_received++;
+    if (out->flags & MSG_TRUNC) {
+        fprintf(stderr, "ERROR: Dropped packet on listener %d larger than the %lu byte buffers\n",
+                listener->id, (long unsigned int)(buf_size - ((char *)payload - (char *)out)));
+        recycle_buf(bid);
+        return;
+    }
+    if (out->payloadlen > (uint32_t)listener->max_payload) {
+        listener->packets_jumbo++;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Received packet on listener ID: %d from %s:%d\n",
+            listener->id, inet_ntoa(src_addr->sin_addr), ntohs(src_addr->sin_port));
+#endif
+
+    // Get the source IP and port, in host byte order
+    src_ip = ntohl(src_addr->sin_addr.s_addr);
+    src_port = ntohs(src_addr->sin_port);
+
+    // Build the chain of sends, one per matching map
+    match = classifier_match(listener, src_ip, src_port);
+    for (int r = 0; r < match->num_routes; r++) {
+        route = match->routes[r];
+        send = send_free;
+        if (send == NULL) {
+            fprintf(stderr, "ERROR: io_uring out of send requests\n");
+            break;
+        }
+        send_free = send->next;
+        memset(&send->msg, 0, sizeof(send->msg));
+        send->iov.iov_base      = payload;
+        send->iov.iov_len       = out->payloadlen;
+        if (!route->transmitter->connected) {
+            send->msg.msg_name      = (void *)&route->dest_addr;
+            send->msg.msg_namelen   = sizeof(route->dest_addr);
+        }
+        send->msg.msg_iov       = &send->iov;
+        send->msg.msg_iovlen    = 1;
+        send->route             = route;
+        send->bid               = bid;
+        send->listener          = listener;
+        send->last              = false;
+        send->head              = NULL;
+        send->next              = NULL;
+        if (head == NULL) {
+            head = send;
+        } else {
+            tail->next = send;
+        }
+        tail = send;
+        count++;
+    }
+    if (head == NULL) {
+        recycle_buf(bid);
+        return;
+    }
+    tail->last = true;
+    head->count = count;
+    head->failed = 0;
+
+    // The whole chain has to go in one submission
+    if (sq_space() < (unsigned)count) {
+        flush_sqes();
+        enter_ring(sq_local_tail - *sq_head, 0);
+    }
+    for (send = head; send != NULL; send = send->next) {
+        send->head      = head;
+        sqe = get_sqe();
+        sqe->opcode     = IORING_OP_SENDMSG;
+        sqe->fd         = send->route->sockfd;
+        sqe->addr       = (uint64_t)(uintptr_t)&send->msg;
+        sqe->len        = 1;
+        sqe->user_data  = (uint64_t)(uintptr_t)send | TAG_SEND;
+        if (!send->last) {
+            sqe->flags  = IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+        }
+    }
+}
+
+/**
+ * Handles a completion of a send. Failures are always reported; successes
+ * only for the last send in a chain, which frees the chain and its buffer.
+ *
+ * @param send  The send request that completed
+ * @param res   Bytes sent, or -errno
+ */
+static void handle_send(uring_send_t *send, int res)
+{
+    uring_send_t    *head = send->head;
+    uring_send_t    *next;
+
+    if (res < 0) {
+        fprintf(stderr, "ERROR: io_uring sendmsg to %s:%d: %s\n",
+                inet_ntoa(send->route->dest_addr.sin_addr), ntohs(send->route->dest_addr.sin_port), strerror(-res));
+        head->failed++;
+    }
+    if (!send->last) {
+        return;
+    }
+
+    // Every send before the last one in the chain has finished
+    head->listener->packets_forwarded += head->count - head->failed;
+    recycle_buf(head->bid);
+    for (send = head; send != NULL; send = next) {
+        next = send->next;
+        send->next = send_free;
+        send_free = send;
+    }
+}
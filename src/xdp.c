@@ -0,0 +1,878 @@
+/*
+ * xdp.c
+ *
+ * AF_XDP datapath for the UDP Packet Repeater
+ *
+ * Every interface with an AF_XDP listener or transmitter gets one XSK socket
+ * (on queue 0), and all of them share one UMEM, so a frame received on one
+ * interface can be sent from any other without a copy. An XDP program on each
+ * listening interface redirects the unfragmented UDP datagrams for the
+ * listeners' ports (and addresses) to the XSK; everything else goes on to the
+ * kernel as usual.
+ *
+ * A received frame is matched against its listener's maps. It is rewritten
+ * in place (MAC and IP addresses, ports and checksums) and put on the TX ring
+ * for the last target it goes to, and copied into a free frame for any other.
+ * Targets whose transmitter has no XSK, or whose next hop's MAC address isn't
+ * known yet, are sent to through the transmitter's socket.
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#define _GNU_SOURCE     // syscall()
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "classify.h"
+#include "xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP              44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP             283
+#endif
+
+#define XDP_RING_MASK       (XDP_RING_SIZE - 1)
+#define XDP_TX_RESERVE      512     // Free frames kept back from the fill rings, for copies to extra targets
+#define XDP_RESOLVE_REFRESH 30      // Time between MAC address lookups for a resolved target (s)
+#define PORT_ANY_ADDRESS    0xffffffff  // Ports map value for a listener on every address
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/*
+ * One of the four rings of an XSK, shared with the kernel. The local index is
+ * the producer for the fill and TX rings, and the consumer for the RX and
+ * completion rings.
+ */
+typedef struct xdp_ring_s
+{
+    uint32_t    *producer;
+    uint32_t    *consumer;
+    void        *descs;     // struct xdp_desc for RX and TX, frame addresses for fill and completion
+    uint32_t    local;      // Index not yet published to the kernel
+    void        *map;
+    size_t      map_len;
+} xdp_ring_t;
+
+/*
+ * The XSK socket of one interface, and the XDP program steering the
+ * listeners' datagrams to it. Stored in a linked list.
+ */
+typedef struct xsk_s
+{
+    socket_type_t   type;           // Always SOCKET_XSK
+    int             fd;             // XSK socket file descriptor
+    iface_t         iface;          // Interface the socket is bound to
+    listener_t      **listeners;    // Listeners receiving on this interface
+    int             num_listeners;
+    xdp_ring_t      rx;
+    xdp_ring_t      tx;
+    xdp_ring_t      fill;
+    xdp_ring_t      comp;
+    uint32_t        tx_pending;     // TX descriptors not yet published
+    int             ports_map_fd;   // Listener ports, looked up by the XDP program
+    int             xsks_map_fd;    // XSK to redirect to, by RX queue
+    int             prog_fd;        // The XDP program
+    int             link_fd;        // The XDP program's attachment to the interface
+    struct xsk_s    *next;
+} xsk_t;
+
+/* Global Variables */
+static xsk_t        *xsk_head = NULL;
+static target_t     *path_targets = NULL;   // Targets that may have an xdp_path_t
+static char         *umem = NULL;           // Frames shared by every XSK
+static size_t       umem_len = 0;
+static uint64_t     free_frames[XDP_NUM_FRAMES];    // Stack of unused frame addresses
+static int          num_free = 0;
+static uint16_t     ip_id = 0;              // IP ID of the next frame sent
+
+// Static method prototypes
+static long bpf(int cmd, union bpf_attr *attr);
+static xsk_t *get_xsk(const char *name);
+static int add_path(target_t *target, transmitter_t *transmitter);
+static int open_xsk(xsk_t *xsk, xsk_t *owner, xdp_mode_t mode);
+static int map_ring(int fd, xdp_ring_t *ring, struct xdp_ring_offset *offsets, off_t pgoff, size_t desc_size);
+static int load_program(xsk_t *xsk, xdp_mode_t mode);
+static void teardown(void);
+static bool recv_frames(xsk_t *xsk, int budget);
+static void forward_frame(xsk_t *xsk, uint64_t addr, uint32_t len);
+static bool path_ready(xdp_path_t *path);
+static bool send_frame(xdp_path_t *path, uint64_t addr, size_t payload_len);
+static void reclaim(xsk_t *xsk);
+static void refill(xsk_t *xsk);
+static bool kick(xsk_t *xsk);
+
+/**
+ * Sets up the AF_XDP datapath: an XSK for every interface with an INGEST_XDP
+ * listener or a transmitter with an interface, the shared UMEM, and the XDP
+ * program of every listening interface. Targets whose transmitter has an
+ * interface get an xdp_path_t.
+ *
+ * @param listeners     The listener linked list
+ * @param transmitters  The transmitter hash table
+ * @param targets       The target hash table
+ * @param mode          How to attach the XDP programs
+ * @return              0 on success, -1 (with nothing left set up) on failure
+ */
+int xdp_init(listener_t *listeners, transmitter_t *transmitters, target_t *targets, xdp_mode_t mode)
+{
+    listener_t      *listener;
+    transmitter_t   *transmitter;
+    target_t        *target;
+    xsk_t           *xsk;
+    xsk_t           *owner = NULL;
+    listener_t      **grown;
+    int             transmitter_id;
+
+    path_targets = targets;
+
+    // Listening interfaces, with their listeners
+    for (listener = listeners; listener != NULL; listener = listener->next_listener) {
+        if (listener->ingest != INGEST_XDP || listener->shard != 0) {
+            continue;
+        }
+        xsk = get_xsk(listener->interface);
+        if (xsk == NULL) {
+            teardown();
+            return -1;
+        }
+        for (int i = 0; i < xsk->num_listeners; i++) {
+            if (xsk->listeners[i]->port == listener->port) {
+                fprintf(stderr, "ERROR: Listeners %d and %d both use port %d on %s with AF_XDP\n",
+                        xsk->listeners[i]->id, listener->id, listener->port, listener->interface);
+                exit(1);
+            }
+        }
+        grown = realloc(xsk->listeners, (xsk->num_listeners + 1) * sizeof(listener_t *));
+        if (grown == NULL) {
+            fprintf(stderr, "ERROR: malloc failed\n");
+            exit(1);
+        }
+        xsk->listeners = grown;
+        xsk->listeners[xsk->num_listeners++] = listener;
+    }
+
+    // Sending interfaces, and the targets sent to through them
+    for (target = targets; target != NULL; target = target->hh.next) {
+        transmitter_id = target->transmitter_id;
+        HASH_FIND_INT(transmitters, &transmitter_id, transmitter);
+        if (transmitter == NULL || transmitter->interface == NULL) {
+            continue;
+        }
+        if (add_path(target, transmitter) < 0) {
+            teardown();
+            return -1;
+        }
+    }
+
+    // The UMEM, and its frames
+    umem_len = (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    umem = mmap(NULL, umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (umem == MAP_FAILED) {
+        perror("Mapping the UMEM");
+        umem = NULL;
+        teardown();
+        return -1;
+    }
+    for (int i = XDP_NUM_FRAMES - 1; i >= 0; i--) {
+        free_frames[num_free++] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+
+    // The first socket registers the UMEM, the others share it
+    for (xsk = xsk_head; xsk != NULL; xsk = xsk->next) {
+        if (open_xsk(xsk, owner, mode) < 0) {
+            teardown();
+            return -1;
+        }
+        if (owner == NULL) {
+            owner = xsk;
+        }
+    }
+    for (xsk = xsk_head; xsk != NULL; xsk = xsk->next) {
+        if (xsk->num_listeners == 0) {
+            continue;
+        }
+        if (load_program(xsk, mode) < 0) {
+            teardown();
+            return -1;
+        }
+        refill(xsk);
+        fprintf(stderr, "AF_XDP: Receiving on %s for %d listener(s)\n", xsk->iface.name, xsk->num_listeners);
+    }
+    return 0;
+}
+
+/**
+ * Registers the XSK of every listening interface with an epoll instance,
+ * edge-triggered. The events point at the xsk_t, which starts with its
+ * socket_type_t.
+ *
+ * @param epoll_fd The epoll instance
+ */
+void xdp_register(int epoll_fd)
+{
+    struct epoll_event  ev;
+    xsk_t               *xsk;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    for (xsk = xsk_head; xsk != NULL; xsk = xsk->next) {
+        if (xsk->num_listeners == 0) {
+            continue;
+        }
+        ev.data.ptr = xsk;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, xsk->fd, &ev) < 0) {
+            perror("ERROR: epoll_ctl");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Forwards up to budget frames from the RX ring of every XSK, then hands the
+ * kernel the frames sent and the free frames to receive into
+ *
+ * @param budget    The most frames handled per XSK
+ * @return          true if any RX ring may still have frames waiting, or any
+ *                  TX ring frames the kernel hasn't sent yet
+ */
+bool xdp_poll(int budget)
+{
+    xsk_t   *xsk;
+    bool    more = false;
+
+    for (xsk = xsk_head; xsk != NULL; xsk = xsk->next) {
+        reclaim(xsk);
+        if (xsk->num_listeners > 0 && recv_frames(xsk, budget)) {
+            more = true;
+        }
+    }
+    for (xsk = xsk_head; xsk != NULL; xsk = xsk->next) {
+        if (kick(xsk)) {
+            more = true;
+        }
+        if (xsk->num_listeners > 0) {
+            refill(xsk);
+        }
+    }
+    return more;
+}
+
+/**
+ * Calls the bpf() syscall
+ */
+static long bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Finds the xsk_t of an interface, adding one to the list if there isn't one
+ *
+ * @param name  The interface name
+ * @return      The xsk_t, or NULL if the interface can't be used
+ */
+static xsk_t *get_xsk(const char *name)
+{
+    xsk_t *xsk;
+
+    for (xsk = xsk_head; xsk != NULL; xsk = xsk->next) {
+        if (strcmp(xsk->iface.name, name) == 0) {
+            return xsk;
+        }
+    }
+
+    xsk = malloc(sizeof(xsk_t));
+    if (xsk == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    memset(xsk, 0, sizeof(xsk_t));
+    xsk->type = SOCKET_XSK;
+    xsk->fd = -1;
+    xsk->ports_map_fd = -1;
+    xsk->xsks_map_fd = -1;
+    xsk->prog_fd = -1;
+    xsk->link_fd = -1;
+    if (frame_get_iface(name, &xsk->iface) < 0) {
+        fprintf(stderr, "ERROR: Interface %s not found, or has no IPv4 address\n", name);
+        free(xsk);
+        return NULL;
+    }
+    xsk->next = xsk_head;
+    xsk_head = xsk;
+    return xsk;
+}
+
+/**
+ * Gives a target an xdp_path_t through its transmitter's interface. Frames
+ * are sent from the transmitter's address and port; an unbound transmitter
+ * socket is bound to an ephemeral port here, and the interface's address is
+ * used if the transmitter has none.
+ *
+ * @return 0 on success, -1 if the interface can't be used
+ */
+static int add_path(target_t *target, transmitter_t *transmitter)
+{
+    xdp_path_t          *path;
+    struct sockaddr_in  addr;
+    socklen_t           addrlen = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(transmitter->sockfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror("Getting transmitter address");
+        return -1;
+    }
+    if (addr.sin_port == 0) {
+        addr.sin_family = AF_INET;
+        if (bind(transmitter->sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+                getsockname(transmitter->sockfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+            perror("Binding transmitter");
+            return -1;
+        }
+    }
+
+    path = malloc(sizeof(xdp_path_t));
+    if (path == NULL) {
+        fprintf(stderr, "ERROR: malloc failed\n");
+        exit(1);
+    }
+    memset(path, 0, sizeof(xdp_path_t));
+    path->xsk = get_xsk(transmitter->interface);
+    if (path->xsk == NULL) {
+        free(path);
+        return -1;
+    }
+    path->src_ip    = ntohl(addr.sin_addr.s_addr);
+    path->src_port  = ntohs(addr.sin_port);
+    path->dst_ip    = target->address;
+    path->dst_port  = target->port;
+    if (path->src_ip == 0) {
+        path->src_ip = path->xsk->iface.address;
+    }
+    path_ready(path);
+    target->xdp = path;
+    return 0;
+}
+
+/**
+ * Opens the XSK socket of an interface on queue 0, with its four rings. The
+ * first socket (no owner) registers the UMEM; the others share the owner's.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int open_xsk(xsk_t *xsk, xsk_t *owner, xdp_mode_t mode)
+{
+    struct xdp_umem_reg     reg;
+    struct xdp_mmap_offsets offsets;
+    struct sockaddr_xdp     addr;
+    socklen_t               optlen = sizeof(offsets);
+    int                     size = XDP_RING_SIZE;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0) {
+        perror("Opening AF_XDP socket");
+        return -1;
+    }
+    if (owner == NULL) {
+        memset(&reg, 0, sizeof(reg));
+        reg.addr        = (uintptr_t)umem;
+        reg.len         = umem_len;
+        reg.chunk_size  = XDP_FRAME_SIZE;
+        reg.headroom    = 0;
+        if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+            perror("Setting XDP_UMEM_REG");
+            return -1;
+        }
+    }
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+            setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+            setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0 ||
+            (xsk->num_listeners > 0 && setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0)) {
+        perror("Setting the AF_XDP ring sizes");
+        return -1;
+    }
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) < 0) {
+        perror("Getting XDP_MMAP_OFFSETS");
+        return -1;
+    }
+    if (map_ring(xsk->fd, &xsk->fill, &offsets.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) < 0 ||
+            map_ring(xsk->fd, &xsk->comp, &offsets.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) < 0 ||
+            map_ring(xsk->fd, &xsk->tx, &offsets.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)) < 0 ||
+            (xsk->num_listeners > 0 &&
+             map_ring(xsk->fd, &xsk->rx, &offsets.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) < 0)) {
+        perror("Mapping the AF_XDP rings");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family    = AF_XDP;
+    addr.sxdp_ifindex   = xsk->iface.ifindex;
+    addr.sxdp_queue_id  = 0;
+    if (owner == NULL) {
+        addr.sxdp_flags = (mode == XDP_MODE_SKB) ? XDP_COPY : 0;
+    } else {
+        addr.sxdp_flags = XDP_SHARED_UMEM;
+        addr.sxdp_shared_umem_fd = owner->fd;
+    }
+    if (bind(xsk->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Binding AF_XDP socket to %s\n", xsk->iface.name);
+        perror("Binding");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Maps one ring of an XSK
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int map_ring(int fd, xdp_ring_t *ring, struct xdp_ring_offset *offsets, off_t pgoff, size_t desc_size)
+{
+    ring->map_len = offsets->desc + XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer  = (uint32_t *)((char *)ring->map + offsets->producer);
+    ring->consumer  = (uint32_t *)((char *)ring->map + offsets->consumer);
+    ring->descs     = (char *)ring->map + offsets->desc;
+    ring->local     = 0;
+    return 0;
+}
+
+/**
+ * Loads the XDP program for an interface, fills in its maps, and attaches it.
+ * The program redirects every unfragmented IPv4 UDP datagram (without IP
+ * options) for a listener's port and address to the XSK of the queue it
+ * arrived on, and passes everything else, including datagrams on queues
+ * without an XSK, on to the kernel.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int load_program(xsk_t *xsk, xdp_mode_t mode)
+{
+    union bpf_attr  attr;
+    uint32_t        key;
+    uint32_t        value;
+    static char     log[65536];
+
+    // Ports map: UDP port (network byte order) to listener address (network byte order) or PORT_ANY_ADDRESS
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type       = BPF_MAP_TYPE_ARRAY;
+    attr.key_size       = sizeof(uint32_t);
+    attr.value_size     = sizeof(uint32_t);
+    attr.max_entries    = 65536;
+    xsk->ports_map_fd = bpf(BPF_MAP_CREATE, &attr);
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type       = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size       = sizeof(uint32_t);
+    attr.value_size     = sizeof(uint32_t);
+    attr.max_entries    = 1;
+    xsk->xsks_map_fd = bpf(BPF_MAP_CREATE, &attr);
+    if (xsk->ports_map_fd < 0 || xsk->xsks_map_fd < 0) {
+        perror("Creating the XDP maps");
+        return -1;
+    }
+
+    // r6 = ctx, r7 = packet start; a failed check jumps to PASS
+#define PASS 34
+    struct bpf_insn insns[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),                  // 0
+        INSN(BPF_LDX | BPF_W | BPF_MEM, 7, 6, offsetof(struct xdp_md, data), 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, 3, 6, offsetof(struct xdp_md, data_end), 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 7, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, FRAME_HEADERS_SIZE),
+        INSN(BPF_JMP | BPF_JGT | BPF_X, 2, 3, PASS - 6, 0),             // 5: too short
+        INSN(BPF_LDX | BPF_H | BPF_MEM, 2, 7, 12, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, 2, 0, PASS - 8, htons(0x0800)), // 7: not IPv4
+        INSN(BPF_LDX | BPF_B | BPF_MEM, 2, 7, ETH_HEADER_SIZE, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, 2, 0, PASS - 10, 0x45),         // 9: IP options
+        INSN(BPF_LDX | BPF_B | BPF_MEM, 2, 7, ETH_HEADER_SIZE + 9, 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, 2, 0, PASS - 12, IPPROTO_UDP),  // 11: not UDP
+        INSN(BPF_LDX | BPF_H | BPF_MEM, 2, 7, ETH_HEADER_SIZE + 6, 0),
+        INSN(BPF_ALU64 | BPF_AND | BPF_K, 2, 0, 0, htons(0x3fff)),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, 2, 0, PASS - 15, 0),            // 14: fragment
+        INSN(BPF_LDX | BPF_H | BPF_MEM, 2, 7, ETH_HEADER_SIZE + IP_HEADER_SIZE + 2, 0),
+        INSN(BPF_STX | BPF_W | BPF_MEM, 10, 2, -4, 0),                  // Key = destination port
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, xsk->ports_map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, PASS - 23, 0),            // 22: no entry
+        INSN(BPF_LDX | BPF_W | BPF_MEM, 1, 0, 0, 0),
+        INSN(BPF_JMP32 | BPF_JEQ | BPF_K, 1, 0, PASS - 25, 0),          // 24: no listener
+        INSN(BPF_JMP32 | BPF_JEQ | BPF_K, 1, 0, 28 - 26, PORT_ANY_ADDRESS),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 7, ETH_HEADER_SIZE + 16, 0),
+        INSN(BPF_JMP32 | BPF_JNE | BPF_X, 1, 2, PASS - 28, 0),          // 27: other address
+        INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, xsk->xsks_map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),           // Passed on if the queue has no XSK
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),           // 34: PASS
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+#undef PASS
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type              = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type   = BPF_XDP;
+    attr.insns                  = (uintptr_t)insns;
+    attr.insn_cnt               = sizeof(insns) / sizeof(insns[0]);
+    attr.license                = (uintptr_t)"Apache-2.0";
+    attr.log_buf                = (uintptr_t)log;
+    attr.log_size               = sizeof(log);
+    attr.log_level              = 1;
+    log[0] = '\0';
+    xsk->prog_fd = bpf(BPF_PROG_LOAD, &attr);
+    if (xsk->prog_fd < 0) {
+        perror("Loading the XDP program");
+        fprintf(stderr, "%s\n", log);
+        return -1;
+    }
+
+    for (int i = 0; i < xsk->num_listeners; i++) {
+        key = htons(xsk->listeners[i]->port);
+        value = (xsk->listeners[i]->address == 0) ? PORT_ANY_ADDRESS : htonl(xsk->listeners[i]->address);
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = xsk->ports_map_fd;
+        attr.key    = (uintptr_t)&key;
+        attr.value  = (uintptr_t)&value;
+        attr.flags  = BPF_ANY;
+        if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+            perror("Updating the XDP ports map");
+            return -1;
+        }
+    }
+    key = 0;
+    value = xsk->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xsk->xsks_map_fd;
+    attr.key    = (uintptr_t)&key;
+    attr.value  = (uintptr_t)&value;
+    attr.flags  = BPF_ANY;
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        perror("Updating the XSK map");
+        return -1;
+    }
+
+    // The link detaches the program when the repeater exits
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = xsk->prog_fd;
+    attr.link_create.target_ifindex = xsk->iface.ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = (mode == XDP_MODE_SKB) ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+    xsk->link_fd = bpf(BPF_LINK_CREATE, &attr);
+    if (xsk->link_fd < 0) {
+        fprintf(stderr, "Attaching the XDP program to %s\n", xsk->iface.name);
+        perror("Attaching");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases everything xdp_init() set up, and takes the xdp_path_t away from
+ * every target, so they are sent to through their sockets
+ */
+static void teardown(void)
+{
+    xsk_t       *xsk;
+    target_t    *target;
+    xdp_ring_t  *rings[4];
+
+    for (target = path_targets; target != NULL; target = target->hh.next) {
+        free(target->xdp);
+        target->xdp = NULL;
+    }
+    while (xsk_head != NULL) {
+        xsk = xsk_head;
+        xsk_head = xsk->next;
+        if (xsk->link_fd >= 0) {
+            close(xsk->link_fd);
+        }
+        if (xsk->prog_fd >= 0) {
+            close(xsk->prog_fd);
+        }
+        if (xsk->ports_map_fd >= 0) {
+            close(xsk->ports_map_fd);
+        }
+        if (xsk->xsks_map_fd >= 0) {
+            close(xsk->xsks_map_fd);
+        }
+        rings[0] = &xsk->rx;
+        rings[1] = &xsk->tx;
+        rings[2] = &xsk->fill;
+        rings[3] = &xsk->comp;
+        for (int i = 0; i < 4; i++) {
+            if (rings[i]->map != NULL) {
+                munmap(rings[i]->map, rings[i]->map_len);
+            }
+        }
+        if (xsk->fd >= 0) {
+            close(xsk->fd);
+        }
+        free(xsk->listeners);
+        free(xsk);
+    }
+    if (umem != NULL) {
+        munmap(umem, umem_len);
+        umem = NULL;
+    }
+    num_free = 0;
+}
+
+/**
+ * Forwards up to budget frames from an XSK's RX ring
+ *
+ * @return true if the ring still has frames waiting
+ */
+static bool recv_frames(xsk_t *xsk, int budget)
+{
+    struct xdp_desc *desc;
+    uint32_t        avail;
+    uint32_t        n;
+
+    avail = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - xsk->rx.local;
+    n = (avail < (uint32_t)budget) ? avail : (uint32_t)budget;
+    for (uint32_t i = 0; i < n; i++) {
+        desc = &((struct xdp_desc *)xsk->rx.descs)[(xsk->rx.local + i) & XDP_RING_MASK];
+        forward_frame(xsk, desc->addr, desc->len);
+    }
+    xsk->rx.local += n;
+    __atomic_store_n(xsk->rx.consumer, xsk->rx.local, __ATOMIC_RELEASE);
+    return avail > n;
+}
+
+/**
+ * Looks up what a received frame matches in its listener's classifier and
+ * sends it to the target of every map it matches. The frame itself is rewritten and sent to
+ * the last target with a ready xdp_path_t; earlier ones get a copy.
+ *
+ * @param xsk   The XSK the frame arrived on
+ * @param addr  The frame's address in the UMEM
+ * @param len   The frame's length (bytes)
+ */
+static void forward_frame(xsk_t *xsk, uint64_t addr, uint32_t len)
+{
+    unsigned char       *frame = (unsigned char *)umem + addr;
+    const unsigned char *ip;
+    size_t              udp_len;
+    listener_t          *listener = NULL;
+    target_t            *target;
+    route_t             *route;
+    const match_t       *match;
+    udp_info_t          info;
+    int                 in_place = -1;
+    uint64_t            copy;
+    bool                sent;
+
+    if (len < ETH_HEADER_SIZE || !frame_parse_ip(frame + ETH_HEADER_SIZE, len - ETH_HEADER_SIZE, &info)) {
+        free_frames[num_free++] = addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        return;
+    }
+    for (int i = 0; i < xsk->num_listeners; i++) {
+        if (xsk->listeners[i]->port == info.dst_port &&
+                (xsk->listeners[i]->address == 0 || xsk->listeners[i]->address == info.dst_ip)) {
+            listener = xsk->listeners[i];
+            break;
+        }
+    }
+    if (listener == NULL) {
+        free_frames[num_free++] = addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        return;
+    }
+    listener->packets_received++;
+
+    // The stack never checks the checksum of these frames. The only exception
+    // is a veth device, where frames this host sent (in either XDP mode) carry
+    // just a partial checksum, left for offload, which can't be checked
+    ip = frame + ETH_HEADER_SIZE;
+    udp_len = info.payload_len + UDP_HEADER_SIZE;
+    if (!frame_udp_checksum_ok(ip, info.payload - UDP_HEADER_SIZE, udp_len) &&
+            !(xsk->iface.veth && frame_udp_checksum_partial(ip, info.payload - UDP_HEADER_SIZE, udp_len))) {
+        listener->packets_bad_checksum++;
+        free_frames[num_free++] = addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        return;
+    }
+
+#ifdef DEBUG
+    struct in_addr src_addr;
+    src_addr.s_addr = htonl(info.src_ip);
+    fprintf(stderr, "Received frame on listener ID: %d from %s:%d\n",
+            listener->id, inet_ntoa(src_addr), info.src_port);
+#endif
+
+    // The frame can be sent as is to the last target with a path, if the headers fit in front of the payload
+    match = classifier_match(listener, info.src_ip, info.src_port);
+    if (info.payload == frame + FRAME_HEADERS_SIZE) {
+        for (int r = match->num_routes - 1; r >= 0 && in_place < 0; r--) {
+            target = match->routes[r]->target;
+            if (target->xdp != NULL && path_ready(target->xdp)) {
+                in_place = r;
+            }
+        }
+    }
+
+    for (int r = 0; r < match->num_routes; r++) {
+        route = match->routes[r];
+        target = route->target;
+        sent = false;
+        if (r == in_place) {
+            sent = send_frame(target->xdp, addr, info.payload_len);
+            if (sent) {
+                addr = UINT64_MAX;
+            }
+        } else if (target->xdp != NULL && path_ready(target->xdp) && num_free > 0) {
+            copy = free_frames[--num_free];
+            memcpy(umem + copy + FRAME_HEADERS_SIZE, info.payload, info.payload_len);
+            sent = send_frame(target->xdp, copy, info.payload_len);
+            if (!sent) {
+                free_frames[num_free++] = copy;
+            }
+        }
+        // No path, or the TX ring is full
+        if (sent) {
+            listener->packets_forwarded++;
+        } else {
+            send_datagram(route, listener, info.payload, info.payload_len);
+        }
+    }
+
+    // The frame goes back to the free frames unless it is being sent
+    if (addr != UINT64_MAX) {
+        free_frames[num_free++] = addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    }
+}
+
+/**
+ * Checks whether frames can be sent on a path, looking the next hop's MAC
+ * address up if it is unknown (at most every XDP_RESOLVE_RETRY seconds) or
+ * due for a refresh
+ *
+ * @return true if the MAC address is known
+ */
+static bool path_ready(xdp_path_t *path)
+{
+    time_t now = time(NULL);
+
+    if (now < path->next_resolve) {
+        return path->resolved;
+    }
+    path->resolved = (frame_resolve_mac(&path->xsk->iface, path->dst_ip, path->dst_mac) == 0);
+    path->next_resolve = now + (path->resolved ? XDP_RESOLVE_REFRESH : XDP_RESOLVE_RETRY);
+    return path->resolved;
+}
+
+/**
+ * Writes the headers for a path in front of the payload in a frame, and puts
+ * the frame on the TX ring of the path's XSK
+ *
+ * @param path          The path to send on
+ * @param addr          The frame's address in the UMEM, the payload starts FRAME_HEADERS_SIZE in
+ * @param payload_len   The payload length (bytes)
+ * @return              true if queued, false if the TX ring is full
+ */
+static bool send_frame(xdp_path_t *path, uint64_t addr, size_t payload_len)
+{
+    xsk_t           *xsk = path->xsk;
+    struct xdp_desc *desc;
+
+    if (xsk->tx.local - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) >= XDP_RING_SIZE) {
+        return false;
+    }
+    frame_write_headers((unsigned char *)umem + addr, xsk->iface.mac, path->dst_mac,
+            path->src_ip, path->src_port, path->dst_ip, path->dst_port, payload_len, ip_id++);
+    desc = &((struct xdp_desc *)xsk->tx.descs)[xsk->tx.local & XDP_RING_MASK];
+    desc->addr      = addr;
+    desc->len       = FRAME_HEADERS_SIZE + payload_len;
+    desc->options   = 0;
+    xsk->tx.local++;
+    xsk->tx_pending++;
+    return true;
+}
+
+/**
+ * Takes the frames the kernel has finished sending back from an XSK's
+ * completion ring
+ */
+static void reclaim(xsk_t *xsk)
+{
+    uint32_t avail = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE) - xsk->comp.local;
+
+    for (uint32_t i = 0; i < avail; i++) {
+        free_frames[num_free++] = ((uint64_t *)xsk->comp.descs)[(xsk->comp.local + i) & XDP_RING_MASK] &
+            ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    }
+    xsk->comp.local += avail;
+    __atomic_store_n(xsk->comp.consumer, xsk->comp.local, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gives an XSK's fill ring as many free frames as it has room for, keeping
+ * XDP_TX_RESERVE frames back for copies
+ */
+static void refill(xsk_t *xsk)
+{
+    uint32_t space = XDP_RING_SIZE - (xsk->fill.local - __atomic_load_n(xsk->fill.consumer, __ATOMIC_ACQUIRE));
+
+    while (space > 0 && num_free > XDP_TX_RESERVE) {
+        ((uint64_t *)xsk->fill.descs)[xsk->fill.local & XDP_RING_MASK] = free_frames[--num_free];
+        xsk->fill.local++;
+        space--;
+    }
+    __atomic_store_n(xsk->fill.producer, xsk->fill.local, __ATOMIC_RELEASE);
+}
+
+/**
+ * Publishes an XSK's queued TX descriptors and wakes the kernel to send them.
+ * In copy mode each wakeup only sends a small batch, so the kernel is woken
+ * again for as long as it makes progress.
+ *
+ * @return true if descriptors are still waiting on the TX ring
+ */
+static bool kick(xsk_t *xsk)
+{
+    uint32_t consumer;
+    uint32_t last;
+
+    if (xsk->tx_pending > 0) {
+        __atomic_store_n(xsk->tx.producer, xsk->tx.local, __ATOMIC_RELEASE);
+        xsk->tx_pending = 0;
+    }
+    consumer = __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE);
+    while (consumer != xsk->tx.local) {
+        if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+                errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+            perror("ERROR: Waking AF_XDP TX");
+            break;
+        }
+        last = consumer;
+        consumer = __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE);
+        if (consumer == last) {
+            break;
+        }
+    }
+    return consumer != xsk->tx.local;
+}
@@ -0,0 +1,64 @@
+#!/usr/bin/perl -w
+use IO::Socket;
+use strict;
+
+# Tests for UDP Packet Repeater maps with CIDR source prefixes
+# Based on the configuration included in conf/example_cidr_rules.json
+#
+# Union Pacific Railroad
+
+{
+    # Source address of each test, and the target ports it should reach
+    my @tests = (
+        ["127.0.0.1",       [9010, 9013]],
+        ["127.1.9.9",       [9010, 9011, 9013]],
+        ["127.1.2.3",       [9010, 9011, 9012, 9013]],
+        ["127.2.0.5",       [9010, 9013, 9014]],
+        ["127.2.1.5",       [9010, 9013]],
+        ["127.1.2.130",     [9010, 9011, 9013, 9015]],
+        ["127.1.2.132",     [9010, 9011, 9013]],
+    );
+    my %targets;
+
+    # Create bound sockets for the targets
+    foreach my $port (9010 .. 9015) {
+        $targets{$port} = IO::Socket::INET->new(
+            Proto       => 'udp',
+            LocalAddr   => '127.0.0.1',
+            LocalPort   => $port
+        ) or die "Could not create socket $port: $!\n";
+        $targets{$port}->blocking(0);
+    }
+
+    # Send a test string from each source address
+    for (my $i = 0; $i < @tests; $i++) {
+        my $sock = IO::Socket::INET->new(
+            Proto       => 'udp',
+            LocalAddr   => $tests[$i][0],
+            PeerPort    => 8010,
+            PeerAddr    => '127.0.0.1'
+        ) or die "Could not create socket from $tests[$i][0]: $!\n";
+        $sock->send("TEST $i") or die "Send error: $!\n";
+        $sock->close();
+    }
+    sleep(1);
+
+    # Collect what each target received
+    my %received;
+    foreach my $port (keys %targets) {
+        my $result;
+        while (defined($targets{$port}->recv($result, 100))) {
+            $received{$result}{$port} = 1;
+        }
+    }
+
+    for (my $i = 0; $i < @tests; $i++) {
+        my $expected = join(",", @{$tests[$i][1]});
+        my $got = join(",", sort(keys %{$received{"TEST $i"} || {}}));
+        if ($got eq $expected) {
+            print "TEST " . ($i + 1) . " SUCCESS: $tests[$i][0] reached $got\n";
+        } else {
+            print "TEST " . ($i + 1) . " FAILURE: $tests[$i][0] reached \"$got\" (expected \"$expected\")\n";
+        }
+    }
+}
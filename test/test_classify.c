@@ -0,0 +1,437 @@
+/*
+ * test_classify.c
+ *
+ * Tests for the source classifier of the UDP Packet Repeater
+ *
+ * Builds classifiers from sets of maps, without sockets, and checks what
+ * each source matches against a scan of the maps in rules order. Run with
+ * "make test" in src/.
+ *
+ * Created 2026-10-16
+ *
+ * Union Pacific Railroad
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "classify.h"
+
+#define MAX_MAPS    64
+
+/*
+ * A listener shard with its maps, each with a route of its own, so the
+ * routes a source matches tell which maps it matched
+ */
+typedef struct test_listener_s
+{
+    listener_t          listener;
+    map_t               maps[MAX_MAPS];
+    route_t             routes[MAX_MAPS];
+} test_listener_t;
+
+static int failures = 0;
+
+/**
+ * Adds a map to a test listener, as create_map_range() would make it
+ *
+ * @param test          The test listener
+ * @param address       The source address (host byte order)
+ * @param prefix_len    The prefix length (0 for any address)
+ * @param port_first    The first source port (0 for any port)
+ * @param port_last     The last source port
+ */
+static void add_map(test_listener_t *test, uint32_t address, int prefix_len, uint16_t port_first, uint16_t port_last)
+{
+    map_t *map = &test->maps[test->listener.num_maps];
+
+    map->address = (prefix_len == 0) ? 0 : address & (0xFFFFFFFFu << (32 - prefix_len));
+    map->prefix_len = prefix_len;
+    map->port = port_first;
+    map->port_last = (port_first == 0) ? 0 : port_last;
+    map->route = &test->routes[test->listener.num_maps];
+    test->listener.maps = test->maps;
+    test->listener.num_maps++;
+}
+
+/**
+ * Checks what the classifier gave a source against a scan of the maps
+ *
+ * @param test      The test listener
+ * @param match     What the classifier gave the source
+ * @param src_ip    The source address (host byte order)
+ * @param src_port  The source port (host byte order)
+ * @return          true if match has the routes of the maps that match, in order
+ */
+static bool check_match(const test_listener_t *test, const match_t *match, uint32_t src_ip, uint16_t src_port)
+{
+    const map_t     *map;
+    int             found = 0;
+
+    for (int m = 0; m < test->listener.num_maps; m++) {
+        map = &test->maps[m];
+        if (map->prefix_len != 0 &&
+                ((src_ip ^ map->address) & (0xFFFFFFFFu << (32 - map->prefix_len))) != 0) {
+            continue;
+        }
+        if (map->port != 0 && (src_port < map->port || src_port > map->port_last)) {
+            continue;
+        }
+        if (found >= match->num_routes || match->routes[found] != map->route) {
+            return false;
+        }
+        found++;
+    }
+    return found == match->num_routes;
+}
+
+/**
+ * Checks what a source matches on a test listener against a scan of its maps
+ *
+ * @param test      The test listener, with its classifier built
+ * @param src_ip    The source address (host byte order)
+ * @param src_port  The source port (host byte order)
+ * @return          true if the classifier gave the routes of the maps that match, in order
+ */
+static bool check_source(test_listener_t *test, uint32_t src_ip, uint16_t src_port)
+{
+    return check_match(test, classifier_match(&test->listener, src_ip, src_port), src_ip, src_port);
+}
+
+/**
+ * Checks every pairing of some addresses and ports on a test listener,
+ * reporting the first source that doesn't match as it should
+ *
+ * @param name      The name of the test
+ * @param test      The test listener, with its classifier built
+ * @param addresses The source addresses to check
+ * @param ports     The source ports to check
+ * @return          true if every source matched as it should
+ */
+static bool check_sources(const char *name, test_listener_t *test,
+        const uint32_t *addresses, int num_addresses, const uint16_t *ports, int num_ports)
+{
+    for (int a = 0; a < num_addresses; a++) {
+        for (int p = 0; p < num_ports; p++) {
+            if (!check_source(test, addresses[a], ports[p])) {
+                printf("%s FAILURE: Wrong routes for %u.%u.%u.%u:%u\n", name,
+                        addresses[a] >> 24, (addresses[a] >> 16) & 0xFF, (addresses[a] >> 8) & 0xFF,
+                        addresses[a] & 0xFF, ports[p]);
+                failures++;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Overlapping exact and wildcard maps, including duplicates, so a source
+ * can match maps of every tier at once
+ */
+static void test_overlapping(void)
+{
+    static const uint32_t addresses[] = {0x0A000001, 0x0A000002, 0x0A000003, 0x0A000004};
+    static const uint16_t ports[] = {2000, 2001, 2002, 2003};
+    test_listener_t *test = calloc(1, sizeof(test_listener_t));
+
+    add_map(test, 0x0A000001, 32, 0, 0);
+    add_map(test, 0, 0, 2000, 2000);
+    add_map(test, 0x0A000001, 32, 2000, 2000);
+    add_map(test, 0x0A000001, 32, 2000, 2000);
+    add_map(test, 0, 0, 0, 0);
+    add_map(test, 0x0A000002, 32, 2001, 2001);
+    add_map(test, 0x0A000002, 32, 0, 0);
+    add_map(test, 0, 0, 2002, 2002);
+    add_map(test, 0x0A000001, 32, 0, 0);
+    add_map(test, 0, 0, 2000, 2000);
+    classifier_build(&test->listener);
+
+    // Twice, so the second pass is answered from the flow cache
+    for (int pass = 0; pass < 2; pass++) {
+        if (!check_sources("TEST overlapping", test, addresses, 4, ports, 4)) {
+            return;
+        }
+    }
+    printf("TEST overlapping SUCCESS\n");
+}
+
+/**
+ * Random sets of exact and wildcard maps, drawn from few addresses and ports
+ * so they overlap and repeat
+ */
+static void test_random(void)
+{
+    static const uint32_t addresses[] = {0x0A000001, 0x0A000002, 0x0A000003, 0xC0A80101, 0xC0A80102};
+    static const uint16_t ports[] = {2000, 2001, 2002, 2003, 40000};
+    test_listener_t *test;
+
+    srand(1);
+    for (int set = 0; set < 500; set++) {
+        test = calloc(1, sizeof(test_listener_t));
+        for (int m = rand() % MAX_MAPS; m >= 0; m--) {
+            if (rand() % 2) {
+                add_map(test, addresses[rand() % 4], 32, 0, 0);
+            } else {
+                add_map(test, 0, 0, 0, 0);
+            }
+            if (rand() % 2) {
+                test->maps[test->listener.num_maps - 1].port = ports[rand() % 4];
+                test->maps[test->listener.num_maps - 1].port_last = test->maps[test->listener.num_maps - 1].port;
+            }
+        }
+        classifier_build(&test->listener);
+        if (!check_sources("TEST random", test, addresses, 5, ports, 5)) {
+            return;
+        }
+    }
+    printf("TEST random SUCCESS\n");
+}
+
+/**
+ * Sources seen again are answered by the flow cache, once it has them
+ */
+static void test_flow_counts(void)
+{
+    test_listener_t *test = calloc(1, sizeof(test_listener_t));
+
+    add_map(test, 0x0A000001, 32, 0, 0);
+    add_map(test, 0, 0, 2000, 2000);
+    classifier_build(&test->listener);
+
+    for (int pass = 0; pass < 3; pass++) {
+        for (uint32_t a = 0; a < 200; a++) {
+            if (!check_source(test, 0x0A000000 + a, 2000)) {
+                printf("TEST flow counts FAILURE: Wrong routes for source %u\n", a);
+                failures++;
+                return;
+            }
+        }
+    }
+    if (test->listener.flow_misses != 200 || test->listener.flow_hits != 400) {
+        printf("TEST flow counts FAILURE: %lu hits and %lu misses (expected 400 and 200)\n",
+                (unsigned long)test->listener.flow_hits, (unsigned long)test->listener.flow_misses);
+        failures++;
+        return;
+    }
+    printf("TEST flow counts SUCCESS\n");
+}
+
+/**
+ * Far more sources than the flow cache holds: a source evicted and looked up
+ * again must get what the tiers gave it the first time, and a source hit
+ * between sources not seen before must never be evicted
+ */
+static void test_flow_eviction(void)
+{
+    enum { SOURCES = 5000 };
+    test_listener_t *test = calloc(1, sizeof(test_listener_t));
+    const match_t   **first = calloc(SOURCES, sizeof(match_t *));
+    const match_t   *hot;
+    const match_t   *match;
+    unsigned long   misses;
+
+    add_map(test, 0x0A000000, 32, 0, 0);
+    add_map(test, 0, 0, 2000, 2000);
+    add_map(test, 0x0A000000, 32, 2001, 2001);
+    add_map(test, 0, 0, 0, 0);
+    classifier_build(&test->listener);
+
+    hot = classifier_match(&test->listener, 0x0A000000, 2001);
+    for (int pass = 0; pass < 3; pass++) {
+        for (uint32_t s = 0; s < SOURCES; s++) {
+            uint32_t address = 0x0A000000 + s % 7;
+            uint16_t port = 1999 + s / 7;
+
+            // A source's first lookup misses, so gets what the tiers give it
+            if (pass == 0) {
+                first[s] = classifier_match(&test->listener, address, port);
+                if (!check_match(test, first[s], address, port)) {
+                    printf("TEST flow eviction FAILURE: Wrong routes for source %u\n", s);
+                    failures++;
+                    return;
+                }
+            } else {
+                match = classifier_match(&test->listener, address, port);
+                if (match != first[s]) {
+                    printf("TEST flow eviction FAILURE: Source %u changed match after eviction\n", s);
+                    failures++;
+                    return;
+                }
+            }
+            misses = test->listener.flow_misses;
+            if (classifier_match(&test->listener, 0x0A000000, 2001) != hot ||
+                    (pass == 0 && test->listener.flow_misses != misses)) {
+                printf("TEST flow eviction FAILURE: Hot source was evicted\n");
+                failures++;
+                return;
+            }
+        }
+    }
+    // Beyond the first lookups, some sources must have missed again after being evicted
+    misses = test->listener.flow_misses;
+    if (misses <= SOURCES + 1) {
+        printf("TEST flow eviction FAILURE: %lu misses for %d sources over 3 passes\n", misses, SOURCES);
+        failures++;
+        return;
+    }
+    printf("TEST flow eviction SUCCESS\n");
+}
+
+/**
+ * Nested prefixes from /0 to /32, prefixes ending inside a trie node, a
+ * prefix given with its host bits set (cleared by add_map(), as by
+ * create_map_range()), and a prefix of address 0 that is not the wildcard
+ */
+static void test_prefixes(void)
+{
+    static const uint32_t addresses[] = {
+        0x00000000, 0x00000001, 0x00FFFFFF, 0x01000000,     // In and around 0.0.0.0/8
+        0x09FFFFFF, 0x0A000000, 0x0A00FFFF, 0x0AFFFFFF,     // Around and in 10.0.0.0/8
+        0x0A010000, 0x0A0101FF, 0x0A010203, 0x0A010204,     // In 10.1.0.0/16, at 10.1.2.3/32
+        0x0A01023F, 0x0A010240, 0x0A01027F, 0x0A010280,     // Either side of 10.1.2.64/26
+        0x0A010281, 0x0A010282, 0x0A0102FE, 0x0A0102FF,     // Either side of 10.1.2.128/31 and /25
+        0x0A010300, 0x0A01034D, 0x0A0103FF, 0x0A010400,     // Either side of 10.1.3.77/24
+        0x0B000000, 0xC0A80101, 0xFFFFFFFF, 0x80000000      // Outside every prefix but /0 and /1
+    };
+    static const uint16_t ports[] = {2000, 2001, 2002};
+    test_listener_t *test = calloc(1, sizeof(test_listener_t));
+
+    add_map(test, 0x0A000000, 8, 0, 0);
+    add_map(test, 0x0A010000, 16, 0, 0);
+    add_map(test, 0x0A010203, 32, 0, 0);
+    add_map(test, 0, 0, 0, 0);
+    add_map(test, 0x0A010240, 26, 2001, 2001);
+    add_map(test, 0x0A010280, 31, 0, 0);
+    add_map(test, 0x0A010280, 25, 2000, 2000);
+    add_map(test, 0x0A01034D, 24, 0, 0);
+    add_map(test, 0x00000000, 8, 2002, 2002);
+    add_map(test, 0x80000000, 1, 0, 0);
+    add_map(test, 0, 0, 2001, 2001);
+    add_map(test, 0x0A010000, 16, 2000, 2000);
+    classifier_build(&test->listener);
+
+    if (!check_sources("TEST prefixes", test, addresses, 28, ports, 3)) {
+        return;
+    }
+    printf("TEST prefixes SUCCESS\n");
+}
+
+/**
+ * Random sets of nested and apart prefixes of every length, checked at
+ * random addresses in and around them
+ */
+static void test_random_prefixes(void)
+{
+    static const uint32_t bases[] = {0x00000000, 0x0A000000, 0x0A010000, 0x0A010200, 0xC0A80100, 0xFFFFFF00};
+    static const uint16_t ports[] = {2000, 2001};
+    uint32_t        addresses[64];
+    test_listener_t *test;
+
+    srand(2);
+    for (int set = 0; set < 500; set++) {
+        test = calloc(1, sizeof(test_listener_t));
+        for (int m = rand() % MAX_MAPS; m >= 0; m--) {
+            add_map(test, bases[rand() % 6] | (rand() & 0xFFFF), rand() % 33, 0, 0);
+            if (rand() % 2) {
+                test->maps[test->listener.num_maps - 1].port = ports[rand() % 2];
+                test->maps[test->listener.num_maps - 1].port_last = test->maps[test->listener.num_maps - 1].port;
+            }
+        }
+        for (int a = 0; a < 64; a++) {
+            addresses[a] = bases[rand() % 6] | (rand() & ((rand() % 2) ? 0xFF : 0xFFFF));
+        }
+        classifier_build(&test->listener);
+        if (!check_sources("TEST random prefixes", test, addresses, 64, ports, 2)) {
+            return;
+        }
+    }
+    printf("TEST random prefixes SUCCESS\n");
+}
+
+/**
+ * Overlapping port ranges, a range ending at 65535, and a single port inside
+ * a wider range, with and without prefixes
+ */
+static void test_port_ranges(void)
+{
+    static const uint32_t addresses[] = {0x0A000001, 0x0A000002, 0x0A010001};
+    static const uint16_t ports[] = {
+        1025, 19999, 20000, 20499, 20500, 20699, 20700, 20701, 20999, 21000,
+        21499, 21500, 64999, 65000, 65534, 65535
+    };
+    test_listener_t *test = calloc(1, sizeof(test_listener_t));
+
+    add_map(test, 0, 0, 20000, 20999);
+    add_map(test, 0, 0, 20500, 21499);
+    add_map(test, 0, 0, 20700, 20700);
+    add_map(test, 0, 0, 65000, 65535);
+    add_map(test, 0x0A000000, 16, 20000, 20700);
+    add_map(test, 0x0A000001, 32, 0, 0);
+    add_map(test, 0x0A000002, 32, 21000, 65535);
+    add_map(test, 0x0A000000, 8, 0, 0);
+    add_map(test, 0, 0, 20700, 20700);
+    classifier_build(&test->listener);
+
+    // Twice, so the second pass is answered from the flow cache
+    for (int pass = 0; pass < 2; pass++) {
+        if (!check_sources("TEST port ranges", test, addresses, 3, ports, 16)) {
+            return;
+        }
+    }
+    printf("TEST port ranges SUCCESS\n");
+}
+
+/**
+ * Random sets of port ranges and prefixes, checked at every port where a
+ * range starts or ends, and either side of it
+ */
+static void test_random_ranges(void)
+{
+    static const uint32_t addresses[] = {0x0A000001, 0x0A000002, 0x0A010001, 0xC0A80101};
+    uint16_t        ports[3 * 2 * MAX_MAPS];
+    int             num_ports;
+    uint16_t        first;
+    test_listener_t *test;
+
+    srand(3);
+    for (int set = 0; set < 500; set++) {
+        test = calloc(1, sizeof(test_listener_t));
+        num_ports = 0;
+        for (int m = rand() % MAX_MAPS; m >= 0; m--) {
+            first = (rand() % 8 == 0) ? 0 : 65535 - rand() % 100;
+            if (first != 0 && rand() % 2) {
+                first = 2000 + rand() % 100;
+            }
+            add_map(test, addresses[rand() % 3], (rand() % 2) ? 32 : rand() % 17,
+                    first, (rand() % 4 == 0) ? 65535 : first + rand() % 20);
+            if (test->maps[test->listener.num_maps - 1].port_last < first) {
+                test->maps[test->listener.num_maps - 1].port_last = 65535;
+            }
+            for (int p = -1; p <= 1 && first != 0; p++) {
+                ports[num_ports++] = first + p;
+                ports[num_ports++] = test->maps[test->listener.num_maps - 1].port_last + p;
+            }
+        }
+        classifier_build(&test->listener);
+        if (!check_sources("TEST random ranges", test, addresses, 4, ports, num_ports)) {
+            return;
+        }
+    }
+    printf("TEST random ranges SUCCESS\n");
+}
+
+int main(void)
+{
+    test_overlapping();
+    test_random();
+    test_flow_counts();
+    test_flow_eviction();
+    test_prefixes();
+    test_random_prefixes();
+    test_port_ranges();
+    test_random_ranges();
+    return (failures > 0) ? 1 : 0;
+}
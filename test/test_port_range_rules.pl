@@ -0,0 +1,67 @@
+#!/usr/bin/perl -w
+use IO::Socket;
+use strict;
+
+# Tests for UDP Packet Repeater maps with source port ranges
+# Based on the configuration included in conf/example_port_range_rules.json
+#
+# Union Pacific Railroad
+
+{
+    # Source address and port of each test, and the target ports it should reach
+    my @tests = (
+        ["127.0.0.1",   20000,  [9020]],
+        ["127.0.0.1",   20600,  [9020, 9021]],
+        ["127.0.0.1",   20700,  [9020, 9021, 9022]],
+        ["127.0.0.1",   21000,  [9021]],
+        ["127.0.0.1",   21500,  []],
+        ["127.0.0.1",   65000,  [9023]],
+        ["127.0.0.1",   65535,  [9023]],
+        ["127.0.0.2",   20050,  [9020, 9024]],
+        ["127.0.0.2",   20100,  [9020]],
+    );
+    my %targets;
+
+    # Create bound sockets for the targets
+    foreach my $port (9020 .. 9024) {
+        $targets{$port} = IO::Socket::INET->new(
+            Proto       => 'udp',
+            LocalAddr   => '127.0.0.1',
+            LocalPort   => $port
+        ) or die "Could not create socket $port: $!\n";
+        $targets{$port}->blocking(0);
+    }
+
+    # Send a test string from each source address and port
+    for (my $i = 0; $i < @tests; $i++) {
+        my $sock = IO::Socket::INET->new(
+            Proto       => 'udp',
+            LocalAddr   => $tests[$i][0],
+            LocalPort   => $tests[$i][1],
+            PeerPort    => 8011,
+            PeerAddr    => '127.0.0.1'
+        ) or die "Could not create socket from $tests[$i][0]:$tests[$i][1]: $!\n";
+        $sock->send("TEST $i") or die "Send error: $!\n";
+        $sock->close();
+    }
+    sleep(1);
+
+    # Collect what each target received
+    my %received;
+    foreach my $port (keys %targets) {
+        my $result;
+        while (defined($targets{$port}->recv($result, 100))) {
+            $received{$result}{$port} = 1;
+        }
+    }
+
+    for (my $i = 0; $i < @tests; $i++) {
+        my $expected = join(",", @{$tests[$i][2]});
+        my $got = join(",", sort(keys %{$received{"TEST $i"} || {}}));
+        if ($got eq $expected) {
+            print "TEST " . ($i + 1) . " SUCCESS: $tests[$i][0]:$tests[$i][1] reached \"$got\"\n";
+        } else {
+            print "TEST " . ($i + 1) . " FAILURE: $tests[$i][0]:$tests[$i][1] reached \"$got\" (expected \"$expected\")\n";
+        }
+    }
+}